@@ -0,0 +1,359 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  annotate
+// C++ version of util/filter_intersect.sh and util/assign_strand.sh, in
+// one pass over a HAMR output table and without bedtools:
+//   --exclude=FILE        drop sites inside any interval of FILE
+//                           (filter_intersect.sh)
+//   --assign-strand=FILE  give each site the strand of the intervals
+//                           (transcripts) of FILE it falls in, dropping
+//                           sites in none or in intervals on both
+//                           strands; sites put on the - strand get the
+//                           complemented refnuc and counts
+//                           (assign_strand.sh)
+// Both can be given; sites are excluded before strands are assigned.
+// As in the scripts, sites are matched by chr and bp only, so both
+// strands of a site are treated alike, and the annotation is read in
+// file order (an interval with strand "." clears the strands seen so
+// far at a site). Refnucs other than A, C, G and T are kept as they are
+// when complementing, where the script would blank them.
+//
+// Annotation files are BED (zero-based, half-open) or, when named
+// *.gff, *.gff3 or *.gtf, GFF (one-based, inclusive). Intervals are
+// kept per chromosome sorted by start, and the table is swept in order:
+// intervals join an active list when a site reaches their start and
+// leave it once a site is past their end. The table is expected to be
+// sorted by bp within each chromosome, as detect_mods and call write
+// it; otherwise each step back restarts the sweep of the chromosome.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "hamr.h"
+#include "output.h"
+#include "metrics.h"
+
+using namespace std;
+
+struct Interval {
+  int start;
+  int end;
+  char strand;
+  // line in the annotation file, for visiting overlaps in file order
+  unsigned long order;
+};
+
+struct IntervalStartLess {
+  bool operator()(const Interval &a, const Interval &b) const {
+    return a.start < b.start;
+  }
+};
+
+struct IntervalOrderLess {
+  bool operator()(const Interval *a, const Interval *b) const {
+    return a->order < b->order;
+  }
+};
+
+static bool ends_with(const string &s, const string &suffix) {
+  return s.size() >= suffix.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// the intervals of a BED or GFF file, and the sweep over them
+class IntervalIndex {
+  map<string, vector<Interval> > chrs;
+
+  // sweep state
+  const vector<Interval> *curr;
+  string curr_chr;
+  int last_bp;
+  size_t next;
+  vector<const Interval *> active;
+
+public:
+  unsigned long restarts;
+
+  IntervalIndex() : curr(NULL), last_bp(0), next(0), restarts(0) { }
+
+  // returns false (and prints a message) on error
+  bool load(const string &fn) {
+    ifstream in(fn.c_str());
+    if (!in.is_open()) {
+      cerr << "ERROR: Could not open annotation " << fn << "\n";
+      return false;
+    }
+    bool gff = ends_with(fn, ".gff") || ends_with(fn, ".gff3") ||
+      ends_with(fn, ".gtf");
+    size_t chr_col = 0, start_col = gff ? 3 : 1, end_col = gff ? 4 : 2,
+      strand_col = gff ? 6 : 5;
+
+    string line;
+    vector<string> fields;
+    unsigned long line_num = 0;
+    while (getline(in, line)) {
+      ++line_num;
+      if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0
+	  || line.compare(0, 7, "browser") == 0)
+	continue;
+      split_tabs(line, fields);
+      Interval iv;
+      bool start_ok = false, end_ok = false;
+      if (fields.size() > end_col) {
+	iv.start = from_s<int>(fields[start_col], start_ok);
+	iv.end = from_s<int>(fields[end_col], end_ok);
+      }
+      if (!start_ok || !end_ok) {
+	cerr << "ERROR: malformed line " << line_num << " in " << fn << "\n";
+	return false;
+      }
+      if (gff)
+	--iv.start;
+      iv.strand = (fields.size() > strand_col && fields[strand_col].size() == 1)
+	? fields[strand_col][0] : ' ';
+      iv.order = line_num;
+      chrs[fields[chr_col]].push_back(iv);
+    }
+    for (map<string, vector<Interval> >::iterator it = chrs.begin();
+	 it != chrs.end(); ++it)
+      stable_sort(it->second.begin(), it->second.end(), IntervalStartLess());
+    return true;
+  }
+
+  // the intervals containing bp, in file order
+  const vector<const Interval *> &overlaps(const string &chr, int bp) {
+    if (curr == NULL || chr != curr_chr || bp < last_bp) {
+      if (curr != NULL && chr == curr_chr)
+	++restarts;
+      map<string, vector<Interval> >::const_iterator it = chrs.find(chr);
+      static const vector<Interval> none;
+      curr = (it != chrs.end()) ? &it->second : &none;
+      curr_chr = chr;
+      next = 0;
+      active.clear();
+    }
+    last_bp = bp;
+
+    // intervals starting by bp become active; those ending by it are done
+    bool added = false;
+    for (; next < curr->size() && (*curr)[next].start <= bp; ++next) {
+      active.push_back(&(*curr)[next]);
+      added = true;
+    }
+    size_t n = 0;
+    for (size_t i=0; i < active.size(); ++i)
+      if (active[i]->end > bp)
+	active[n++] = active[i];
+    active.resize(n);
+    if (added)
+      sort(active.begin(), active.end(), IntervalOrderLess());
+    return active;
+  }
+};
+
+static void print_annotate_usage(const vector<string> &args) {
+  cerr << "USAGE: " << args[0] << " [OPTIONS] mods.txt\n"
+       << "    filters a HAMR output table (- for stdin) by annotation\n\n"
+       << "    OPTIONS:\n"
+       << "      --exclude=FILE         Drop sites inside intervals of a BED or\n"
+       << "                               GFF file (util/filter_intersect.sh)\n"
+       << "      --assign-strand=FILE   Set strands from the transcripts of a BED\n"
+       << "                               or GFF file, dropping sites outside them\n"
+       << "                               or on both strands\n"
+       << "                               (util/assign_strand.sh)\n";
+  print_metrics_options();
+}
+
+static char complement(char c) {
+  switch(c) {
+  case 'A': return 'T';
+  case 'C': return 'G';
+  case 'G': return 'C';
+  case 'T': return 'A';
+  }
+  return c;
+}
+
+int annotate_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  string exclude_fn, strand_fn;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("annotate");
+
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    bool invalid = false;
+
+    if (parse_metrics_option(it->first, it->second, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (it->first == "--exclude") {
+      exclude_fn = it->second;
+
+    } else if (it->first == "--assign-strand") {
+      strand_fn = it->second;
+    }
+  }
+
+  if (positional_args.size() < 2 || (exclude_fn.empty() && strand_fn.empty())) {
+    print_annotate_usage(args);
+    return(1);
+  }
+
+  string in_fn = positional_args[1];
+
+  IntervalIndex exclude, strands;
+  double load_time = metrics_now();
+  if ((!exclude_fn.empty() && !exclude.load(exclude_fn)) ||
+      (!strand_fn.empty() && !strands.load(strand_fn)))
+    return(1);
+  load_time = metrics_now() - load_time;
+
+  // read from stdin or a file
+  istream* p_infile;
+  ifstream* p_in = NULL;
+  if (in_fn != "-") {
+    p_in = new ifstream(in_fn.c_str());
+    if (!p_in->is_open()) {
+      cerr << "ERROR: Could not open file " << in_fn << "\n";
+      delete p_in;
+      return(1);
+    }
+    p_infile = p_in;
+  }
+  else
+    p_infile = &cin;
+
+  istream& infile = (*p_infile);
+
+  OutputWriter output;
+  OutputOptions out_opts;
+  if (!output.open("-", out_opts)) {
+    delete p_in;
+    return(1);
+  }
+
+  string line;
+  vector<string> fields;
+  unsigned long line_num = 0, n_sites = 0, n_excluded = 0, n_no_strand = 0,
+    n_flipped = 0;
+  ProgressMeter progress(metrics_opts.progress_interval, "rows");
+  double sweep_time = metrics_now();
+  bool ok = true;
+  // the header
+  if (getline(infile, line)) {
+    ++line_num;
+    output.put(line);
+    output.put('\n');
+  }
+  while (getline(infile, line)) {
+    ++line_num;
+    if ((line_num & 0xffff) == 0)
+      progress.update(line_num, fields.empty() ? "" : fields[0]);
+    if (line.empty())
+      continue;
+    split_tabs(line, fields);
+    bool conv_success = false;
+    int bp = 0;
+    if (fields.size() >= 8)
+      bp = from_s<int>(fields[1], conv_success);
+    if (!conv_success) {
+      cerr << "ERROR: malformed line " << line_num << " in " << in_fn << "\n";
+      ok = false;
+      break;
+    }
+    ++n_sites;
+
+    if (!exclude_fn.empty() && !exclude.overlaps(fields[0], bp).empty()) {
+      ++n_excluded;
+      continue;
+    }
+
+    if (!strand_fn.empty()) {
+      const vector<const Interval *> &tx = strands.overlaps(fields[0], bp);
+      int seen = 0;
+      for (size_t i=0; i < tx.size(); ++i) {
+	if (tx[i]->strand == '+')
+	  seen |= 1;
+	else if (tx[i]->strand == '-')
+	  seen |= 2;
+	else if (tx[i]->strand == '.')
+	  seen = 0;
+      }
+      if (seen != 1 && seen != 2) {
+	++n_no_strand;
+	continue;
+      }
+      if (seen == 1) {
+	fields[2] = "+";
+      } else {
+	// the reverse complement: refnuc and counts A<->T, C<->G
+	fields[2] = "-";
+	if (fields[3].size() == 1)
+	  fields[3][0] = complement(fields[3][0]);
+	swap(fields[4], fields[7]);
+	swap(fields[5], fields[6]);
+	++n_flipped;
+      }
+      for (size_t i=0; i < fields.size(); ++i) {
+	if (i > 0)
+	  output.put('\t');
+	output.put(fields[i]);
+      }
+      output.put('\n');
+    } else {
+      output.put(line);
+      output.put('\n');
+    }
+  }
+  delete p_in;
+  sweep_time = metrics_now() - sweep_time;
+  if (!output.close() || !ok)
+    return(1);
+
+  if (exclude.restarts + strands.restarts > 0)
+    cerr << "WARNING: " << in_fn << " is not sorted by position; "
+	 << "annotation was slower\n";
+  cerr << "  Sites: " << n_sites << "\n";
+  if (!exclude_fn.empty())
+    cerr << "  Excluded by " << exclude_fn << ": " << n_excluded << "\n";
+  if (!strand_fn.empty())
+    cerr << "  Without a single strand in " << strand_fn << ": "
+	 << n_no_strand << "\n"
+	 << "  Put on the - strand: " << n_flipped << "\n";
+
+  metrics.set("rows", "sites", n_sites);
+  metrics.set("rows", "excluded", n_excluded);
+  metrics.set("rows", "no_strand", n_no_strand);
+  metrics.set("rows", "minus_strand", n_flipped);
+  metrics.set("timers_s", "load", load_time);
+  metrics.set("timers_s", "sweep", sweep_time);
+  return metrics.write_json(metrics_opts.json_fn) ? 0 : 1;
+}
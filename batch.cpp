@@ -0,0 +1,366 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  batch
+// Piles up several samples (BAM files aligned to the same genome) in one
+// pass over the reference: the reads of all samples are merged by
+// coordinate, so the reference is read once for the whole batch rather
+// than once per sample. Each sample gets its own output
+// (PREFIX<sample>.rnapileup or PREFIX<sample>_mismatches.bed), or all of
+// them go into one wide nucleotide frequency table:
+//   chr bp strand refnuc  then A C G T nonref for each sample
+// with a row for each site and strand where any sample has mismatches.
+// Samples without a site there that passes the filters (too few reads,
+// or none) get NA in all five columns.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <climits>
+#include <cstring>
+
+#include "hamr.h"
+#include "pileup.h"
+#include "stats.h"
+#include "output.h"
+#include "metrics.h"
+
+using namespace std;
+
+// lines the sites of every sample up into the rows of the wide table
+class JointTableWriter : public PileupSync {
+  // one site of a sample, waiting for the others
+  struct SampleSite {
+    int pos;
+    NucFreqRow rows[2];
+    bool mismatch[2];
+  };
+
+  // collects the sites of one sample
+  class SampleCollector : public SiteVisitor {
+  public:
+    deque<SampleSite> sites;
+
+    bool use_counts() const { return true; }
+
+    void visit_counts(const string &ref_id, const SiteCounts &site) {
+      SampleSite s;
+      s.pos = site.pos;
+      s.mismatch[0] = site_nuc_freq_row(site, '+', s.rows[0]);
+      s.mismatch[1] = site_nuc_freq_row(site, '-', s.rows[1]);
+      sites.push_back(s);
+    }
+  };
+
+  OutputBuffer &out;
+  vector<SampleCollector *> samples;
+  // samples with a site at the position being written
+  vector<const SampleSite *> at_pos;
+
+public:
+  unsigned long rows_written;
+
+  JointTableWriter(OutputBuffer &out, const vector<string> &names) :
+    out(out), samples(names.size()), at_pos(names.size()),
+    rows_written(0) {
+    out.put("chr\tbp\tstrand\trefnuc");
+    for (size_t i=0; i < names.size(); ++i) {
+      samples[i] = new SampleCollector;
+      const char *cols[] = { ".A", ".C", ".G", ".T", ".nonref" };
+      for (int c=0; c < 5; ++c) {
+	out.put('\t');
+	out.put(names[i]);
+	out.put(cols[c], strlen(cols[c]));
+      }
+    }
+    out.put('\n');
+  }
+
+  ~JointTableWriter() {
+    for (size_t i=0; i < samples.size(); ++i)
+      delete samples[i];
+  }
+
+  // the visitor for sample i
+  SiteVisitor *sample(size_t i) { return samples[i]; }
+
+  // every queued site is complete: write them in position order
+  void sync(const string &ref_id, int pos) {
+    for (;;) {
+      int next = INT_MAX;
+      for (size_t i=0; i < samples.size(); ++i)
+	if (!samples[i]->sites.empty() && samples[i]->sites.front().pos < next)
+	  next = samples[i]->sites.front().pos;
+      if (next == INT_MAX)
+	break;
+
+      const SampleSite *first = NULL;
+      bool mismatch[2] = { false, false };
+      for (size_t i=0; i < samples.size(); ++i) {
+	at_pos[i] = NULL;
+	if (!samples[i]->sites.empty() && samples[i]->sites.front().pos == next) {
+	  at_pos[i] = &samples[i]->sites.front();
+	  if (first == NULL)
+	    first = at_pos[i];
+	  mismatch[0] |= at_pos[i]->mismatch[0];
+	  mismatch[1] |= at_pos[i]->mismatch[1];
+	}
+      }
+
+      // + strand before - strand, as hamr_cmd call orders them
+      for (int strand=0; strand < 2; ++strand)
+	if (mismatch[strand])
+	  write_row(ref_id, first->rows[strand], strand);
+
+      for (size_t i=0; i < samples.size(); ++i)
+	if (at_pos[i] != NULL)
+	  samples[i]->sites.pop_front();
+    }
+  }
+
+private:
+  void write_row(const string &ref_id, const NucFreqRow &row, int strand) {
+    out.put(ref_id);
+    out.put('\t');
+    out.put_uint(row.bp);
+    out.put('\t');
+    out.put(row.strand);
+    out.put('\t');
+    out.put(row.refnuc);
+    for (size_t i=0; i < samples.size(); ++i) {
+      // samples without the site failed the filters there (possibly
+      // for having no reads at all), which is not the same as 0 reads
+      if (at_pos[i] == NULL) {
+	out.put("\tNA\tNA\tNA\tNA\tNA", 15);
+	continue;
+      }
+      const NucFreqRow &r = at_pos[i]->rows[strand];
+      for (int c=0; c < 4; ++c) {
+	out.put('\t');
+	out.put_uint(r.counts[c]);
+      }
+      out.put('\t');
+      out.put_uint(r.nonref);
+    }
+    out.put('\n');
+    ++rows_written;
+  }
+};
+
+// sample name from a BAM file name: its base name without .bam
+// ("stdin" for -)
+static string sample_name(const string &bam_fn) {
+  if (bam_fn == "-")
+    return "stdin";
+  string name(bam_fn);
+  size_t slash = name.rfind('/');
+  if (slash != string::npos)
+    name.erase(0, slash + 1);
+  if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bam") == 0)
+    name.erase(name.size() - 4);
+  return name;
+}
+
+static void print_batch_usage(const vector<string> &args,
+			      bool options_only=false) {
+  if (!options_only) {
+    cerr << "USAGE: " << args[0] << " [OPTIONS] genome.fasta reads1.bam reads2.bam ...\n"
+	 << "    piles up all samples in one pass over the reference\n\n"
+	 << "    OPTIONS:\n";
+  }
+  print_pileup_options();
+  cerr   << "      --output-format=FMT    table: one wide nucleotide frequency table\n"
+	 << "                               of all samples, on stdout, with NA for\n"
+	 << "                               samples whose site failed the filters\n"
+	 << "                               (e.g. --min-coverage); rnapileup,\n"
+	 << "                               mismatchbed or nucfreq: a file per\n"
+	 << "                               sample (table)\n"
+	 << "      --output-prefix=PREFIX Per-sample outputs go to PREFIX<sample>.rnapileup,\n"
+	 << "                               PREFIX<sample>_mismatches.bed or\n"
+	 << "                               PREFIX<sample>_mismatches_sorted.txt\n"
+	 << "      --sample-names=A,B,... Sample names, in the order of the BAM files\n"
+	 << "                               (BAM file names without .bam)\n";
+  if (!options_only) {
+    print_output_options();
+    print_metrics_options();
+  }
+}
+
+int batch_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  PileupOptions opts;
+  OutputOptions out_opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("batch");
+  string output_format("table"), output_prefix, sample_names;
+
+  // collect and validate command line arguments
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    string key = it->first;
+    string value = it->second;
+    bool invalid = false;
+
+    if (parse_pileup_option(key, value, opts, invalid) ||
+	parse_output_option(key, value, out_opts, invalid) ||
+	parse_metrics_option(key, value, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (key == "--output-format") {
+      output_format = value;
+      if (output_format != "table" && output_format != "rnapileup" &&
+	  output_format != "mismatchbed" && output_format != "nucfreq") {
+	cerr << "Invalid value for --output-format: " << value
+	     << "; must be table, rnapileup, mismatchbed or nucfreq\n";
+	return(1);
+      }
+
+    } else if (key == "--output-prefix") {
+      output_prefix = value;
+
+    } else if (key == "--sample-names") {
+      sample_names = value;
+
+    } else if (key == "--list-options") {
+      print_batch_usage(args, true);
+      return(0);
+    }
+  }
+
+  if (positional_args.size() < 3) {
+    print_batch_usage(args);
+    return(1);
+  }
+
+  string fas_fn( positional_args[1] );
+  vector<string> bam_fns(positional_args.begin() + 2, positional_args.end());
+
+  vector<string> names;
+  if (sample_names.empty()) {
+    for (size_t i=0; i < bam_fns.size(); ++i)
+      names.push_back(sample_name(bam_fns[i]));
+  } else {
+    istringstream s(sample_names);
+    string name;
+    while (getline(s, name, ','))
+      names.push_back(name);
+    if (names.size() != bam_fns.size()) {
+      cerr << "ERROR: --sample-names gives " << names.size()
+	   << " names for " << bam_fns.size() << " BAM files\n";
+      return(1);
+    }
+  }
+  if (set<string>(names.begin(), names.end()).size() != names.size()) {
+    cerr << "ERROR: sample names must be unique; use --sample-names\n";
+    return(1);
+  }
+
+  if (output_format != "table" && output_prefix.empty()) {
+    cerr << "ERROR: --output-format=" << output_format
+	 << " writes a file per sample and needs --output-prefix\n";
+    return(1);
+  }
+  if (!opts.regions_fn.empty()) {
+    cerr << "ERROR: --regions isn't supported in batch mode\n";
+    return(1);
+  }
+  if (opts.threads > 1)
+    cerr << "WARNING: --threads is ignored in batch mode, where each "
+	 << "BAM file is decoded on its own thread\n";
+
+  // output supplied arguments
+  for (size_t i=0; i < bam_fns.size(); ++i)
+    cerr << "  Processing BAM file " << bam_fns[i] << " as sample "
+	 << names[i] << "\n";
+  cerr << "  Using genome fasta file " << fas_fn << "\n";
+  print_pileup_settings(opts);
+  opts.timing = metrics_opts.enabled();
+  opts.progress_interval = metrics_opts.progress_interval;
+
+  vector<SiteVisitor *> visitors;
+  vector<OutputWriter *> outputs;
+  JointTableWriter *table = NULL;
+  int status = 0;
+  if (output_format == "table") {
+    outputs.push_back(new OutputWriter);
+    if (!outputs[0]->open("-", out_opts))
+      status = 1;
+    table = new JointTableWriter(*outputs[0], names);
+    for (size_t i=0; i < names.size(); ++i)
+      visitors.push_back(table->sample(i));
+  } else {
+    string ext = (output_format == "rnapileup") ? ".rnapileup" :
+      (output_format == "nucfreq") ? "_mismatches_sorted.txt" :
+      "_mismatches.bed";
+    if (out_opts.bgzf)
+      ext += ".gz";
+    for (size_t i=0; i < names.size() && status == 0; ++i) {
+      outputs.push_back(new OutputWriter);
+      if (!outputs[i]->open(output_prefix + names[i] + ext, out_opts))
+	status = 1;
+      visitors.push_back(new_text_writer(output_format, *outputs[i]));
+    }
+  }
+
+  vector<PileupStats> stats;
+  if (status == 0)
+    status = run_multi_pileup(bam_fns, fas_fn, opts, visitors, stats, table);
+
+  unsigned long rows_written = 0;
+  if (table != NULL) {
+    rows_written = table->rows_written;
+    delete table;
+  } else
+    for (size_t i=0; i < visitors.size(); ++i)
+      delete visitors[i];
+  for (size_t i=0; i < outputs.size(); ++i) {
+    if (!outputs[i]->close())
+      status = 1;
+    delete outputs[i];
+  }
+  if (status != 0)
+    return 1;
+
+  // output statistics
+  PileupStats total;
+  for (size_t i=0; i < stats.size(); ++i) {
+    cerr << "Sample " << names[i] << ":\n";
+    print_pileup_stats(stats[i]);
+    total.add(stats[i]);
+  }
+
+  set_pileup_metrics(metrics, total);
+  metrics.set("output", "format", output_format);
+  metrics.set("output", "samples", (unsigned long)names.size());
+  if (output_format == "table")
+    metrics.set("output", "rows", rows_written);
+  if (!metrics.write_json(metrics_opts.json_fn))
+    return 1;
+
+  return 0;
+}
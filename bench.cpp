@@ -0,0 +1,323 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  bench
+// Reproducible benchmark: simulates a data set (see simulate.h), then
+// runs each stage of the pipeline on it as a child process, measuring
+// wall time and peak memory:
+//     rnapileup              reads.bam -> .rnapileup
+//     rnapileup2mismatchbed  .rnapileup -> mismatch BED
+//     nucfreq                reads.bam -> nucleotide frequency table
+//     detect_mods            nucleotide frequency table -> mods
+//     call                   reads.bam -> mods, in a single pass
+// Results go to a tab-delimited file, one line per stage.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "hamr.h"
+#include "simulate.h"
+#include "metrics.h"
+
+using namespace std;
+
+struct StageResult {
+  string stage;
+  double seconds;
+  unsigned long reads;
+  unsigned long sites;
+  long max_rss_kb;
+};
+
+// run this program with args, stdout to out_fn and stderr to log_fn,
+// timing it; returns the exit status, or -1 if it couldn't be run
+static int run_stage(const vector<string> &args, const string &out_fn,
+		     const string &log_fn, double &seconds, long &max_rss_kb) {
+  struct timeval start, stop;
+  gettimeofday(&start, NULL);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    int out = open(out_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int log = open(log_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0 || log < 0)
+      _exit(127);
+    dup2(out, 1);
+    dup2(log, 2);
+    vector<char *> argv;
+    for (size_t i=0; i < args.size(); ++i)
+      argv.push_back(const_cast<char *>(args[i].c_str()));
+    argv.push_back(NULL);
+    execv("/proc/self/exe", &argv[0]);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  while (wait4(pid, &status, 0, &usage) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  gettimeofday(&stop, NULL);
+
+  seconds = (stop.tv_sec - start.tv_sec) +
+    (stop.tv_usec - start.tv_usec) / 1e6;
+  max_rss_kb = usage.ru_maxrss;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// the simulation settings, to tell whether an existing data set can be
+// reused
+static string simulate_params(const SimulateOptions &o) {
+  ostringstream s;
+  s << "seed=" << o.seed << " chromosomes=" << o.chromosomes
+    << " chr_length=" << o.chr_length << " depth=" << o.depth
+    << " read_length=" << o.read_length
+    << " soft_clip_rate=" << o.soft_clip_rate
+    << " mismatch_rate=" << o.mismatch_rate << " hotspots=" << o.hotspots
+    << " hotspot_reads=" << o.hotspot_reads
+    << " mod_fraction=" << o.mod_fraction;
+  return s.str();
+}
+
+static void print_bench_usage(const vector<string> &args,
+			      bool options_only=false) {
+  if (!options_only) {
+    cerr << "USAGE: " << args[0] << " [OPTIONS] work_dir\n"
+	 << "    simulates a data set in work_dir (reused if the settings\n"
+	 << "    haven't changed) and times each stage on it\n\n"
+	 << "    OPTIONS:\n";
+  }
+  cerr   << "      --results=FILE         Where to write the results\n"
+	 << "                               (work_dir/bench_results.tsv)\n";
+  print_simulate_options();
+  if (!options_only)
+    print_metrics_options();
+}
+
+int bench_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  SimulateOptions sim_opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("bench");
+  string results_fn;
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    bool invalid = false;
+
+    if (parse_simulate_option(it->first, it->second, sim_opts, invalid) ||
+	parse_metrics_option(it->first, it->second, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (it->first == "--results") {
+      results_fn = it->second;
+
+    } else if (it->first == "--list-options") {
+      print_bench_usage(args, true);
+      return(0);
+    }
+  }
+
+  if (positional_args.size() < 2) {
+    print_bench_usage(args);
+    return(1);
+  }
+
+  string dir = positional_args[1];
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    cerr << "ERROR: Could not create " << dir << "\n";
+    return(1);
+  }
+  if (results_fn.empty())
+    results_fn = dir + "/bench_results.tsv";
+  string prefix = dir + "/sim";
+
+  // simulate, unless the same data set is already there
+  unsigned long n_reads = 0;
+  string params = simulate_params(sim_opts);
+  string params_fn = prefix + ".params";
+  {
+    ifstream in(params_fn.c_str());
+    string old_params;
+    if (getline(in, old_params) && old_params == params &&
+	(in >> n_reads)) {
+      cerr << "Reusing simulated data in " << dir << "\n";
+    } else {
+      cerr << "Simulating data in " << dir << "...\n";
+      if (simulate(sim_opts, prefix, n_reads) != 0)
+	return(1);
+      ofstream out(params_fn.c_str());
+      out << params << "\n" << n_reads << "\n";
+    }
+  }
+
+  vector<StageResult> results;
+  StageResult r;
+  vector<string> cmd;
+  string bam_fn = prefix + ".bam", fas_fn = prefix + ".fa";
+
+  // rnapileup
+  cmd.clear();
+  cmd.push_back("hamr_cmd");
+  cmd.push_back("rnapileup");
+  cmd.push_back(bam_fn);
+  cmd.push_back(fas_fn);
+  cmd.push_back("--stats-json=" + dir + "/rnapileup.stats.json");
+  r.stage = "rnapileup";
+  cerr << "Running " << r.stage << "...\n";
+  if (run_stage(cmd, prefix + ".rnapileup", dir + "/rnapileup.log",
+		r.seconds, r.max_rss_kb) != 0) {
+    cerr << "ERROR: rnapileup failed; see " << dir << "/rnapileup.log\n";
+    return(1);
+  }
+  r.reads = n_reads;
+  r.sites = count_lines(prefix + ".rnapileup");
+  results.push_back(r);
+  unsigned long n_sites = r.sites;
+
+  // rnapileup2mismatchbed
+  cmd.clear();
+  cmd.push_back("hamr_cmd");
+  cmd.push_back("rnapileup2mismatchbed");
+  cmd.push_back(prefix + ".rnapileup");
+  cmd.push_back("--stats-json=" + dir + "/rnapileup2mismatchbed.stats.json");
+  r.stage = "rnapileup2mismatchbed";
+  cerr << "Running " << r.stage << "...\n";
+  if (run_stage(cmd, prefix + "_mismatches.bed",
+		dir + "/rnapileup2mismatchbed.log",
+		r.seconds, r.max_rss_kb) != 0) {
+    cerr << "ERROR: rnapileup2mismatchbed failed; see " << dir
+	 << "/rnapileup2mismatchbed.log\n";
+    return(1);
+  }
+  r.reads = 0;
+  r.sites = n_sites;
+  results.push_back(r);
+
+  // nucleotide frequency table, as hamr.sh makes it
+  string table_fn = prefix + "_mismatches_sorted.txt";
+  cmd.clear();
+  cmd.push_back("hamr_cmd");
+  cmd.push_back("rnapileup");
+  cmd.push_back("--output-format=nucfreq");
+  cmd.push_back(bam_fn);
+  cmd.push_back(fas_fn);
+  cmd.push_back("--stats-json=" + dir + "/nucfreq.stats.json");
+  r.stage = "nucfreq";
+  cerr << "Running " << r.stage << "...\n";
+  if (run_stage(cmd, table_fn, dir + "/nucfreq.log",
+		r.seconds, r.max_rss_kb) != 0) {
+    cerr << "ERROR: rnapileup --output-format=nucfreq failed; see " << dir
+	 << "/nucfreq.log\n";
+    return(1);
+  }
+  r.reads = n_reads;
+  r.sites = count_lines(table_fn);
+  results.push_back(r);
+
+  // detect_mods
+  cmd.clear();
+  cmd.push_back("hamr_cmd");
+  cmd.push_back("detect_mods");
+  cmd.push_back(table_fn);
+  cmd.push_back("--stats-json=" + dir + "/detect_mods.stats.json");
+  r.stage = "detect_mods";
+  cerr << "Running " << r.stage << "...\n";
+  if (run_stage(cmd, prefix + "_mods.txt", dir + "/detect_mods.log",
+		r.seconds, r.max_rss_kb) != 0) {
+    cerr << "ERROR: detect_mods failed; see " << dir << "/detect_mods.log\n";
+    return(1);
+  }
+  r.reads = 0;
+  r.sites = count_lines(table_fn);
+  results.push_back(r);
+
+  // call
+  cmd.clear();
+  cmd.push_back("hamr_cmd");
+  cmd.push_back("call");
+  cmd.push_back(bam_fn);
+  cmd.push_back(fas_fn);
+  cmd.push_back("--stats-json=" + dir + "/call.stats.json");
+  r.stage = "call";
+  cerr << "Running " << r.stage << "...\n";
+  if (run_stage(cmd, prefix + "_call_mods.txt", dir + "/call.log",
+		r.seconds, r.max_rss_kb) != 0) {
+    cerr << "ERROR: call failed; see " << dir << "/call.log\n";
+    return(1);
+  }
+  r.reads = n_reads;
+  r.sites = n_sites;
+  results.push_back(r);
+
+  // results
+  ofstream out(results_fn.c_str());
+  if (!out.is_open()) {
+    cerr << "ERROR: Could not open " << results_fn << "\n";
+    return(1);
+  }
+  out << "stage\tseconds\treads\tsites\treads_per_s\tsites_per_s\tmax_rss_kb\n";
+  for (size_t i=0; i < results.size(); ++i) {
+    const StageResult &s = results[i];
+    double t = (s.seconds > 0) ? s.seconds : 1e-6;
+    out << s.stage << "\t" << s.seconds << "\t" << s.reads << "\t"
+	<< s.sites << "\t" << (unsigned long)(s.reads / t) << "\t"
+	<< (unsigned long)(s.sites / t) << "\t" << s.max_rss_kb << "\n";
+    cerr << "  " << s.stage << ": " << s.seconds << " s, "
+	 << (unsigned long)(s.reads / t) << " reads/s, "
+	 << (unsigned long)(s.sites / t) << " sites/s, "
+	 << s.max_rss_kb << " KB peak RSS\n";
+  }
+  cerr << "Results written to " << results_fn << "\n";
+
+  // each stage's own counters and timings are in work_dir/STAGE.stats.json
+  metrics.set("data", "reads", n_reads);
+  metrics.set("data", "sites", n_sites);
+  for (size_t i=0; i < results.size(); ++i) {
+    metrics.set(results[i].stage, "seconds", results[i].seconds);
+    metrics.set(results[i].stage, "max_rss_kb",
+		(unsigned long)results[i].max_rss_kb);
+  }
+  if (!metrics.write_json(metrics_opts.json_fn))
+    return(1);
+
+  return(0);
+}
@@ -0,0 +1,373 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  binary pileup format (see binpileup.h)
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hamr.h"
+#include "binpileup.h"
+
+using namespace std;
+
+static void put_varint(vector<unsigned char> &buf, uint64_t x) {
+  while (x >= 0x80) {
+    buf.push_back((unsigned char)(x | 0x80));
+    x >>= 7;
+  }
+  buf.push_back((unsigned char)x);
+}
+
+// returns false if the varint runs past end or doesn't fit 64 bits
+static bool get_varint(const unsigned char *&p, const unsigned char *end,
+		       uint64_t &x) {
+  x = 0;
+  for (int shift=0; p < end && shift < 64; shift += 7) {
+    unsigned char b = *p++;
+    x |= uint64_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+// the same, for values that must fit 32 bits
+static bool get_varint(const unsigned char *&p, const unsigned char *end,
+		       uint32_t &x) {
+  uint64_t y;
+  if (!get_varint(p, end, y) || y > 0xffffffffULL)
+    return false;
+  x = (uint32_t)y;
+  return true;
+}
+
+///////////////////////
+
+BinPileupWriter::BinPileupWriter(ostream *out) :
+  out(out), offset(0), block_chr(0), n_sites(0) {
+  if (out != NULL) {
+    BinPileupHeader h;
+    memcpy(h.magic, BINPILEUP_MAGIC, sizeof(h.magic));
+    h.byte_order = BINPILEUP_BYTE_ORDER;
+    h.version = BINPILEUP_VERSION;
+    write(&h, sizeof(h));
+  }
+}
+
+void BinPileupWriter::visit_counts(const string &ref_id,
+				   const SiteCounts &site) {
+  vector<unsigned char> packed;
+  packed.push_back((unsigned char)site.ref);
+  packed.push_back((unsigned char)((site.min_qual > 255) ? 255 :
+				   site.min_qual));
+  put_varint(packed, site.nreads);
+  put_varint(packed, site.qual_sum);
+
+  unsigned int mask = 0;
+  for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s)
+    if (site.counts[s] > 0)
+      mask |= 1u << s;
+  packed.push_back((unsigned char)(mask & 0xff));
+  packed.push_back((unsigned char)(mask >> 8));
+
+  for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+    if (site.counts[s] == 0)
+      continue;
+    put_varint(packed, site.counts[s]);
+    const unsigned int *h = site.readpos[s];
+    uint32_t nbins = 0;
+    for (int i=0; i <= site.max_readpos[s]; ++i)
+      nbins += (h[i] > 0);
+    put_varint(packed, nbins);
+    int prev = 0;
+    for (int i=0; i <= site.max_readpos[s]; ++i) {
+      if (h[i] == 0)
+	continue;
+      put_varint(packed, i - prev);
+      put_varint(packed, h[i]);
+      prev = i;
+    }
+  }
+
+  add_site(ref_id, site.pos, &packed[0], packed.size());
+}
+
+void BinPileupWriter::merge(SiteVisitor *part) {
+  BinPileupWriter *p = static_cast<BinPileupWriter *>(part);
+  for (size_t i=0; i < p->site_pos.size(); ++i) {
+    size_t beg = p->site_off[i];
+    size_t end = (i+1 < p->site_pos.size()) ?
+      p->site_off[i+1] : p->site_data.size();
+    add_site(p->chrs[p->site_chrs[i]], p->site_pos[i],
+	     &p->site_data[beg], end - beg);
+  }
+}
+
+void BinPileupWriter::add_site(const string &chr, uint32_t pos,
+			       const unsigned char *packed,
+			       size_t packed_len) {
+  map<string, unsigned int>::iterator it = chr_index.find(chr);
+  unsigned int c;
+  if (it == chr_index.end()) {
+    c = chrs.size();
+    chrs.push_back(chr);
+    chr_index[chr] = c;
+  } else
+    c = it->second;
+
+  if (out != NULL && !site_pos.empty() &&
+      (c != block_chr || site_pos.size() >= BINPILEUP_BLOCK_SITES))
+    flush_block();
+  if (site_pos.empty())
+    block_chr = c;
+
+  site_pos.push_back(pos);
+  site_off.push_back(site_data.size());
+  site_data.insert(site_data.end(), packed, packed + packed_len);
+  if (out == NULL)
+    site_chrs.push_back(c);
+  ++n_sites;
+}
+
+void BinPileupWriter::flush_block() {
+  if (site_pos.empty())
+    return;
+
+  // positions go in front of each site, as steps from the previous one
+  vector<unsigned char> data;
+  data.reserve(site_data.size() + 2 * site_pos.size());
+  uint32_t prev = site_pos.front();
+  for (size_t i=0; i < site_pos.size(); ++i) {
+    put_varint(data, site_pos[i] - prev);
+    prev = site_pos[i];
+    size_t end = (i+1 < site_pos.size()) ? site_off[i+1] : site_data.size();
+    data.insert(data.end(), site_data.begin() + site_off[i],
+		site_data.begin() + end);
+  }
+
+  BinPileupBlock blk;
+  blk.chr = block_chr;
+  blk.n_sites = site_pos.size();
+  blk.first_pos = site_pos.front();
+  blk.last_pos = site_pos.back();
+  blk.data_off = offset;
+  blk.data_len = data.size();
+  write(&data[0], data.size());
+  index.push_back(blk);
+
+  site_pos.clear();
+  site_off.clear();
+  site_data.clear();
+}
+
+void BinPileupWriter::close() {
+  flush_block();
+
+  BinPileupTrailer t;
+  memset(&t, 0, sizeof(t));
+  t.chrs_off = offset;
+  t.n_chrs = chrs.size();
+  for (size_t i=0; i < chrs.size(); ++i) {
+    uint32_t len = chrs[i].size();
+    write(&len, sizeof(len));
+    write(chrs[i].data(), len);
+  }
+  pad();
+
+  t.index_off = offset;
+  t.n_blocks = index.size();
+  t.n_sites = n_sites;
+  if (!index.empty())
+    write(&index[0], sizeof(BinPileupBlock) * index.size());
+
+  memcpy(t.magic, BINPILEUP_MAGIC, sizeof(t.magic));
+  write(&t, sizeof(t));
+  out->flush();
+}
+
+void BinPileupWriter::write(const void *data, size_t len) {
+  out->write((const char *)data, len);
+  offset += len;
+}
+
+// align the block index, so that it can be used in place
+void BinPileupWriter::pad() {
+  static const char zeros[8] = { 0 };
+  if (offset % 8 != 0)
+    write(zeros, 8 - offset % 8);
+}
+
+///////////////////////
+
+BinPileupReader::BinPileupReader() :
+  data(NULL), size(0), blocks(NULL), n_blocks(0), n_sites(0) { }
+
+BinPileupReader::~BinPileupReader() {
+  if (data != NULL)
+    munmap((void *)data, size);
+}
+
+bool BinPileupReader::open(const string &fn) {
+  int fd = ::open(fn.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open file " << fn << "\n";
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    cerr << "ERROR: " << fn << " is empty or can't be read\n";
+    ::close(fd);
+    return false;
+  }
+  size = st.st_size;
+
+  void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    cerr << "ERROR: failed to map " << fn << ": " << strerror(errno) << "\n";
+    size = 0;
+    return false;
+  }
+  data = (const unsigned char *)p;
+  // sites are read front to back
+  madvise(p, size, MADV_SEQUENTIAL);
+
+  if (!check()) {
+    cerr << "ERROR: " << fn << " is not a valid binary pileup file\n";
+    return false;
+  }
+  return true;
+}
+
+// check the header, trailer and index and load the chr table
+bool BinPileupReader::check() {
+  if (size < sizeof(BinPileupHeader) + sizeof(BinPileupTrailer))
+    return false;
+
+  const BinPileupHeader *h = (const BinPileupHeader *)data;
+  if (memcmp(h->magic, BINPILEUP_MAGIC, sizeof(h->magic)) != 0 ||
+      h->byte_order != BINPILEUP_BYTE_ORDER ||
+      h->version != BINPILEUP_VERSION)
+    return false;
+
+  size_t trailer_off = size - sizeof(BinPileupTrailer);
+  const BinPileupTrailer *t =
+    (const BinPileupTrailer *)(data + trailer_off);
+  if (memcmp(t->magic, BINPILEUP_MAGIC, sizeof(t->magic)) != 0 ||
+      t->chrs_off > trailer_off || t->index_off > trailer_off ||
+      t->index_off % 8 != 0 ||
+      t->n_blocks > (trailer_off - t->index_off) / sizeof(BinPileupBlock))
+    return false;
+
+  const unsigned char *p = data + t->chrs_off;
+  const unsigned char *end = data + t->index_off;
+  for (uint32_t i=0; i < t->n_chrs; ++i) {
+    uint32_t len;
+    if (end - p < (ptrdiff_t)sizeof(len))
+      return false;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    if ((uint32_t)(end - p) < len)
+      return false;
+    chrs.push_back(string((const char *)p, len));
+    p += len;
+  }
+
+  blocks = (const BinPileupBlock *)(data + t->index_off);
+  n_blocks = t->n_blocks;
+  n_sites = t->n_sites;
+  for (size_t b=0; b < n_blocks; ++b) {
+    const BinPileupBlock &blk = blocks[b];
+    if (blk.chr >= chrs.size() || blk.data_off > trailer_off ||
+	blk.data_len > trailer_off - blk.data_off)
+      return false;
+  }
+  return true;
+}
+
+void BinPileupReader::start_block(size_t b, BinPileupCursor &c) const {
+  c.p = data + blocks[b].data_off;
+  c.end = c.p + blocks[b].data_len;
+  c.pos = blocks[b].first_pos;
+}
+
+bool BinPileupReader::next_site(BinPileupCursor &c, SiteCounts &site) const {
+  const unsigned char *&p = c.p;
+  uint32_t step, nreads;
+  uint64_t qual_sum;
+  if (!get_varint(p, c.end, step) || c.end - p < 2)
+    return false;
+  c.pos += step;
+  site.reset(c.pos);
+  site.ref = *p++;
+  site.min_qual = *p++;
+  if (!get_varint(p, c.end, nreads) || !get_varint(p, c.end, qual_sum) ||
+      c.end - p < 2)
+    return false;
+  site.nreads = nreads;
+  site.qual_sum = qual_sum;
+  unsigned int mask = p[0] | (p[1] << 8);
+  p += 2;
+
+  for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+    if ((mask & (1u << s)) == 0)
+      continue;
+    uint32_t count, nbins;
+    if (!get_varint(p, c.end, count) || !get_varint(p, c.end, nbins))
+      return false;
+    site.counts[s] = count;
+    if (s >= 2)
+      site.nonref += count;
+    uint32_t pos = 0;
+    for (uint32_t j=0; j < nbins; ++j) {
+      uint32_t delta, n;
+      if (!get_varint(p, c.end, delta) || !get_varint(p, c.end, n))
+	return false;
+      pos += delta;
+      if (pos >= (uint32_t)MAX_READPOS)
+	return false;
+      site.readpos[s][pos] = n;
+      if ((int)pos > site.max_readpos[s])
+	site.max_readpos[s] = pos;
+    }
+  }
+  return true;
+}
+
+bool is_binpileup_file(const string &fn) {
+  if (fn == "-")
+    return false;
+  ifstream in(fn.c_str(), ios::in | ios::binary);
+  char magic[sizeof(BINPILEUP_MAGIC)];
+  if (!in.read(magic, sizeof(magic)))
+    return false;
+  return memcmp(magic, BINPILEUP_MAGIC, sizeof(magic)) == 0;
+}
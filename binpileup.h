@@ -0,0 +1,172 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  binary pileup format
+// A compact alternative to the text .rnapileup that can be read with
+// mmap. Holds the SiteCounts of each site rather than the pileup
+// strings (base qualities are kept only as a sum and minimum per site).
+//
+// Layout (all fixed-width integers little-endian, as written by the host):
+//   header          magic "HAMRBP1\0", byte order mark, version
+//   blocks          each up to BINPILEUP_BLOCK_SITES packed sites of one
+//                     chromosome
+//   chr table       for each chromosome: uint32 length, name
+//   block index     one BinPileupBlock per block (8-byte aligned)
+//   trailer         offsets of the chr table and block index
+// Everything is written front to back, so the format can be streamed to
+// stdout; readers find the chr table and index through the trailer.
+//
+// Sites are packed one after another, all numbers as LEB128 varints:
+//   pos minus the previous site's (the block's first_pos for the
+//     first site), ref and min_qual (one byte each), nreads, qual_sum,
+//   a 2-byte mask (little-endian) of the symbols with nonzero counts,
+//   then for each of those, in PILEUP_SYMBOLS order: its count, the
+//     number of distinct read positions, and (position - previous
+//     position, count) pairs.
+// Sites therefore have to be read in order from the start of a block.
+
+#ifndef HAMR_BINPILEUP_H
+#define HAMR_BINPILEUP_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <stdint.h>
+
+#include "pileup.h"
+
+using namespace std;
+
+const char BINPILEUP_MAGIC[8] = { 'H', 'A', 'M', 'R', 'B', 'P', '1', '\0' };
+const uint32_t BINPILEUP_BYTE_ORDER = 0x01020304;
+const uint32_t BINPILEUP_VERSION = 2;
+const unsigned int BINPILEUP_BLOCK_SITES = 4096;
+
+struct BinPileupHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+};
+
+struct BinPileupBlock {
+  uint32_t chr;
+  uint32_t n_sites;
+  uint32_t first_pos;
+  uint32_t last_pos;
+  // where the packed sites are in the file
+  uint64_t data_off;
+  uint64_t data_len;
+};
+
+// where BinPileupReader::next_site is in a block
+struct BinPileupCursor {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint32_t pos;
+};
+
+struct BinPileupTrailer {
+  uint64_t chrs_off;
+  uint32_t n_chrs;
+  uint32_t reserved;
+  uint64_t index_off;
+  uint64_t n_blocks;
+  uint64_t n_sites;
+  char magic[8];
+};
+
+// writes SiteCounts in the binary format; close() must be called after
+// the last site to write the chr table, index and trailer
+class BinPileupWriter : public SiteVisitor {
+  ostream *out;
+  uint64_t offset;
+
+  vector<string> chrs;
+  map<string, unsigned int> chr_index;
+
+  // the block being filled (all sites of a region part): positions and
+  // packed sites without their positions
+  unsigned int block_chr;
+  vector<uint32_t> site_pos;
+  vector<size_t> site_off;
+  vector<unsigned char> site_data;
+  // for region parts (out == NULL), the chromosome of each site
+  vector<unsigned int> site_chrs;
+
+  vector<BinPileupBlock> index;
+  uint64_t n_sites;
+
+public:
+  // out == NULL keeps all sites in memory (regions piled up in parallel)
+  BinPileupWriter(ostream *out);
+
+  bool use_counts() const { return true; }
+  void visit_counts(const string &ref_id, const SiteCounts &site);
+  SiteVisitor *fork() { return new BinPileupWriter(NULL); }
+  void merge(SiteVisitor *part);
+
+  void close();
+
+private:
+  void add_site(const string &chr, uint32_t pos,
+		const unsigned char *packed, size_t packed_len);
+  void flush_block();
+  void write(const void *data, size_t len);
+  void pad();
+};
+
+// read-only view of a binary pileup file mapped into memory
+class BinPileupReader {
+  const unsigned char *data;
+  size_t size;
+
+  vector<string> chrs;
+  const BinPileupBlock *blocks;
+  size_t n_blocks;
+  uint64_t n_sites;
+
+public:
+  BinPileupReader();
+  ~BinPileupReader();
+
+  // map file fn; prints an error and returns false on failure
+  bool open(const string &fn);
+
+  size_t num_chrs() const { return chrs.size(); }
+  const string &chr_name(unsigned int i) const { return chrs[i]; }
+  size_t num_blocks() const { return n_blocks; }
+  uint64_t num_sites() const { return n_sites; }
+  const BinPileupBlock &block(size_t b) const { return blocks[b]; }
+
+  // position c at the first site of block b
+  void start_block(size_t b, BinPileupCursor &c) const;
+  // unpack the site at c, including its read position histogram, and
+  // move c past it; false if the site is corrupt
+  bool next_site(BinPileupCursor &c, SiteCounts &site) const;
+
+private:
+  bool check();
+};
+
+// does the file start with the binary pileup magic? false for stdin
+bool is_binpileup_file(const string &fn);
+
+#endif
@@ -0,0 +1,304 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  call
+// Single-pass HAMR: BAM -> modification table without intermediate files.
+// Equivalent to rnapileup | rnapileup2mismatchbed | hamr_mismatchbed2table.sh
+//   | awk '$9 > 0' | hamr_detect_mods.R
+// except that sites come out in BAM order (+ strand before - strand)
+// rather than in the lexical chromosome order of sort -m.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "hamr.h"
+#include "pileup.h"
+#include "stats.h"
+#include "output.h"
+#include "metrics.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+// turns each pileup site into nucleotide frequency rows (one per strand
+// with mismatches), keeping them until all p-values are known
+class NucFreqCollector : public SiteVisitor {
+public:
+  ModsTable table;
+  double seq_err;
+  // set if the table couldn't spill its rows to disk
+  bool failed;
+
+  NucFreqCollector(double seq_err) : seq_err(seq_err), failed(false) { }
+
+  // only counts are needed, not the pileup strings
+  bool use_counts() const { return true; }
+
+  void visit_counts(const string &ref_id, const SiteCounts &site) {
+    NucFreqRow row;
+    if (site_nuc_freq_row(site, '+', row) &&
+	!table.add(ref_id, row, test_site(row, seq_err)))
+      failed = true;
+    if (site_nuc_freq_row(site, '-', row) &&
+	!table.add(ref_id, row, test_site(row, seq_err)))
+      failed = true;
+  }
+
+  SiteVisitor *fork() { return new NucFreqCollector(seq_err); }
+
+  void merge(SiteVisitor *part) {
+    if (!table.append(static_cast<NucFreqCollector *>(part)->table))
+      failed = true;
+  }
+};
+
+// with --checkpoint-dir: saves the nucleotide frequency rows of each
+// chromosome as a shard once it has been piled up
+class ShardWriter : public SiteVisitor {
+  // NULL for the parts of a parallel pileup
+  Checkpoint *checkpoint;
+  // the chromosome being collected and its rows
+  string chr;
+  OutputBuffer rows;
+  unsigned long n_rows;
+
+public:
+  bool failed;
+
+  ShardWriter(Checkpoint *checkpoint) :
+    checkpoint(checkpoint), n_rows(0), failed(false) { }
+
+  bool use_counts() const { return true; }
+
+  void visit_counts(const string &ref_id, const SiteCounts &site) {
+    // sites come in order, so the previous chromosome is finished
+    if (ref_id != chr) {
+      save();
+      chr = ref_id;
+    }
+    NucFreqRow row;
+    if (site_nuc_freq_row(site, '+', row)) {
+      write_nuc_freq_row(rows, chr, row);
+      ++n_rows;
+    }
+    if (site_nuc_freq_row(site, '-', row)) {
+      write_nuc_freq_row(rows, chr, row);
+      ++n_rows;
+    }
+  }
+
+  SiteVisitor *fork() { return new ShardWriter(NULL); }
+
+  void merge(SiteVisitor *part) {
+    ShardWriter *p = static_cast<ShardWriter *>(part);
+    if (p->chr.empty())
+      return;
+    if (p->chr != chr) {
+      save();
+      chr = p->chr;
+    }
+    rows.put(p->rows.data(), p->rows.size());
+    n_rows += p->n_rows;
+  }
+
+  // save the rows of the current chromosome; call once the pileup has
+  // finished to save the last one
+  void save() {
+    if (!chr.empty() && checkpoint != NULL && !failed)
+      failed = !checkpoint->save(chr, rows, n_rows);
+    chr.clear();
+    rows.clear();
+    n_rows = 0;
+  }
+};
+
+// add the rows of a shard to table, testing them
+static bool load_shard(const string &fn, double seq_err, ModsTable &table) {
+  ifstream in(fn.c_str());
+  if (!in.is_open()) {
+    cerr << "ERROR: Could not open shard " << fn << "\n";
+    return false;
+  }
+  string line, chr;
+  NucFreqRow row;
+  while (getline(in, line)) {
+    if (!parse_nuc_freq_line(line, chr, row)) {
+      cerr << "ERROR: malformed line in shard " << fn << "\n";
+      return false;
+    }
+    if (!table.add(chr, row, test_site(row, seq_err)))
+      return false;
+  }
+  return true;
+}
+
+// pile up the chromosomes without a shard in checkpoint_dir, then read
+// every shard back into table
+static int run_checkpointed(const string &bam_fn, const string &fas_fn,
+			    PileupOptions pileup_opts,
+			    const string &checkpoint_dir, double seq_err,
+			    ModsTable &table, PileupStats &pileup_stats,
+			    RunMetrics &metrics) {
+  vector<string> chrs, fingerprint;
+  if (!fingerprint_pileup(bam_fn, fas_fn, pileup_opts, chrs, fingerprint))
+    return 1;
+  Checkpoint checkpoint;
+  if (!checkpoint.open(checkpoint_dir, fingerprint))
+    return 1;
+
+  pileup_opts.chromosomes.clear();
+  for (size_t i=0; i < chrs.size(); ++i)
+    if (!checkpoint.is_done(chrs[i]))
+      pileup_opts.chromosomes.push_back(chrs[i]);
+  cerr << "  Checkpoint in " << checkpoint_dir << ": "
+       << chrs.size() - pileup_opts.chromosomes.size() << " of "
+       << chrs.size() << " chromosomes done\n";
+  metrics.set("checkpoint", "chromosomes_reused",
+	      (unsigned long)(chrs.size() - pileup_opts.chromosomes.size()));
+  metrics.set("checkpoint", "chromosomes_piled_up",
+	      (unsigned long)pileup_opts.chromosomes.size());
+
+  if (!pileup_opts.chromosomes.empty()) {
+    ShardWriter writer(&checkpoint);
+    if (run_pileup(bam_fn, fas_fn, pileup_opts, writer, pileup_stats) != 0)
+      return 1;
+    writer.save();
+    // chromosomes without any sites are done too
+    OutputBuffer no_rows;
+    for (size_t i=0; i < pileup_opts.chromosomes.size() && !writer.failed; ++i)
+      if (!checkpoint.is_done(pileup_opts.chromosomes[i]))
+	writer.failed = !checkpoint.save(pileup_opts.chromosomes[i], no_rows, 0);
+    if (writer.failed)
+      return 1;
+    print_pileup_stats(pileup_stats);
+  }
+
+  for (size_t i=0; i < chrs.size(); ++i)
+    if (!load_shard(checkpoint.shard_fn(chrs[i]), seq_err, table))
+      return 1;
+  return 0;
+}
+
+static void print_call_usage(const vector<string> &args,
+			     bool options_only=false) {
+  if (!options_only) {
+    cerr << "USAGE: " << args[0] << " [OPTIONS] reads.bam genome.fasta\n\n"
+	 << "    OPTIONS:\n";
+  }
+  print_pileup_options();
+  print_stats_options();
+  if (!options_only) {
+    cerr << "      --checkpoint-dir=DIR   Save each chromosome's counts in DIR as it\n"
+	 << "                               is done; a rerun with the same inputs and\n"
+	 << "                               pileup options only does what's missing\n";
+    print_metrics_options();
+  }
+}
+
+int call_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  PileupOptions pileup_opts;
+  StatsOptions stats_opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("call");
+  string checkpoint_dir;
+
+  // collect and validate command line arguments
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    string key = it->first;
+    string value = it->second;
+    bool invalid = false;
+
+    if (parse_pileup_option(key, value, pileup_opts, invalid) ||
+	parse_stats_option(key, value, stats_opts, invalid) ||
+	parse_metrics_option(key, value, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (key == "--checkpoint-dir") {
+      checkpoint_dir = value;
+
+    } else if (key == "--list-options") {
+      print_call_usage(args, true);
+      return(0);
+    }
+  }
+
+  if (positional_args.size() < 3) {
+    print_call_usage(args);
+    return(1);
+  }
+
+  string bam_fn( positional_args[1] );
+  string fas_fn( positional_args[2] );
+
+  cerr << "  Processing BAM file " << bam_fn << "\n";
+  cerr << "  Using genome fasta file " << fas_fn << "\n";
+  print_pileup_settings(pileup_opts);
+  print_stats_settings(stats_opts);
+  pileup_opts.timing = metrics_opts.enabled();
+  pileup_opts.progress_interval = metrics_opts.progress_interval;
+
+  NucFreqCollector collector(stats_opts.seq_err);
+  collector.table.limit_memory(stats_opts.max_memory_mb, stats_opts.temp_dir);
+  PileupStats pileup_stats;
+  if (!checkpoint_dir.empty()) {
+    if (run_checkpointed(bam_fn, fas_fn, pileup_opts, checkpoint_dir,
+			 stats_opts.seq_err, collector.table, pileup_stats,
+			 metrics) != 0)
+      return 1;
+  } else {
+    if (run_pileup(bam_fn, fas_fn, pileup_opts, collector, pileup_stats) != 0
+	|| collector.failed)
+      return 1;
+    print_pileup_stats(pileup_stats);
+  }
+
+  set_pileup_metrics(metrics, pileup_stats);
+  metrics.set("rows", "tested", (unsigned long)collector.table.size());
+
+  if (collector.table.empty()) {
+    cerr << "WARNING: no mismatches found\n";
+    metrics.write_json(metrics_opts.json_fn);
+    return 1;
+  }
+
+  // FDR adjustment and writing the table
+  double write_time = 0;
+  bool written;
+  {
+    ScopedTimer timer(&write_time);
+    written = collector.table.write(cout, stats_opts);
+  }
+  metrics.set("timers_s", "write", write_time);
+  metrics.set("rows", "spilled", (unsigned long)collector.table.spilled());
+  if (!written)
+    return 1;
+
+  return metrics.write_json(metrics_opts.json_fn) ? 0 : 1;
+}
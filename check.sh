@@ -0,0 +1,116 @@
+#!/bin/bash
+#  Copyright (c) 2013 University of Pennsylvania
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a
+#  copy of this software and associated documentation files (the "Software"),
+#  to deal in the Software without restriction, including without limitation
+#  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+#  and/or sell copies of the Software, and to permit persons to whom the
+#  Software is furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+#  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+#  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+#  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+#  DEALINGS IN THE SOFTWARE.
+
+# consistency checks on simulated data (make check): the different
+# ways of getting the same result must agree byte for byte
+#   - the serial pileup and --threads
+#   - rnapileup | rnapileup2mismatchbed and --output-format=mismatchbed,
+#     with and without --max-depth
+#   - call and rnapileup --output-format=nucfreq | detect_mods, with
+#     and without spilling to disk (--max-memory)
+#   - the binary pileup written directly, converted from text and
+#     converted to text and back
+
+if [[ $# -lt 2 ]]; then
+    echo "USAGE: $0 hamr_cmd work_dir" >&2
+    exit 1
+fi
+
+hamr_cmd="$1"
+dir="$2"
+mkdir -p "${dir}" || exit 1
+sim="${dir}/sim"
+log="${dir}/check.log"
+
+# two chromosomes longer than a parallel region, so that --threads
+# splits them and reads cross region boundaries
+"${hamr_cmd}" simulate --chromosomes=2 --chr-length=1500000 --depth=10 \
+  --hotspots=10 --hotspot-reads=500 "${sim}" 2> "${log}"
+if [[ $? -ne 0 ]]; then
+    echo "ERROR: simulation failed; see ${log}" >&2
+    exit 1
+fi
+
+failed=0
+
+# run "$@" with stdout to the file given first, stderr to the log
+function run() {
+    local out="$1"
+    shift
+    if ! "${hamr_cmd}" "$@" > "${out}" 2>> "${log}"; then
+	echo "ERROR: ${hamr_cmd} $* failed; see ${log}" >&2
+	exit 1
+    fi
+}
+
+function same() {
+    local what="$1"
+    if cmp -s "$2" "$3"; then
+	echo "ok    ${what}" >&2
+    else
+	echo "FAIL  ${what}: $2 and $3 differ" >&2
+	failed=1
+    fi
+}
+
+bam="${sim}.bam"
+fas="${sim}.fa"
+
+run "${sim}.rnapileup" rnapileup "${bam}" "${fas}"
+run "${sim}_threads.rnapileup" rnapileup --threads=4 "${bam}" "${fas}"
+same "rnapileup --threads" "${sim}.rnapileup" "${sim}_threads.rnapileup"
+
+for depth in 0 50; do
+    opts="--max-depth=${depth}"
+    run "${sim}_${depth}.rnapileup" rnapileup ${opts} "${bam}" "${fas}"
+    run "${sim}_${depth}_text.bed" rnapileup2mismatchbed "${sim}_${depth}.rnapileup"
+    run "${sim}_${depth}.bed" rnapileup ${opts} --output-format=mismatchbed \
+      "${bam}" "${fas}"
+    same "rnapileup2mismatchbed ${opts}" "${sim}_${depth}_text.bed" \
+      "${sim}_${depth}.bed"
+done
+
+run "${sim}_nucfreq.txt" rnapileup --output-format=nucfreq "${bam}" "${fas}"
+for mem in 1024 1; do
+    opts="--max-memory=${mem}"
+    run "${sim}_${mem}_detect.txt" detect_mods ${opts} "${sim}_nucfreq.txt"
+    run "${sim}_${mem}_call.txt" call ${opts} "${bam}" "${fas}"
+    same "call ${opts}" "${sim}_${mem}_detect.txt" "${sim}_${mem}_call.txt"
+done
+if ! grep -q spilling "${log}"; then
+    echo "FAIL  --max-memory=1 did not spill to disk" >&2
+    failed=1
+fi
+
+# the binary format keeps counts rather than the reads' order, so its
+# text is not the original; it has to convert back to the same bytes
+run "${sim}.bin" rnapileup --output-format=binary "${bam}" "${fas}"
+run /dev/null convert_pileup "${sim}.rnapileup" "${sim}_text.bin"
+same "text pileup to binary" "${sim}.bin" "${sim}_text.bin"
+run /dev/null convert_pileup "${sim}.bin" "${sim}_bin.rnapileup"
+run /dev/null convert_pileup "${sim}_bin.rnapileup" "${sim}_round.bin"
+same "binary pileup round trip" "${sim}.bin" "${sim}_round.bin"
+
+if [[ ${failed} -ne 0 ]]; then
+    echo "Some checks failed" >&2
+    exit 1
+fi
+echo "All checks passed" >&2
@@ -0,0 +1,231 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sam.h"
+#include "hamr.h"
+#include "pileup.h"
+#include "output.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+// changes whenever the shard format does, so old shards aren't reused
+const int SHARD_VERSION = 1;
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t n) {
+  for (size_t i=0; i < n; ++i)
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// "size mtime" of a file, or "" if it doesn't exist
+static string file_stamp(const string &fn) {
+  struct stat st;
+  if (stat(fn.c_str(), &st) != 0)
+    return "";
+  ostringstream s;
+  s << st.st_size << " " << st.st_mtime;
+  return s.str();
+}
+
+bool fingerprint_pileup(const string &bam_fn, const string &fas_fn,
+			const PileupOptions &opts, vector<string> &chrs,
+			vector<string> &fingerprint) {
+  // the BAM file is read twice, and its stamp is part of the fingerprint
+  if (bam_fn == "-") {
+    cerr << "ERROR: checkpoints need a BAM file, not standard input\n";
+    return false;
+  }
+  bamFile bam_file = bam_open(bam_fn.c_str(), "r");
+  if (bam_file == 0) {
+    cerr << "Failed to open BAM file " << bam_fn << "\n";
+    return false;
+  }
+  bam_header_t *bam_hdr = bam_header_read(bam_file);
+  if (bam_hdr == NULL) {
+    cerr << "ERROR: could not read the header of " << bam_fn << "\n";
+    bam_close(bam_file);
+    return false;
+  }
+  uint64_t h = 0xcbf29ce484222325ULL;
+  h = fnv1a(h, bam_hdr->text, bam_hdr->l_text);
+  chrs.clear();
+  for (int tid=0; tid < bam_hdr->n_targets; ++tid) {
+    chrs.push_back(bam_hdr->target_name[tid]);
+    string target = chrs.back() + "\t" + to_s(bam_hdr->target_len[tid]) + "\n";
+    h = fnv1a(h, target.data(), target.size());
+  }
+  bam_header_destroy(bam_hdr);
+  bam_close(bam_file);
+
+  string fas_stamp = file_stamp(fas_fn);
+  if (fas_stamp.empty()) {
+    cerr << "Failed to open FASTA file " << fas_fn << "\n";
+    return false;
+  }
+
+  ostringstream bam, fas, options;
+  bam << "bam " << file_stamp(bam_fn) << " " << hex << h;
+  fas << "fasta " << fas_stamp;
+  // only what changes the sites; --threads doesn't
+  options << "options shards=" << SHARD_VERSION
+	  << " no_ss=" << opts.no_ss
+	  << " exclude_ends=" << opts.exclude_ends
+	  << " skip_indels=" << opts.skip_indels
+	  << " min_coverage=" << opts.min_coverage
+	  << " min_nonref=" << opts.min_nonref
+	  << " min_nonref_fraction=" << opts.min_nonref_fraction
+	  << " min_q=" << opts.min_q
+	  << " max_depth=" << opts.max_depth;
+  if (opts.max_depth > 0)
+    options << " seed=" << opts.seed;
+  if (!opts.regions_fn.empty())
+    options << " regions=" << opts.regions_fn << " "
+	    << file_stamp(opts.regions_fn);
+
+  fingerprint.clear();
+  fingerprint.push_back(bam.str());
+  fingerprint.push_back(fas.str());
+  fingerprint.push_back(options.str());
+  return true;
+}
+
+/////////////////////
+
+string Checkpoint::shard_fn(const string &chr) const {
+  // keep the name safe as a file name
+  string name(chr);
+  for (size_t i=0; i < name.size(); ++i)
+    if (!isalnum((unsigned char)name[i]) && name[i] != '.' &&
+	name[i] != '_' && name[i] != '-')
+      name[i] = '_';
+  return dir + "/" + name + ".nucfreq";
+}
+
+bool Checkpoint::open(const string &dir_, const vector<string> &fingerprint_) {
+  dir = dir_;
+  fingerprint = fingerprint_;
+  done.clear();
+
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    cerr << "ERROR: Could not create checkpoint directory " << dir << "\n";
+    return false;
+  }
+
+  // what a previous run left
+  ifstream in((dir + "/manifest").c_str());
+  vector<string> old_fingerprint;
+  map<string, unsigned long> old_done;
+  string line;
+  while (getline(in, line)) {
+    if (line.compare(0, 12, "fingerprint ") == 0) {
+      old_fingerprint.push_back(line.substr(12));
+    } else if (line.compare(0, 5, "done\t") == 0) {
+      size_t tab = line.find('\t', 5);
+      if (tab == string::npos)
+	continue;
+      bool ok = false;
+      unsigned long n = from_s<unsigned long>(line.substr(tab + 1), ok);
+      if (ok)
+	old_done[line.substr(5, tab - 5)] = n;
+    }
+  }
+  in.close();
+
+  if (!old_done.empty() && old_fingerprint != fingerprint) {
+    cerr << "  Inputs or pileup options changed since the checkpoint in "
+	 << dir << "; starting over\n";
+    for (map<string, unsigned long>::iterator it = old_done.begin();
+	 it != old_done.end(); ++it)
+      unlink(shard_fn(it->first).c_str());
+  } else {
+    // keep the shards that are still whole
+    for (map<string, unsigned long>::iterator it = old_done.begin();
+	 it != old_done.end(); ++it) {
+      if (count_lines(shard_fn(it->first)) == it->second)
+	done.insert(*it);
+      else
+	cerr << "  Shard for " << it->first << " is incomplete; redoing it\n";
+    }
+  }
+
+  return write_manifest();
+}
+
+bool Checkpoint::write_manifest() const {
+  string fn = dir + "/manifest";
+  string tmp_fn = fn + ".tmp";
+  ofstream out(tmp_fn.c_str());
+  out << "# hamr_cmd checkpoint\n";
+  for (size_t i=0; i < fingerprint.size(); ++i)
+    out << "fingerprint " << fingerprint[i] << "\n";
+  for (map<string, unsigned long>::const_iterator it = done.begin();
+       it != done.end(); ++it)
+    out << "done\t" << it->first << "\t" << it->second << "\n";
+  out.close();
+  if (!out || rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+    cerr << "ERROR: Could not write " << fn << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool Checkpoint::save(const string &chr, const OutputBuffer &rows,
+		      unsigned long n) {
+  // the shard only takes its name once it's complete
+  string fn = shard_fn(chr);
+  string tmp_fn = fn + ".tmp";
+  FILE *out = fopen(tmp_fn.c_str(), "wb");
+  bool ok = (out != NULL);
+  if (ok) {
+    if (rows.size() > 0)
+      ok = (fwrite(rows.data(), 1, rows.size(), out) == rows.size());
+    ok = (fclose(out) == 0) && ok;
+  }
+  if (!ok || rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+    cerr << "ERROR: Could not write shard " << fn << "\n";
+    return false;
+  }
+
+  done[chr] = n;
+  string manifest_fn = dir + "/manifest";
+  ofstream manifest(manifest_fn.c_str(), ios::app);
+  manifest << "done\t" << chr << "\t" << n << "\n";
+  manifest.close();
+  if (!manifest) {
+    cerr << "ERROR: Could not write " << manifest_fn << "\n";
+    return false;
+  }
+  return true;
+}
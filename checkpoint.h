@@ -0,0 +1,75 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  checkpoint
+// Resumable runs (hamr_cmd call --checkpoint-dir=DIR): the nucleotide
+// frequency rows of each chromosome are saved in DIR as a shard as soon
+// as the chromosome has been piled up, and DIR/manifest lists the
+// finished shards along with a fingerprint of the inputs and pileup
+// options they were made from. A rerun with the same fingerprint only
+// piles up the chromosomes without a shard; a different fingerprint
+// discards them all. Shards don't depend on the statistics options, so
+// a rerun changing only those reuses every shard.
+
+#ifndef HAMR_CHECKPOINT_H
+#define HAMR_CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "pileup.h"
+
+using namespace std;
+
+class Checkpoint {
+  string dir;
+  vector<string> fingerprint;
+  // finished chromosomes and their numbers of rows
+  map<string, unsigned long> done;
+
+  bool write_manifest() const;
+
+public:
+  // use dir (created if needed) for a run with this fingerprint; shards
+  // made from other inputs, or gone missing, are discarded. Returns
+  // false on error
+  bool open(const string &dir, const vector<string> &fingerprint);
+
+  bool is_done(const string &chr) const { return done.count(chr) > 0; }
+  size_t num_done() const { return done.size(); }
+
+  // where the shard of chr is kept
+  string shard_fn(const string &chr) const;
+
+  // save n rows of the nucleotide frequency table as the shard of chr,
+  // and record it in the manifest. Returns false on error
+  bool save(const string &chr, const OutputBuffer &rows, unsigned long n);
+};
+
+// the chromosomes of a BAM file, and the fingerprint of piling it up:
+// the size, modification time and header of the BAM file, the size and
+// modification time of the FASTA file, and the options that change the
+// sites. Returns false if the files can't be read
+bool fingerprint_pileup(const string &bam_fn, const string &fas_fn,
+			const PileupOptions &opts, vector<string> &chrs,
+			vector<string> &fingerprint);
+
+#endif
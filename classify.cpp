@@ -0,0 +1,455 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  classify
+// C++ version of classify_mods.R: predicts the modification type of each
+// significant site (sig == TRUE) from the frequencies of its three
+// non-reference nucleotides, by k-nearest neighbours (as R's class::knn)
+// among the training sites of a model for the same reference nucleotide.
+// Input:   - HAMR output table (from detect_mods or call)
+//          - Model exported by util/export_model.R
+// Output:  - The significant rows with a pred.mod column added
+//
+// Ties between classes are broken in favour of the first class in
+// sorted order rather than at random as knn does; sites whose
+// reference nucleotide has no model get NA.
+//
+// Model file (little-endian):
+//   "HAMRKNN1", int32 number of models, then for each model:
+//     string precursor (A, C, G or U), int32 number of classes,
+//     the class names as strings (sorted), int32 number of rows,
+//     rows x 3 float64 counts, rows x int32 class (0-based)
+//   where a string is an int32 length followed by its bytes
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cfloat>
+#include <stdint.h>
+
+#include "hamr.h"
+#include "output.h"
+#include "metrics.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAMR_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// training sites for one precursor; coordinates are the normalized
+// frequencies (1+count)/sum(1+counts) of the three non-reference
+// nucleotides, stored by column
+struct ModModel {
+  vector<string> classes;
+  vector<double> x[3];
+  vector<int> cls;
+
+  size_t size() const { return cls.size(); }
+};
+
+/////////////////////
+// reading the model
+
+static bool read_bytes(istream &in, void *buf, size_t n) {
+  return (bool)in.read((char *)buf, n);
+}
+
+static bool read_int32(istream &in, int32_t &v) {
+  unsigned char b[4];
+  if (!read_bytes(in, b, 4))
+    return false;
+  v = (int32_t)((uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+		((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24));
+  return true;
+}
+
+static bool read_float64(istream &in, double &v) {
+  unsigned char b[8];
+  if (!read_bytes(in, b, 8))
+    return false;
+  uint64_t u = 0;
+  for (int i=7; i >= 0; --i)
+    u = (u << 8) | b[i];
+  memcpy(&v, &u, sizeof(v));
+  return true;
+}
+
+static bool read_string(istream &in, string &s) {
+  int32_t len;
+  if (!read_int32(in, len) || len < 0 || len > 4096)
+    return false;
+  s.resize(len);
+  return len == 0 || read_bytes(in, &s[0], len);
+}
+
+static bool load_models(const string &fn, map<char, ModModel> &models) {
+  ifstream in(fn.c_str(), ios::binary);
+  if (!in.is_open()) {
+    cerr << "ERROR: Could not open model " << fn << "\n";
+    return false;
+  }
+  char magic[8];
+  int32_t n_models;
+  if (!read_bytes(in, magic, 8) || memcmp(magic, "HAMRKNN1", 8) != 0 ||
+      !read_int32(in, n_models)) {
+    cerr << "ERROR: " << fn << " is not a model file "
+	 << "(see util/export_model.R)\n";
+    return false;
+  }
+  for (int m=0; m < n_models; ++m) {
+    string precursor;
+    int32_t n_classes, n_rows;
+    bool ok = read_string(in, precursor) && precursor.size() == 1 &&
+      read_int32(in, n_classes) && n_classes > 0;
+    ModModel &model = models[ok ? precursor[0] : ' '];
+    for (int i=0; ok && i < n_classes; ++i) {
+      model.classes.push_back("");
+      ok = read_string(in, model.classes.back());
+    }
+    ok = ok && read_int32(in, n_rows) && n_rows >= 0;
+    for (int i=0; ok && i < n_rows; ++i) {
+      double c[3];
+      ok = read_float64(in, c[0]) && read_float64(in, c[1]) &&
+	read_float64(in, c[2]);
+      // x.n = sweep(1+x, 1, rowSums(1+x), '/')
+      double sum = (1 + c[0]) + (1 + c[1]) + (1 + c[2]);
+      for (int k=0; k < 3; ++k)
+	model.x[k].push_back((1 + c[k]) / sum);
+    }
+    for (int i=0; ok && i < n_rows; ++i) {
+      int32_t cls;
+      ok = read_int32(in, cls) && cls >= 0 && cls < n_classes;
+      model.cls.push_back(cls);
+    }
+    if (!ok) {
+      cerr << "ERROR: malformed model " << fn << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+/////////////////////
+// squared distances from one site to every training site
+
+static void site_distances_scalar(const ModModel &model, const double *t,
+				  double *dist) {
+  for (size_t j=0; j < model.size(); ++j) {
+    double d = 0.0;
+    for (int k=0; k < 3; ++k) {
+      double tmp = t[k] - model.x[k][j];
+      d += tmp * tmp;
+    }
+    dist[j] = d;
+  }
+}
+
+#ifdef HAMR_X86_KERNELS
+
+// 4 training sites at a time; the sums are added in the same order as
+// the scalar version, so the distances (and ties) are identical
+__attribute__((target("avx2")))
+static void site_distances_avx2(const ModModel &model, const double *t,
+				double *dist) {
+  const size_t n = model.size();
+  const __m256d t0 = _mm256_set1_pd(t[0]);
+  const __m256d t1 = _mm256_set1_pd(t[1]);
+  const __m256d t2 = _mm256_set1_pd(t[2]);
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d a = _mm256_sub_pd(t0, _mm256_loadu_pd(&model.x[0][j]));
+    __m256d b = _mm256_sub_pd(t1, _mm256_loadu_pd(&model.x[1][j]));
+    __m256d c = _mm256_sub_pd(t2, _mm256_loadu_pd(&model.x[2][j]));
+    __m256d d = _mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+    d = _mm256_add_pd(d, _mm256_mul_pd(c, c));
+    _mm256_storeu_pd(dist + j, d);
+  }
+  for (; j < n; ++j) {
+    double d = 0.0;
+    for (int k=0; k < 3; ++k) {
+      double tmp = t[k] - model.x[k][j];
+      d += tmp * tmp;
+    }
+    dist[j] = d;
+  }
+}
+
+#endif
+
+// dispatch, decided once (HAMR_SIMD=scalar forces the scalar version,
+// as for the pileup kernels)
+struct DistanceKernel {
+  const char *name;
+  void (*distances)(const ModModel &, const double *, double *);
+
+  DistanceKernel() : name("scalar"), distances(site_distances_scalar) {
+#ifdef HAMR_X86_KERNELS
+    const char *want = getenv("HAMR_SIMD");
+    __builtin_cpu_init();
+    if ((want == NULL || strcmp(want, "scalar") != 0) &&
+	__builtin_cpu_supports("avx2")) {
+      name = "avx2";
+      distances = site_distances_avx2;
+    }
+#endif
+  }
+};
+
+static const DistanceKernel kernel;
+
+/////////////////////
+// k nearest neighbours, following VR_knn in R's class package: sites
+// tying with the k-th nearest (within a relative EPS) vote as well
+
+static const double KNN_EPS = 1e-4;
+static const int KNN_MAX_TIES = 1000;
+
+// the index of the predicted class, or -1 if there are too many ties
+static int knn_class(const ModModel &model, const double *dist, int k,
+		     vector<double> &nndist, vector<size_t> &pos,
+		     vector<int> &votes) {
+  const double far = 0.99 * DBL_MAX;
+  nndist.assign(KNN_MAX_TIES, far);
+  pos.assign(KNN_MAX_TIES, 0);
+  int kn = k;
+  for (size_t j=0; j < model.size(); ++j) {
+    if (dist[j] <= nndist[k-1] * (1 + KNN_EPS)) {
+      for (int i=0; i <= kn; ++i) {
+	if (dist[j] < nndist[i]) {
+	  for (int i1=kn; i1 > i; --i1) {
+	    nndist[i1] = nndist[i1-1];
+	    pos[i1] = pos[i1-1];
+	  }
+	  nndist[i] = dist[j];
+	  pos[i] = j;
+	  // keep an extra site if the last one ties with the k-th
+	  if (nndist[kn] <= nndist[k-1] && ++kn == KNN_MAX_TIES - 1)
+	    return -1;
+	  break;
+	}
+      }
+    }
+    nndist[kn] = far;
+  }
+
+  votes.assign(model.classes.size(), 0);
+  for (int i=0; i < k; ++i)
+    ++votes[model.cls[pos[i]]];
+  for (int i=k; i < kn && nndist[i] <= nndist[k-1] * (1 + KNN_EPS); ++i)
+    ++votes[model.cls[pos[i]]];
+
+  int best = 0;
+  for (size_t c=1; c < votes.size(); ++c)
+    if (votes[c] > votes[best])
+      best = c;
+  return best;
+}
+
+/////////////////////
+
+static void print_classify_usage(const vector<string> &args) {
+  cerr << "USAGE: " << args[0] << " [OPTIONS] mods.txt model.knn\n"
+       << "    predicts modification types of the significant sites in\n"
+       << "    mods.txt (- for stdin); see util/export_model.R for models\n\n"
+       << "    OPTIONS:\n"
+       << "      --k=K                  Number of nearest neighbours (1)\n";
+  print_metrics_options();
+}
+
+int classify_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  int k = 1;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("classify");
+
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    bool invalid = false;
+    bool conv_success = false;
+
+    if (parse_metrics_option(it->first, it->second, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (it->first == "--k") {
+      k = from_s<int>(it->second, conv_success);
+      if (!conv_success || k < 1 || k >= KNN_MAX_TIES - 1) {
+	cerr << "ERROR: invalid number of neighbours (" << it->second
+	     << "): must be a positive integer\n";
+	return(1);
+      }
+    }
+  }
+
+  if (positional_args.size() < 3) {
+    print_classify_usage(args);
+    return(1);
+  }
+
+  string in_fn = positional_args[1];
+  string model_fn = positional_args[2];
+
+  map<char, ModModel> models;
+  if (!load_models(model_fn, models))
+    return(1);
+  cerr << "  Using model " << model_fn << " (" << models.size()
+       << " reference nucleotides, " << kernel.name << " distances)\n";
+
+  // read from stdin or a file
+  istream* p_infile;
+  ifstream* p_in = NULL;
+  if (in_fn != "-") {
+    p_in = new ifstream(in_fn.c_str());
+    if (!p_in->is_open()) {
+      cerr << "ERROR: Could not open file " << in_fn << "\n";
+      delete p_in;
+      return(1);
+    }
+    p_infile = p_in;
+  }
+  else
+    p_infile = &cin;
+
+  istream& infile = (*p_infile);
+
+  // columns are found by name in the header, as read.table(header=T)
+  string line;
+  vector<string> fields;
+  int refnuc_col = -1, sig_col = -1, count_col[4] = { -1, -1, -1, -1 };
+  if (getline(infile, line)) {
+    split_tabs(line, fields);
+    for (size_t i=0; i < fields.size(); ++i) {
+      if (fields[i] == "refnuc") refnuc_col = i;
+      else if (fields[i] == "sig") sig_col = i;
+      else if (fields[i] == "A") count_col[0] = i;
+      else if (fields[i] == "C") count_col[1] = i;
+      else if (fields[i] == "G") count_col[2] = i;
+      else if (fields[i] == "T") count_col[3] = i;
+    }
+  }
+  if (refnuc_col < 0 || sig_col < 0 || count_col[0] < 0 ||
+      count_col[1] < 0 || count_col[2] < 0 || count_col[3] < 0) {
+    cerr << "ERROR: " << in_fn << " is not a HAMR output table "
+	 << "(needs refnuc, A, C, G, T and sig columns)\n";
+    delete p_in;
+    return(1);
+  }
+
+  OutputWriter output;
+  OutputOptions out_opts;
+  if (!output.open("-", out_opts)) {
+    delete p_in;
+    return(1);
+  }
+  output.put(line);
+  output.put("\tpred.mod\n");
+
+  static const char NUCS[] = "ACGT";
+  vector<double> dist, nndist;
+  vector<size_t> pos;
+  vector<int> votes;
+  unsigned long line_num = 1, n_sig = 0, n_classified = 0;
+  ProgressMeter progress(metrics_opts.progress_interval, "rows");
+  double classify_time = metrics_now();
+  bool ok = true;
+  while (getline(infile, line)) {
+    ++line_num;
+    if ((line_num & 0xffff) == 0)
+      progress.update(line_num, "");
+    if (line.empty())
+      continue;
+    split_tabs(line, fields);
+    if ((int)fields.size() <= sig_col || (int)fields.size() <= refnuc_col) {
+      cerr << "ERROR: malformed line " << line_num << " in " << in_fn << "\n";
+      ok = false;
+      break;
+    }
+    if (fields[sig_col] != "TRUE")
+      continue;
+    ++n_sig;
+
+    // precursor = sub('T', 'U', refnuc)
+    const string &refnuc = fields[refnuc_col];
+    char precursor = (refnuc == "T") ? 'U' : refnuc[0];
+    map<char, ModModel>::const_iterator model = models.end();
+    if (refnuc.size() == 1)
+      model = models.find(precursor);
+
+    const char *pred = "NA";
+    if (model != models.end() && model->second.size() > 0) {
+      // x.test = 1 + counts of the other nucleotides; xn.test = x.test/sum
+      double t[3];
+      int n = 0;
+      for (int i=0; i < 4 && ok; ++i) {
+	if (NUCS[i] == refnuc[0])
+	  continue;
+	bool conv_success = false;
+	if ((int)fields.size() > count_col[i])
+	  t[n] = 1 + from_s<double>(fields[count_col[i]], conv_success);
+	if (!conv_success || n == 3) {
+	  cerr << "ERROR: malformed line " << line_num << " in "
+	       << in_fn << "\n";
+	  ok = false;
+	}
+	++n;
+      }
+      if (!ok)
+	break;
+      double sum = t[0] + t[1] + t[2];
+      for (int i=0; i < 3; ++i)
+	t[i] /= sum;
+
+      const ModModel &m = model->second;
+      dist.resize(m.size());
+      kernel.distances(m, t, &dist[0]);
+      int cls = knn_class(m, &dist[0], (k < (int)m.size()) ? k : m.size(),
+			  nndist, pos, votes);
+      if (cls >= 0) {
+	pred = m.classes[cls].c_str();
+	++n_classified;
+      }
+    }
+    output.put(line);
+    output.put('\t');
+    output.put(pred);
+    output.put('\n');
+  }
+  delete p_in;
+  classify_time = metrics_now() - classify_time;
+  if (!output.close() || !ok)
+    return(1);
+
+  cerr << "  Classified " << n_classified << " of " << n_sig
+       << " significant sites\n";
+  metrics.set("rows", "significant", n_sig);
+  metrics.set("rows", "classified", n_classified);
+  metrics.set("timers_s", "classify", classify_time);
+  return metrics.write_json(metrics_opts.json_fn) ? 0 : 1;
+}
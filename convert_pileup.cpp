@@ -0,0 +1,190 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  convert_pileup
+// Converts text .rnapileup files to the binary pileup format (see
+// binpileup.h) and back.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "hamr.h"
+#include "pileup.h"
+#include "binpileup.h"
+#include "metrics.h"
+
+using namespace std;
+
+// write a site in the text .rnapileup format. The pileup strings are
+// rebuilt from the counts: bases are grouped by symbol and read
+// start/end markers are gone. Only the minimum and the sum of the
+// qualities are kept, so the first base gets the minimum and the rest
+// of the sum is spread evenly over the others; read back, the text
+// gives the same site again.
+static void write_rnapileup_counts(ostream &out, const string &chr,
+				   const SiteCounts &site) {
+  string pileup, quals, readpos;
+  unsigned long n = site.nreads, rest = 0, extra = 0;
+  if (n > 1 && site.qual_sum >= (unsigned long)site.min_qual) {
+    rest = (site.qual_sum - site.min_qual) / (n - 1);
+    extra = (site.qual_sum - site.min_qual) % (n - 1);
+  }
+  for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+    if (site.counts[s] == 0)
+      continue;
+    for (int i=0; i <= site.max_readpos[s]; ++i) {
+      for (unsigned int j=0; j < site.readpos[s][i]; ++j) {
+	size_t k = quals.size();
+	unsigned long q = (k == 0) ? site.min_qual :
+	  rest + ((k <= extra) ? 1 : 0);
+	pileup += PILEUP_SYMBOLS[s];
+	quals += char(33 + q);
+	readpos += char(33 + i);
+      }
+    }
+  }
+
+  out << chr << "\t"
+      << 1+(site.pos) << "\t"
+      << site.ref << "\t"
+      << site.nreads << "\t"
+      << pileup << "\t"
+      << quals << "\t"
+      << readpos << "\n";
+}
+
+static void print_convert_usage(const vector<string> &args) {
+  cerr << "USAGE: " << args[0] << " [OPTIONS] in_pileup out_pileup\n\n"
+       << "    Converts a text .rnapileup file to the binary pileup format,\n"
+       << "    or a binary pileup file back to text. in_pileup may be - for\n"
+       << "    text on stdin, out_pileup - for stdout.\n\n"
+       << "    OPTIONS:\n";
+  print_metrics_options();
+}
+
+int convert_pileup_main(const vector<string> &args) {
+  // parse_arguments would take - (stdin/stdout) for an option
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("convert_pileup");
+  vector<string> positional_args;
+  for (size_t i=0; i < args.size(); ++i) {
+    if (args[i].compare(0, 2, "--") != 0 || i == 0) {
+      positional_args.push_back(args[i]);
+      continue;
+    }
+    size_t equals_at = args[i].find('=');
+    string key = args[i].substr(0, equals_at);
+    string value = (equals_at == string::npos) ? "" :
+      args[i].substr(equals_at + 1);
+    bool invalid = false;
+    if (parse_metrics_option(key, value, metrics_opts, invalid) && invalid)
+      return(1);
+  }
+
+  if (positional_args.size() < 3) {
+    print_convert_usage(args);
+    return(1);
+  }
+  string in_fn(positional_args[1]);
+  string out_fn(positional_args[2]);
+
+  ostream *p_out = &cout;
+  ofstream *p_outfile = NULL;
+  if (out_fn != "-") {
+    p_outfile = new ofstream(out_fn.c_str(), ios::out | ios::binary);
+    if (!p_outfile->is_open()) {
+      cerr << "Could not open file " << out_fn << " for writing\n";
+      delete p_outfile;
+      return(1);
+    }
+    p_out = p_outfile;
+  }
+
+  int status = 0;
+  SiteCounts site;
+  ProgressMeter progress(metrics_opts.progress_interval, "sites");
+  unsigned long n_sites = 0;
+
+  if (is_binpileup_file(in_fn)) {
+    // binary -> text
+    BinPileupReader reader;
+    if (!reader.open(in_fn))
+      status = 1;
+    for (size_t b=0; status == 0 && b < reader.num_blocks(); ++b) {
+      const string &chr = reader.chr_name(reader.block(b).chr);
+      BinPileupCursor c;
+      reader.start_block(b, c);
+      for (size_t i=0; i < reader.block(b).n_sites; ++i) {
+	if (!reader.next_site(c, site)) {
+	  cerr << "ERROR: corrupt site in block " << b << " of " << in_fn << "\n";
+	  status = 1;
+	  break;
+	}
+	write_rnapileup_counts(*p_out, chr, site);
+      }
+      n_sites += reader.block(b).n_sites;
+      progress.update(n_sites, chr);
+    }
+
+  } else {
+    // text -> binary
+    istream *p_in = &cin;
+    ifstream *p_infile = NULL;
+    if (in_fn != "-") {
+      p_infile = new ifstream(in_fn.c_str());
+      if (!p_infile->is_open()) {
+	cerr << "Could not open file " << in_fn << "\n";
+	delete p_infile;
+	delete p_outfile;
+	return(1);
+      }
+      p_in = p_infile;
+    }
+
+    BinPileupWriter writer(p_out);
+    string line, chr;
+    while (getline(*p_in, line)) {
+      parse_rnapileup_line(line, chr, site);
+      writer.visit_counts(chr, site);
+      if ((++n_sites & 0xffff) == 0)
+	progress.update(n_sites, chr);
+    }
+    writer.close();
+    delete p_infile;
+  }
+
+  if (p_outfile != NULL) {
+    p_outfile->close();
+    if (p_outfile->fail()) {
+      cerr << "ERROR: failed writing " << out_fn << "\n";
+      status = 1;
+    }
+    delete p_outfile;
+  }
+
+  if (status == 0) {
+    metrics.set("input", "sites", n_sites);
+    if (!metrics.write_json(metrics_opts.json_fn))
+      status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,153 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  detect_mods
+// C++ version of hamr_detect_mods.R
+// Input:   - Nucleotide frequency table
+//              (chr bp strand refnuc A C G T nonref)
+// Output:  - Table containing results for each site
+//
+// Rows are tested as they are read; only the counts and the two p-values
+// per row are kept for the FDR adjustment at the end, and past
+// --max-memory these are spilled to temporary files.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "hamr.h"
+#include "stats.h"
+#include "metrics.h"
+
+using namespace std;
+
+static void print_detect_mods_usage(const vector<string> &args,
+				    bool options_only=false) {
+  if (!options_only) {
+    cerr << "USAGE: " << args[0] << " [OPTIONS] in.nuc_freq_table\n\n"
+	 << "    OPTIONS:\n";
+  }
+  print_stats_options();
+  if (!options_only)
+    print_metrics_options();
+}
+
+int detect_mods_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  StatsOptions opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("detect_mods");
+
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    bool invalid = false;
+
+    if (parse_stats_option(it->first, it->second, opts, invalid) ||
+	parse_metrics_option(it->first, it->second, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (it->first == "--list-options") {
+      print_detect_mods_usage(args, true);
+      return(0);
+    }
+  }
+
+  if (positional_args.size() < 2) {
+    print_detect_mods_usage(args);
+    return(1);
+  }
+
+  string in_fn = positional_args[1];
+
+  print_stats_settings(opts);
+
+  // read from stdin or a file
+  istream* p_infile;
+  ifstream* p_in = NULL;
+  if (in_fn != "-") {
+    p_in = new ifstream(in_fn.c_str());
+    if (!p_in->is_open()) {
+      cerr << "ERROR: Could not open file " << in_fn << "\n";
+      delete p_in;
+      return(1);
+    }
+    p_infile = p_in;
+  }
+  else
+    p_infile = &cin;
+
+  istream& infile = (*p_infile);
+
+  ModsTable table;
+  table.limit_memory(opts.max_memory_mb, opts.temp_dir);
+  string line, chr;
+  NucFreqRow row;
+  unsigned long line_num = 0;
+  ProgressMeter progress(metrics_opts.progress_interval, "rows");
+  double read_time = metrics_now();
+  while (getline(infile, line)) {
+    ++line_num;
+    if ((line_num & 0xffff) == 0)
+      progress.update(line_num, chr);
+    if (line.empty())
+      continue;
+
+    if (!parse_nuc_freq_line(line, chr, row)) {
+      cerr << "ERROR: malformed line " << line_num << " in " << in_fn << "\n";
+      delete p_in;
+      return(1);
+    }
+    if (!table.add(chr, row, test_site(row, opts.seq_err))) {
+      delete p_in;
+      return(1);
+    }
+  }
+  delete p_in;
+  read_time = metrics_now() - read_time;
+  metrics.set("rows", "tested", (unsigned long)table.size());
+  metrics.set("timers_s", "read_test", read_time);
+
+  if (table.empty()) {
+    cerr << "WARNING: empty input to detect_mods (no mismatches found?)\n";
+    metrics.write_json(metrics_opts.json_fn);
+    return(1);
+  }
+
+  // FDR adjustment and writing the table
+  double write_time = 0;
+  bool written;
+  {
+    ScopedTimer timer(&write_time);
+    written = table.write(cout, opts);
+  }
+  metrics.set("timers_s", "write", write_time);
+  metrics.set("rows", "spilled", (unsigned long)table.spilled());
+  if (!written)
+    return(1);
+
+  return metrics.write_json(metrics_opts.json_fn) ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+
+#include "extsort.h"
+
+using namespace std;
+
+string default_temp_dir() {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0')
+    return "/tmp";
+  return dir;
+}
+
+FILE *create_temp_file(const string &dir, string &fn) {
+  string tmpl = (dir.empty() ? default_temp_dir() : dir) + "/hamr_sort.XXXXXX";
+  vector<char> name(tmpl.begin(), tmpl.end());
+  name.push_back('\0');
+  int fd = mkstemp(&name[0]);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: could not create a temporary file in %s: %s\n",
+	    (dir.empty() ? default_temp_dir() : dir).c_str(), strerror(errno));
+    return NULL;
+  }
+  fn = &name[0];
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "ERROR: could not open temporary file %s\n", fn.c_str());
+    close(fd);
+    remove(fn.c_str());
+  }
+  return fp;
+}
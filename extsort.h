@@ -0,0 +1,239 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  extsort
+// Sorting more fixed-size records than fit in memory: records are kept
+// in a buffer of bounded size that is sorted and spilled to a temporary
+// file (a run) whenever it fills up. At the end, runs are merged
+// MERGE_FAN_IN at a time until one last merge can hand the records back
+// in order. If nothing was spilled everything stays in memory.
+// Records are written with fwrite, so T must be a plain struct.
+
+#ifndef HAMR_EXTSORT_H
+#define HAMR_EXTSORT_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+
+using namespace std;
+
+// $TMPDIR, or /tmp if it isn't set
+string default_temp_dir();
+
+// create a new temporary file in dir and open it for writing; fn is set
+// to its name. Returns NULL (and prints a message) on error
+FILE *create_temp_file(const string &dir, string &fn);
+
+template <class T, class Less>
+class ExternalSorter {
+  static const size_t MERGE_FAN_IN = 64;
+
+  // a run being merged and its next record
+  struct Head {
+    T rec;
+    size_t src;
+  };
+  struct HeadGreater {
+    Less less;
+    bool operator()(const Head &a, const Head &b) const {
+      return less(b.rec, a.rec);
+    }
+  };
+  typedef priority_queue<Head, vector<Head>, HeadGreater> HeadQueue;
+
+  string temp_dir;
+  size_t max_records;
+  unsigned long long n;
+  bool error;
+
+  vector<T> buf;
+  // sorted runs spilled so far
+  vector<string> runs;
+
+  // reading back: from buf if nothing was spilled, else from the merge
+  // of the last runs
+  bool finished;
+  size_t buf_pos;
+  vector<FILE *> merge_in;
+  HeadQueue heads;
+
+  ExternalSorter(const ExternalSorter &);
+  ExternalSorter &operator=(const ExternalSorter &);
+
+  void fail(const string &msg, const string &fn) {
+    if (!error)
+      fprintf(stderr, "ERROR: %s %s\n", msg.c_str(), fn.c_str());
+    error = true;
+  }
+
+  bool read_rec(size_t src, T &rec) {
+    if (fread(&rec, sizeof(T), 1, merge_in[src]) == 1)
+      return true;
+    if (ferror(merge_in[src]))
+      fail("could not read temporary file", runs[src]);
+    return false;
+  }
+
+  // open runs[first..last) for merging
+  bool start_merge(size_t first, size_t last) {
+    close_merge();
+    for (size_t i=first; i < last; ++i) {
+      FILE *fp = fopen(runs[i].c_str(), "rb");
+      if (fp == NULL) {
+	fail("could not open temporary file", runs[i]);
+	return false;
+      }
+      merge_in.push_back(fp);
+    }
+    Head h;
+    for (h.src=0; h.src < merge_in.size(); ++h.src)
+      if (read_rec(h.src, h.rec))
+	heads.push(h);
+    return !error;
+  }
+
+  bool next_merged(T &rec) {
+    if (heads.empty())
+      return false;
+    Head h = heads.top();
+    heads.pop();
+    rec = h.rec;
+    if (read_rec(h.src, h.rec))
+      heads.push(h);
+    return true;
+  }
+
+  void close_merge() {
+    for (size_t i=0; i < merge_in.size(); ++i)
+      fclose(merge_in[i]);
+    merge_in.clear();
+    heads = HeadQueue();
+  }
+
+  void spill() {
+    sort(buf.begin(), buf.end(), Less());
+    string fn;
+    FILE *fp = create_temp_file(temp_dir, fn);
+    if (fp == NULL) {
+      error = true;
+      return;
+    }
+    runs.push_back(fn);
+    if (!buf.empty() && fwrite(&buf[0], sizeof(T), buf.size(), fp) != buf.size())
+      fail("could not write temporary file", fn);
+    if (fclose(fp) != 0)
+      fail("could not write temporary file", fn);
+    buf.clear();
+  }
+
+  // replace the first MERGE_FAN_IN runs with their merge
+  void merge_front() {
+    string fn;
+    FILE *out = create_temp_file(temp_dir, fn);
+    if (out == NULL) {
+      error = true;
+      return;
+    }
+    T rec;
+    if (start_merge(0, MERGE_FAN_IN)) {
+      while (next_merged(rec))
+	if (fwrite(&rec, sizeof(T), 1, out) != 1) {
+	  fail("could not write temporary file", fn);
+	  break;
+	}
+    }
+    close_merge();
+    if (fclose(out) != 0)
+      fail("could not write temporary file", fn);
+    for (size_t i=0; i < MERGE_FAN_IN; ++i)
+      remove(runs[i].c_str());
+    runs.erase(runs.begin(), runs.begin() + MERGE_FAN_IN);
+    runs.push_back(fn);
+  }
+
+public:
+  // keep at most max_bytes of records in memory, spilling to temp_dir
+  ExternalSorter(size_t max_bytes, const string &temp_dir) :
+    temp_dir(temp_dir), n(0), error(false), finished(false), buf_pos(0) {
+    max_records = max_bytes / sizeof(T);
+    if (max_records < 1024)
+      max_records = 1024;
+  }
+
+  ~ExternalSorter() { clear(); }
+
+  // returns false after an error
+  bool add(const T &rec) {
+    buf.push_back(rec);
+    ++n;
+    if (buf.size() >= max_records)
+      spill();
+    return !error;
+  }
+
+  unsigned long long size() const { return n; }
+  bool spilled() const { return !runs.empty(); }
+  bool failed() const { return error; }
+
+  // done adding; the records can now be read back with next()
+  bool finish() {
+    finished = true;
+    if (runs.empty()) {
+      sort(buf.begin(), buf.end(), Less());
+      return true;
+    }
+    if (!buf.empty())
+      spill();
+    vector<T>().swap(buf);
+    while (runs.size() > MERGE_FAN_IN && !error)
+      merge_front();
+    return !error && start_merge(0, runs.size());
+  }
+
+  // the next record in sorted order; false at the end or on error
+  bool next(T &rec) {
+    if (error || !finished)
+      return false;
+    if (runs.empty()) {
+      if (buf_pos == buf.size())
+	return false;
+      rec = buf[buf_pos++];
+      return true;
+    }
+    return next_merged(rec);
+  }
+
+  // drop all records and temporary files
+  void clear() {
+    close_merge();
+    for (size_t i=0; i < runs.size(); ++i)
+      remove(runs[i].c_str());
+    runs.clear();
+    vector<T>().swap(buf);
+    n = 0;
+    buf_pos = 0;
+    finished = false;
+  }
+};
+
+#endif
@@ -27,6 +27,14 @@ using namespace std;
 
 int rnapileup_main (const vector<string> &args);
 int rnapileup2mismatchbed_main (const vector<string> &args);
+int call_main (const vector<string> &args);
+int detect_mods_main (const vector<string> &args);
+int convert_pileup_main (const vector<string> &args);
+int simulate_main (const vector<string> &args);
+int bench_main (const vector<string> &args);
+int batch_main (const vector<string> &args);
+int classify_main (const vector<string> &args);
+int annotate_main (const vector<string> &args);
 
 // key=value command line arguments
 typedef map<string, string> arg_collection;
@@ -35,6 +43,12 @@ void parse_arguments(const vector<string> &args,
 		     arg_collection &value_args,
 		     vector<string> &positional_args);
 
+// split a tab-delimited line into fields
+void split_tabs(const string &line, vector<string> &fields);
+
+// number of lines in a file (0 if it can't be read)
+unsigned long count_lines(const string &fn);
+
 // convert value from string (usually to int)
 // and set the success variable on success
 template< typename T >
@@ -46,3 +60,11 @@ inline T from_s(const std::string& str, bool &success) {
   return result;
 }
 
+// the reverse: value as a string
+template< typename T >
+inline std::string to_s(const T &value) {
+  std::ostringstream oss;
+  oss << value;
+  return oss.str();
+}
+
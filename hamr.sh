@@ -28,10 +28,15 @@ function print_usage() {
   echo "    OPTIONS:" >&2
   echo "     Sequencing data options:" >&2
   ./hamr_cmd rnapileup --list-options
-  echo "      --no-check-sorted      Don't check if BAM is sorted" >&2
+  echo "      --single-pass          Go straight from BAM to mods table in one" >&2
+  echo "                               process (hamr_cmd call), without" >&2
+  echo "                               writing intermediate files" >&2
+  echo "      --resume               Single pass, keeping per-chromosome counts in" >&2
+  echo "                               output_prefix_checkpoint/ so that a rerun" >&2
+  echo "                               picks up where a failed run stopped" >&2
   echo "" >&2
   echo "     Modification detection options:" >&2
-  ./hamr_detect_mods.R --list-options
+  ./hamr_cmd detect_mods --list-options
   echo "" >&2
   echo "      --help                 Print this message and exit" >&2
   echo "      --version              Print version number and exit" >&2
@@ -45,7 +50,7 @@ req_args=3
 # parse command line arguments
 while test $# -gt 0
 do
-    if [[ "${1:0:1}" == "-" ]]; then
+    if [[ "${1:0:1}" == "-" && "$1" != "-" ]]; then
 	opts=("${opts[@]}" "$1")
     else
 	args=("${args[@]}" "$1")
@@ -58,7 +63,11 @@ for i in "${opts[@]}"; do
     case $i in
 	--help) print_usage; exit 0;;
 	--version) echo "${PROGRAM} ${VERSION}"; exit 0;;
-	--no-check-sorted) no_check_sorted=1;;
+	# the sort order is checked by hamr_cmd as it reads; still
+	# accepted for old command lines
+	--no-check-sorted) ;;
+	--single-pass) single_pass=1;;
+	--resume) single_pass=1; resume=1;;
     esac
 done
 
@@ -82,22 +91,28 @@ if [[ ! -e `dirname $outpre` ]]; then
     mkdir -p `dirname $outpre`
 fi
 
-if [[ -z $no_check_sorted ]]; then
-    echo "Checking if BAM file is sorted..." >&2
-    samtools view "${in_bam}" | sort -k3,3 -k4n,4n --check=quiet
+if [[ -n $single_pass ]]; then
+    echo "Computing pileup and testing for statistical significance..." >&2
+    ./hamr_cmd call ${opts[@]} ${resume:+--checkpoint-dir=${outpre}_checkpoint} \
+      "${in_bam}" "${genome_fas}" \
+      > ${outpre}_mods.txt
+
     if [[ $? -ne 0 ]]; then
-	echo "ERROR: BAM file not sorted. If this is incorrect," >&2
-	echo "         proceed anyway with --no-check-sorted" >&2
+	echo "ERROR: single-pass analysis failed" >&2
 	exit 1
     fi
-else
-    echo "Skipping check of BAM sortedness..." >&2
+
+    echo "Analysis complete." >&2
+    exit 0
 fi
 
-# Generate RNA pileup
+# Generate RNA pileup, written directly as the nucleotide frequency
+# table of mismatched sites (same as rnapileup | rnapileup2mismatchbed,
+# then hamr_mismatchbed2table.sh on each strand and sort -m, without
+# the large intermediate files)
 echo "Computing RNA pileup..." >&2
-./hamr_cmd rnapileup ${opts[@]} "${in_bam}" "${genome_fas}" \
- > ${outpre}.rnapileup
+./hamr_cmd rnapileup ${opts[@]} --output-format=nucfreq \
+  "${in_bam}" "${genome_fas}" > ${outpre}_mismatches_sorted.txt
 
 if [[ $? -ne 0 ]]; then
     echo "ERROR: Failed to generate RNA pileup" >&2
@@ -106,40 +121,9 @@ else
     echo "Succesfully generated RNA pileup" >&2
 fi
 
-# Convert RNA pileup to BED file
-echo "Converting pileup to BED" >&2
-./hamr_cmd rnapileup2mismatchbed ${outpre}.rnapileup \
- > ${outpre}_mismatches.bed
-
-
-# it's easier to process consecutive lines for each locus
-# but order isn't guaranteed wrt strand in mismatches.bed
-# so split it into + and - files for processing
-
-# NOTE: doing this in parallel, thus requiring 2 CPUs
-
-echo "Converting fwd strand to nuc freq table..." >&2
-awk '$6 == "+"' ${outpre}_mismatches.bed | \
-  ./hamr_mismatchbed2table.sh | \
-  awk '$9 > 0' > \
-    ${outpre}_mismatches_fwd.txt &
-
-echo "Converting rev strand to nuc freq table..." >&2
-awk '$6 == "-"' ${outpre}_mismatches.bed | \
-  ./hamr_mismatchbed2table.sh | \
-  awk '$9 > 0' > \
-    ${outpre}_mismatches_rev.txt &
-
-wait
-
-echo "Sorting nuc freq table..." >&2
-sort -m -k1,1 -k2n,2n -k3 \
-  ${outpre}_mismatches_fwd.txt ${outpre}_mismatches_rev.txt \
-  > ${outpre}_mismatches_sorted.txt
-
 # Detect modifications using statistical testing
 echo "Testing for statistical significance..." >&2
-./hamr_detect_mods.R ${opts[@]} ${outpre}_mismatches_sorted.txt \
+./hamr_cmd detect_mods ${opts[@]} ${outpre}_mismatches_sorted.txt \
   > ${outpre}_mods.txt
 
 if [[ $? -ne 0 ]]; then
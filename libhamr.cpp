@@ -0,0 +1,50 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <string>
+
+#include "libhamr.h"
+
+using namespace std;
+
+// hands the sites of run_pileup to a SiteCallback
+class CallbackVisitor : public SiteVisitor {
+  SiteCallback callback;
+  void *data;
+
+public:
+  CallbackVisitor(SiteCallback callback, void *data) :
+    callback(callback), data(data) { }
+
+  bool use_counts() const { return true; }
+
+  void visit_counts(const string &ref_id, const SiteCounts &site) {
+    callback(ref_id, site, data);
+  }
+};
+
+int pileup_sites(const string &bam_fn, const string &fas_fn,
+		 const PileupOptions &opts, SiteCallback callback, void *data,
+		 PileupStats &stats) {
+  PileupOptions serial_opts(opts);
+  serial_opts.threads = 1;
+  CallbackVisitor visitor(callback, data);
+  return run_pileup(bam_fn, fas_fn, serial_opts, visitor, stats);
+}
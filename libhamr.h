@@ -0,0 +1,80 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  libhamr
+// HAMR's pileup and statistics as a library (libhamr.a, and libhamr.so
+// with make shared), for programs that want the counts at each site
+// without running hamr_cmd and parsing its text output; hamr_cmd itself
+// is main.cpp linked against it. Everything is in the headers included
+// below; the main entry points are:
+//   PileupOptions      the filters (--min-q etc.) as a struct
+//   run_pileup         pile up a BAM file, handing each site to a
+//                        SiteVisitor as SiteCounts (use_counts() true)
+//                        or as a Pileup with the pileup strings
+//   pileup_sites       the same with a plain callback function
+//   run_multi_pileup   several BAM files in one pass over the reference
+//   site_nuc_freq_row  one strand of a site as a nucleotide frequency row
+//   test_site          the H0_1/H0_4 p-values of a row
+// Messages and errors go to stderr, as in hamr_cmd.
+//
+// For example, counting the + strand sites with mismatches:
+//
+//   static void count_site(const string &chr, const SiteCounts &site,
+//                          void *data) {
+//     NucFreqRow row;
+//     if (site_nuc_freq_row(site, '+', row))
+//       ++*(unsigned long *)data;
+//   }
+//
+//   PileupOptions opts;
+//   opts.min_q = 30;
+//   unsigned long n = 0;
+//   PileupStats stats;
+//   if (pileup_sites("reads.bam", "genome.fa", opts, count_site, &n,
+//                    stats) != 0)
+//     ... error
+//
+// and linking with -lhamr -lbam -lz -lpthread.
+
+#ifndef HAMR_LIBHAMR_H
+#define HAMR_LIBHAMR_H
+
+#include <string>
+
+#include "pileup.h"
+#include "stats.h"
+
+using namespace std;
+
+#define HAMR_VERSION "1.2.0"
+
+// called with each site that passes the filters, in BAM order; data is
+// whatever was given to pileup_sites
+typedef void (*SiteCallback)(const string &chr, const SiteCounts &site,
+			     void *data);
+
+// run_pileup with a callback instead of a SiteVisitor. The callback is
+// called from one thread, so opts.threads is ignored. Returns nonzero on
+// error
+int pileup_sites(const string &bam_fn, const string &fas_fn,
+		 const PileupOptions &opts, SiteCallback callback, void *data,
+		 PileupStats &stats);
+
+#endif
@@ -41,7 +41,8 @@ void test_parse_arguments(const vector<string> &args) {
 int main(int argc, char **argv) {
   if (argc < 2) {
     cerr << "USAGE: " << argv[0] << " cmd\n" 
-	 << "    where cmd is rnapileup|filter_pileup|rnapileup2mismatchbed\n";
+	 << "    where cmd is rnapileup|filter_pileup|rnapileup2mismatchbed|call|detect_mods|\n"
+	 << "                 batch|classify|annotate|convert_pileup|simulate|bench\n";
     return(1);
   }
 
@@ -59,6 +60,22 @@ int main(int argc, char **argv) {
     return (rnapileup_main(args));
   else if (cmd == "rnapileup2mismatchbed")
     return (rnapileup2mismatchbed_main(args));
+  else if (cmd == "call")
+    return (call_main(args));
+  else if (cmd == "batch")
+    return (batch_main(args));
+  else if (cmd == "detect_mods")
+    return (detect_mods_main(args));
+  else if (cmd == "classify")
+    return (classify_main(args));
+  else if (cmd == "annotate")
+    return (annotate_main(args));
+  else if (cmd == "convert_pileup")
+    return (convert_pileup_main(args));
+  else if (cmd == "simulate")
+    return (simulate_main(args));
+  else if (cmd == "bench")
+    return (bench_main(args));
   else {
     cerr << "Invalid command: " << cmd << "\n";
     return(1);
@@ -0,0 +1,197 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "hamr.h"
+#include "metrics.h"
+
+using namespace std;
+
+bool parse_metrics_option(const string &key, const string &value,
+			  MetricsOptions &opts, bool &invalid) {
+  bool conv_success = false;
+  invalid = false;
+
+  if (key == "--stats-json") {
+    opts.json_fn = value;
+    if (opts.json_fn.empty()) {
+      cerr << "Invalid value for --stats-json: must be a file name\n";
+      invalid = true;
+    }
+
+  } else if (key == "--progress") {
+    opts.progress_interval = 10;
+    if (!value.empty()) {
+      opts.progress_interval = from_s<double>(value, conv_success);
+      if (!conv_success || !(opts.progress_interval > 0)) {
+	cerr << "Invalid value for --progress: "
+	     << value << "; must be a positive number of seconds\n";
+	invalid = true;
+      }
+    }
+
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void print_metrics_options() {
+  cerr   << "      --stats-json=FILE      Write counters and stage timings to FILE\n"
+	 << "      --progress[=SECONDS]   Report progress every SECONDS (10)\n";
+}
+
+double metrics_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long peak_rss_kb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
+}
+
+/////////////////////
+
+ProgressMeter::ProgressMeter(double interval, const string &unit) :
+  interval(interval), start(metrics_now()), last(start), last_count(0),
+  unit(unit) { }
+
+void ProgressMeter::report(unsigned long count, const string &where) {
+  double now = metrics_now();
+  double rate = (now > last) ? (count - last_count) / (now - last) : 0;
+  cerr << "  progress: " << fixed << setprecision(1) << (now - start)
+       << " s, " << count << " " << unit << " ("
+       << setprecision(0) << rate << " " << unit << "/s)";
+  cerr.unsetf(ios_base::floatfield);
+  cerr << setprecision(6);
+  if (!where.empty())
+    cerr << ", at " << where;
+  cerr << ", " << peak_rss_kb() << " KB peak RSS\n";
+  last = now;
+  last_count = count;
+}
+
+/////////////////////
+
+// a string as a JSON string literal
+static string json_string(const string &s) {
+  string out("\"");
+  for (size_t i=0; i < s.size(); ++i) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+RunMetrics::RunMetrics(const string &command) :
+  command(command), start(metrics_now()) { }
+
+void RunMetrics::set_json(const string &section, const string &key,
+			  const string &json) {
+  size_t s = 0;
+  while (s < sections.size() && sections[s].name != section)
+    ++s;
+  if (s == sections.size()) {
+    sections.push_back(Section());
+    sections.back().name = section;
+  }
+  vector<pair<string, string> > &values = sections[s].values;
+  for (size_t i=0; i < values.size(); ++i) {
+    if (values[i].first == key) {
+      values[i].second = json;
+      return;
+    }
+  }
+  values.push_back(make_pair(key, json));
+}
+
+void RunMetrics::set(const string &section, const string &key,
+		     unsigned long value) {
+  ostringstream s;
+  s << value;
+  set_json(section, key, s.str());
+}
+
+void RunMetrics::set(const string &section, const string &key,
+		     double value) {
+  ostringstream s;
+  s << setprecision(6) << value;
+  set_json(section, key, s.str());
+}
+
+void RunMetrics::set(const string &section, const string &key,
+		     const string &value) {
+  set_json(section, key, json_string(value));
+}
+
+bool RunMetrics::write_json(const string &fn) const {
+  if (fn.empty())
+    return true;
+
+  ofstream out(fn.c_str());
+  if (!out.is_open()) {
+    cerr << "ERROR: Could not open " << fn << " for --stats-json\n";
+    return false;
+  }
+
+  out << "{\n"
+      << "  \"command\": " << json_string(command) << ",\n"
+      << "  \"elapsed_s\": " << setprecision(6) << (metrics_now() - start)
+      << ",\n"
+      << "  \"peak_rss_kb\": " << peak_rss_kb();
+  for (size_t s=0; s < sections.size(); ++s) {
+    out << ",\n  " << json_string(sections[s].name) << ": {";
+    const vector<pair<string, string> > &values = sections[s].values;
+    for (size_t i=0; i < values.size(); ++i)
+      out << (i ? ",\n    " : "\n    ") << json_string(values[i].first)
+	  << ": " << values[i].second;
+    out << "\n  }";
+  }
+  out << "\n}\n";
+
+  out.close();
+  if (!out) {
+    cerr << "ERROR: Could not write " << fn << "\n";
+    return false;
+  }
+  return true;
+}
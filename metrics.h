@@ -0,0 +1,122 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  metrics
+// Run statistics for every hamr_cmd command: counters and stage timers
+// collected during a run and written as a JSON document
+// (--stats-json=FILE), and progress lines on stderr while it runs
+// (--progress[=SECONDS]).
+
+#ifndef HAMR_METRICS_H
+#define HAMR_METRICS_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct MetricsOptions {
+  // where to write the JSON document (empty for nowhere)
+  string json_fn;
+  // seconds between progress lines (0 for none)
+  double progress_interval;
+
+  MetricsOptions() : json_fn(), progress_interval(0) { }
+
+  // true if anything will be reported, so stages are worth timing
+  bool enabled() const { return !json_fn.empty() || progress_interval > 0; }
+};
+
+// handles --stats-json and --progress; returns false if key is not a
+// metrics option. invalid is set (and a message printed) on bad values
+bool parse_metrics_option(const string &key, const string &value,
+			  MetricsOptions &opts, bool &invalid);
+void print_metrics_options();
+
+// seconds on a monotonic clock
+double metrics_now();
+// peak resident set size of this process so far, in KB
+long peak_rss_kb();
+
+// adds the time until it goes out of scope to *total (if not NULL)
+class ScopedTimer {
+  double *total;
+  double start;
+
+public:
+  ScopedTimer(double *total) :
+    total(total), start(total ? metrics_now() : 0) { }
+  ~ScopedTimer() {
+    if (total)
+      *total += metrics_now() - start;
+  }
+};
+
+// prints a progress line to stderr when at least interval seconds have
+// passed since the last one; update() is cheap when no line is due
+class ProgressMeter {
+  double interval;
+  double start;
+  double last;
+  unsigned long last_count;
+  string unit;
+
+public:
+  ProgressMeter(double interval, const string &unit);
+
+  // count is the running total of units processed; where, if given,
+  // says how far along the input the run is
+  void update(unsigned long count, const string &where = "") {
+    if (interval > 0 && metrics_now() - last >= interval)
+      report(count, where);
+  }
+
+private:
+  void report(unsigned long count, const string &where);
+};
+
+// named values for the JSON document, grouped into sections; the
+// command, elapsed time and peak RSS are always included
+class RunMetrics {
+  struct Section {
+    string name;
+    vector<pair<string, string> > values;
+  };
+
+  string command;
+  double start;
+  vector<Section> sections;
+
+  void set_json(const string &section, const string &key,
+		const string &json);
+
+public:
+  RunMetrics(const string &command);
+
+  void set(const string &section, const string &key, unsigned long value);
+  void set(const string &section, const string &key, double value);
+  void set(const string &section, const string &key, const string &value);
+
+  // write the document to fn; returns false (and prints a message) on
+  // failure. Does nothing if fn is empty
+  bool write_json(const string &fn) const;
+};
+
+#endif
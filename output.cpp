@@ -0,0 +1,229 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <iostream>
+#include <cstdlib>
+
+#include "bgzf.h"
+#include "hamr.h"
+#include "output.h"
+
+using namespace std;
+
+// size of each output buffer, and how many the background thread may
+// have queued up before the producer waits
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+const int OUTPUT_BUFFERS = 4;
+
+bool parse_output_option(const string &key, const string &value,
+			 OutputOptions &opts, bool &invalid) {
+  bool conv_success = false;
+  invalid = false;
+
+  if (key == "--output-compression") {
+    if (value == "bgzf") {
+      opts.bgzf = true;
+    } else if (value == "none") {
+      opts.bgzf = false;
+    } else {
+      cerr << "Invalid value for --output-compression: " << value
+	   << "; must be none or bgzf\n";
+      invalid = true;
+    }
+
+  } else if (key == "--compression-threads") {
+    opts.compression_threads = from_s<int>(value, conv_success);
+    if (!conv_success || (opts.compression_threads < 1)) {
+      cerr << "Invalid value for --compression-threads: "
+	   << value << "; must be a positive integer\n";
+      invalid = true;
+    }
+
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void print_output_options() {
+  cerr   << "      --output-compression=C none, or bgzf for compressed output that\n"
+	 << "                               bgzip and tabix can read (none)\n"
+	 << "      --compression-threads=N Compress BGZF blocks on N threads (2)\n";
+}
+
+/////////////////////
+
+OutputBuffer::OutputBuffer() : buf(NULL), len(0), cap(0) { }
+
+OutputBuffer::~OutputBuffer() {
+  free(buf);
+}
+
+void OutputBuffer::overflow() {
+  cap = (cap == 0) ? 4096 : 2 * cap;
+  buf = (char *)realloc(buf, cap);
+  if (buf == NULL) {
+    cerr << "ERROR: out of memory for output\n";
+    exit(1);
+  }
+}
+
+/////////////////////
+
+OutputWriter::OutputWriter() :
+  fp(NULL), bgzf(NULL), failed(false), done(false),
+  thread_started(false) {
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+OutputWriter::~OutputWriter() {
+  if (thread_started)
+    close();
+  for (size_t i=0; i < free_bufs.size(); ++i)
+    free(free_bufs[i]);
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&cond);
+}
+
+bool OutputWriter::open(const string &fn, const OutputOptions &opts) {
+  if (opts.bgzf) {
+    BGZF *z = (fn == "-") ? bgzf_dopen(fileno(stdout), "w") :
+      bgzf_open(fn.c_str(), "w");
+    if (z == NULL) {
+      cerr << "ERROR: Could not open output file " << fn << "\n";
+      return false;
+    }
+    if (opts.compression_threads > 1)
+      bgzf_mt(z, opts.compression_threads, 256);
+    bgzf = z;
+  } else if (fn == "-") {
+    fp = stdout;
+  } else {
+    fp = fopen(fn.c_str(), "wb");
+    if (fp == NULL) {
+      cerr << "ERROR: Could not open output file " << fn << "\n";
+      return false;
+    }
+  }
+
+  for (int i=0; i < OUTPUT_BUFFERS; ++i)
+    free_bufs.push_back((char *)malloc(OUTPUT_BUFFER_SIZE));
+  buf = free_bufs.back();
+  free_bufs.pop_back();
+  cap = OUTPUT_BUFFER_SIZE;
+  len = 0;
+
+  pthread_create(&thread, NULL, writer_thread, this);
+  thread_started = true;
+  return true;
+}
+
+// queue the current buffer and take an empty one
+void OutputWriter::submit() {
+  pthread_mutex_lock(&lock);
+  full.push_back(buf);
+  full_len.push_back(len);
+  pthread_cond_broadcast(&cond);
+  while (free_bufs.empty())
+    pthread_cond_wait(&cond, &lock);
+  buf = free_bufs.back();
+  free_bufs.pop_back();
+  pthread_mutex_unlock(&lock);
+  len = 0;
+}
+
+void OutputWriter::overflow() {
+  if (!thread_started) {
+    // not opened: behave like a plain buffer
+    OutputBuffer::overflow();
+    return;
+  }
+  submit();
+}
+
+void *OutputWriter::writer_thread(void *data) {
+  static_cast<OutputWriter *>(data)->write_loop();
+  return NULL;
+}
+
+void OutputWriter::write_loop() {
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (full.empty() && !done)
+      pthread_cond_wait(&cond, &lock);
+    if (full.empty())
+      break;
+    char *b = full.front();
+    size_t n = full_len.front();
+    full.erase(full.begin());
+    full_len.erase(full_len.begin());
+    pthread_mutex_unlock(&lock);
+
+    bool ok;
+    if (bgzf != NULL)
+      ok = (bgzf_write((BGZF *)bgzf, b, n) == (ssize_t)n);
+    else
+      ok = (fwrite(b, 1, n, fp) == n);
+
+    pthread_mutex_lock(&lock);
+    if (!ok)
+      failed = true;
+    free_bufs.push_back(b);
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool OutputWriter::close() {
+  if (!thread_started)
+    return !failed;
+
+  if (len > 0)
+    submit();
+  pthread_mutex_lock(&lock);
+  done = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  thread_started = false;
+
+  // the last buffer taken by submit() goes back to the pool
+  free_bufs.push_back(buf);
+  buf = NULL;
+  cap = len = 0;
+
+  if (bgzf != NULL) {
+    if (bgzf_close((BGZF *)bgzf) != 0)
+      failed = true;
+    bgzf = NULL;
+  } else if (fp == stdout) {
+    if (fflush(fp) != 0)
+      failed = true;
+  } else if (fp != NULL) {
+    if (fclose(fp) != 0)
+      failed = true;
+  }
+  fp = NULL;
+
+  if (failed)
+    cerr << "ERROR: could not write output\n";
+  return !failed;
+}
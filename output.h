@@ -0,0 +1,153 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  output
+// Buffered text output for the commands writing large tables
+// (rnapileup, rnapileup2mismatchbed). Text is formatted into a large
+// buffer; full buffers are handed to a background thread which writes
+// them out, compressing them as BGZF with --output-compression=bgzf
+// (on a pool of threads, using samtools' bgzf_mt), so producing the
+// output never waits on the disk or on zlib. BGZF output can be
+// indexed with tabix like any bgzip'd file.
+
+#ifndef HAMR_OUTPUT_H
+#define HAMR_OUTPUT_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <pthread.h>
+
+using namespace std;
+
+struct OutputOptions {
+  bool bgzf;
+  // threads compressing BGZF blocks
+  int compression_threads;
+
+  OutputOptions() : bgzf(false), compression_threads(2) { }
+};
+
+// handles --output-compression and --compression-threads; returns false
+// if key is not an output option. invalid is set (and a message
+// printed) on bad values
+bool parse_output_option(const string &key, const string &value,
+			 OutputOptions &opts, bool &invalid);
+void print_output_options();
+
+// text in memory with fast formatting; used on its own for output that
+// is assembled before being written (regions piled up in parallel)
+class OutputBuffer {
+protected:
+  char *buf;
+  size_t len;
+  size_t cap;
+
+  // make room for at least one more byte; the default grows the buffer
+  virtual void overflow();
+
+public:
+  OutputBuffer();
+  virtual ~OutputBuffer();
+
+  void put(char c) {
+    if (len == cap)
+      overflow();
+    buf[len++] = c;
+  }
+
+  void put(const char *s, size_t n) {
+    while (n > 0) {
+      if (len == cap)
+	overflow();
+      size_t k = (n < cap - len) ? n : cap - len;
+      memcpy(buf + len, s, k);
+      len += k;
+      s += k;
+      n -= k;
+    }
+  }
+
+  void put(const string &s) { put(s.data(), s.size()); }
+
+  void put_uint(unsigned long x) {
+    char digits[24];
+    int n = 0;
+    do {
+      digits[n++] = char('0' + x % 10);
+      x /= 10;
+    } while (x != 0);
+    if (cap - len < (size_t)n) {
+      while (n > 0)
+	put(digits[--n]);
+      return;
+    }
+    while (n > 0)
+      buf[len++] = digits[--n];
+  }
+
+  void put_int(long x) {
+    if (x < 0) {
+      put('-');
+      put_uint(0UL - (unsigned long)x);
+    } else {
+      put_uint((unsigned long)x);
+    }
+  }
+
+  const char *data() const { return buf; }
+  size_t size() const { return len; }
+  void clear() { len = 0; }
+};
+
+// an OutputBuffer writing to a file (or stdout for "-") from a
+// background thread
+class OutputWriter : public OutputBuffer {
+  FILE *fp;
+  void *bgzf;
+  bool failed;
+
+  // buffers waiting to be written, and empty ones; guarded by lock
+  vector<char *> full;
+  vector<size_t> full_len;
+  vector<char *> free_bufs;
+  bool done;
+  pthread_t thread;
+  bool thread_started;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  void overflow();
+  void submit();
+  static void *writer_thread(void *data);
+  void write_loop();
+
+public:
+  OutputWriter();
+  ~OutputWriter();
+
+  // returns false (and prints a message) if the file can't be opened
+  bool open(const string &fn, const OutputOptions &opts);
+  // write everything out; returns false if anything failed
+  bool close();
+};
+
+#endif
@@ -0,0 +1,1869 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  pileup
+// The pileup engine behind rnapileup, call and batch (see pileup.h):
+// reads of a sorted BAM file are walked along their CIGAR strings into
+// Pileups or SiteCounts, which are handed to a SiteVisitor once no read
+// still to come can cover them. Also the text writers for the pileup
+// formats and the --threads/--regions and multi-sample drivers. The
+// history of the pileup is kept in rnapileup.cpp.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+#include <cctype>
+#include <climits>
+#include <sstream>
+#include <map>
+#include <set>
+#include <queue>
+#include <functional>
+#include <pthread.h>
+
+#include "sam.h"
+#include "faidx.h"
+#include "hamr.h"
+#include "pileup.h"
+#include "seqdecode.h"
+#include "output.h"
+#include "metrics.h"
+#include "stats.h"
+
+using namespace std;
+
+// base for visitors writing sites as text: when piling up in parallel
+// each region is written to its own buffer, appended to the output in
+// order
+class SiteTextWriter : public SiteVisitor {
+protected:
+  OutputBuffer &out;
+  // output of a single region, when piling up in parallel
+  OutputBuffer *region_out;
+
+  // an empty writer of the same kind writing to part_out
+  virtual SiteTextWriter *new_part(OutputBuffer &part_out) = 0;
+
+public:
+  SiteTextWriter(OutputBuffer &out) : out(out), region_out(NULL) { }
+  ~SiteTextWriter() { delete region_out; }
+
+  SiteVisitor *fork() {
+    OutputBuffer *buf = new OutputBuffer;
+    SiteTextWriter *part = new_part(*buf);
+    part->region_out = buf;
+    return part;
+  }
+
+  void merge(SiteVisitor *part) {
+    OutputBuffer *buf = static_cast<SiteTextWriter *>(part)->region_out;
+    out.put(buf->data(), buf->size());
+  }
+};
+
+// writes sites in the text .rnapileup format
+class RNAPileupWriter : public SiteTextWriter {
+protected:
+  SiteTextWriter *new_part(OutputBuffer &part_out) {
+    return new RNAPileupWriter(part_out);
+  }
+
+public:
+  RNAPileupWriter(OutputBuffer &out) : SiteTextWriter(out) { }
+
+  void visit(const string &ref_id, const Pileup &site) {
+    // output one-based coords
+    out.put(ref_id);
+    out.put('\t');
+    out.put_int(1+(site.pos));
+    out.put('\t');
+    out.put(site.ref);
+    out.put('\t');
+    out.put_int(site.nreads);
+    out.put('\t');
+    out.put(site.pileup);
+    out.put('\t');
+    out.put(site.quals);
+    out.put('\t');
+    out.put(site.readpos);
+#ifdef DEBUGMODE
+    out.put('\t');
+    for (int i=0; i < site.read_ids.size(); ++i) {
+      out.put(site.read_ids[i]);
+      out.put(',');
+    }
+#endif
+    out.put('\n');
+  }
+};
+
+// writes sites straight to the mismatch BED format of
+// rnapileup2mismatchbed, accumulating only counts per site
+class MismatchBedWriter : public SiteTextWriter {
+protected:
+  SiteTextWriter *new_part(OutputBuffer &part_out) {
+    return new MismatchBedWriter(part_out);
+  }
+
+public:
+  MismatchBedWriter(OutputBuffer &out) : SiteTextWriter(out) { }
+
+  bool use_counts() const { return true; }
+
+  void visit_counts(const string &ref_id, const SiteCounts &site) {
+    write_mismatch_bed(out, ref_id, site);
+  }
+};
+
+// writes the nucleotide frequency table of hamr_mismatchbed2table.sh
+// (rows with mismatches only, + strand before - strand at each site)
+class NucFreqWriter : public SiteTextWriter {
+protected:
+  SiteTextWriter *new_part(OutputBuffer &part_out) {
+    return new NucFreqWriter(part_out);
+  }
+
+public:
+  NucFreqWriter(OutputBuffer &out) : SiteTextWriter(out) { }
+
+  bool use_counts() const { return true; }
+
+  void visit_counts(const string &ref_id, const SiteCounts &site) {
+    NucFreqRow row;
+    if (site_nuc_freq_row(site, '+', row))
+      write_nuc_freq_row(out, ref_id, row);
+    if (site_nuc_freq_row(site, '-', row))
+      write_nuc_freq_row(out, ref_id, row);
+  }
+};
+
+SiteVisitor *new_text_writer(const string &format, OutputBuffer &out) {
+  if (format == "rnapileup")
+    return new RNAPileupWriter(out);
+  if (format == "mismatchbed")
+    return new MismatchBedWriter(out);
+  if (format == "nucfreq")
+    return new NucFreqWriter(out);
+  return NULL;
+}
+
+/////////////////////
+/*class DNAComplementer {
+  char c[256];
+public:
+  DNAComplementer() { 
+    for(int i=0; i<256; ++i)
+      c[i] = 'n';
+    c['a'] = 't'; c['c'] = 'g';  c['g'] = 'c'; c['t'] = 'a';
+    c['m'] = 'k'; c['r'] = 'y';  c['k'] = 'm'; c['y'] = 'r';
+    c['s'] = 's'; c['w'] = 'w';
+    c['v'] = 'b'; c['h'] = 'd'; c['b'] = 'v'; c['d'] = 'h';
+    for(int i='a'; i<='z'; ++i)
+      c[toupper(i)] = char(toupper(c[int(i)]));
+  }
+  char operator () (char x) const { return c[int(x)]; }
+  };*/
+
+/////////////////////
+
+void print_pileup_options() {
+  cerr   << "      --exclude-ends         Exclude 5' and 3' ends of reads\n"
+	 << "      --min-q=N              Exclude bases with Q score < N (15)\n"
+	 << "      --min-coverage=N       Exclude sites with < N reads covering (10)\n"
+	 << "      --min-nonref=N         Exclude sites with < N reads not matching\n"
+	 << "                               the reference (0)\n"
+	 << "      --min-nonref-fraction=F  Exclude sites where < F of the reads\n"
+	 << "                               don't match the reference (0)\n"
+	 << "      --not-strand-specific  Library not strand-specific (convert everything to +)\n"
+	 << "      --skip-indel-reads     Discard reads with insertions or deletions\n"
+	 << "      --max-depth=N          Keep a random sample of at most N bases per\n"
+	 << "                               site (0 for no limit) (0)\n"
+	 << "      --seed=N               Random seed for --max-depth (1)\n"
+	 << "      --threads=N            Pile up regions in parallel on N threads\n"
+	 << "                               (requires a BAM index) (1)\n"
+	 << "      --regions=FILE         Only pile up the regions in a BED file\n"
+	 << "                               (requires a BAM index)\n";
+}
+
+bool parse_pileup_option(const string &key, const string &value,
+			 PileupOptions &opts, bool &invalid) {
+  bool conv_success = false;
+  invalid = false;
+
+  if (key == "--not-strand-specific") {
+    opts.no_ss = true;
+
+  } else if (key == "--exclude-ends") {
+    opts.exclude_ends = true;
+
+  } else if (key == "--skip-indel-reads") {
+    opts.skip_indels = true;
+
+  } else if (key == "--min-q") {
+    opts.min_q = from_s<int>(value, conv_success);
+    if (!conv_success || (opts.min_q < 0)) {
+      cerr << "Invalid value for --min-q: " << value << "; must be a non-negative integer\n";
+      invalid = true;
+    }
+
+  } else if (key == "--min-coverage") {
+    opts.min_coverage = from_s<int>(value, conv_success);
+    if (!conv_success || (opts.min_coverage < 0)) {
+      cerr << "Invalid value for --min-coverage: "
+	   << value << "; must be a non-negative integer\n";
+      invalid = true;
+    }
+
+  } else if (key == "--min-nonref") {
+    opts.min_nonref = from_s<int>(value, conv_success);
+    if (!conv_success || (opts.min_nonref < 0)) {
+      cerr << "Invalid value for --min-nonref: "
+	   << value << "; must be a non-negative integer\n";
+      invalid = true;
+    }
+
+  } else if (key == "--min-nonref-fraction") {
+    opts.min_nonref_fraction = from_s<double>(value, conv_success);
+    if (!conv_success || opts.min_nonref_fraction < 0 ||
+	opts.min_nonref_fraction > 1) {
+      cerr << "Invalid value for --min-nonref-fraction: "
+	   << value << "; must be a real number in [0,1]\n";
+      invalid = true;
+    }
+
+  } else if (key == "--max-depth") {
+    opts.max_depth = from_s<int>(value, conv_success);
+    if (!conv_success || (opts.max_depth < 0)) {
+      cerr << "Invalid value for --max-depth: "
+	   << value << "; must be a non-negative integer\n";
+      invalid = true;
+    }
+
+  } else if (key == "--seed") {
+    opts.seed = from_s<unsigned long>(value, conv_success);
+    if (!conv_success) {
+      cerr << "Invalid value for --seed: "
+	   << value << "; must be a non-negative integer\n";
+      invalid = true;
+    }
+
+  } else if (key == "--regions") {
+    opts.regions_fn = value;
+    if (opts.regions_fn.empty()) {
+      cerr << "Invalid value for --regions: must be a BED file\n";
+      invalid = true;
+    }
+
+  } else if (key == "--threads") {
+    opts.threads = from_s<int>(value, conv_success);
+    if (!conv_success || (opts.threads < 1)) {
+      cerr << "Invalid value for --threads: "
+	   << value << "; must be a positive integer\n";
+      invalid = true;
+    }
+
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// output supplied arguments
+void print_pileup_settings(const PileupOptions &opts) {
+  if (opts.no_ss)
+    cerr << "  Treating library as non-stand-specific\n";
+  if (opts.exclude_ends)
+    cerr << "  Excluding ends of reads\n";
+  if (opts.skip_indels)
+    cerr << "  Discarding reads with indels\n";
+  cerr << "  Requiring Q-score >= " << opts.min_q << "\n";
+  cerr << "  Requiring " << opts.min_coverage << " coverage at a site\n";
+  if (opts.min_nonref > 0)
+    cerr << "  Requiring " << opts.min_nonref
+	 << " reads not matching the reference at a site\n";
+  if (opts.min_nonref_fraction > 0)
+    cerr << "  Requiring a fraction of " << opts.min_nonref_fraction
+	 << " of reads not matching the reference at a site\n";
+  if (opts.max_depth > 0)
+    cerr << "  Sampling at most " << opts.max_depth
+	 << " bases per site (seed " << opts.seed << ")\n";
+  if (!opts.regions_fn.empty())
+    cerr << "  Only piling up regions in " << opts.regions_fn << "\n";
+}
+
+void print_pileup_stats(const PileupStats &stats) {
+  double bases_excluded_end_pct = 100.0 * double(stats.bases_excluded_end) / 
+    double(stats.bases_encountered);
+  double bases_excluded_q_pct = 100.0 * double(stats.bases_excluded_q) / 
+    double(stats.bases_encountered);
+  double bases_excluded_depth_pct = 100.0 * double(stats.bases_excluded_depth) /
+    double(stats.bases_encountered);
+  double sites_excluded_cov_pct = 100.0 * double(stats.sites_excluded_cov) / 
+    double(stats.sites_encountered);
+
+  cerr << "Bases encountered: " << stats.bases_encountered << "\n"
+       << "Bases excluded due to being on read-end: " << setw(3) << bases_excluded_end_pct << "%\n"
+       << "Bases excluded due to low Q: " << setw(3) << bases_excluded_q_pct << "%\n"
+       << "Bases excluded due to max depth: " << setw(3) << bases_excluded_depth_pct << "%\n"
+       << "Sites encountered: " << stats.sites_encountered << "\n"
+       << "Sites excluded due to low coverage: " << setw(3) << sites_excluded_cov_pct << "%\n";
+  if (stats.sites_excluded_nonref > 0)
+    cerr << "Sites excluded due to few mismatches: " << setw(3)
+	 << 100.0 * double(stats.sites_excluded_nonref) /
+      double(stats.sites_encountered) << "%\n";
+}
+
+void PileupStats::add(const PileupStats &other) {
+  reads_used += other.reads_used;
+  reads_skipped_unmapped += other.reads_skipped_unmapped;
+  reads_skipped_indels += other.reads_skipped_indels;
+  bases_excluded_end += other.bases_excluded_end;
+  bases_excluded_q += other.bases_excluded_q;
+  bases_excluded_depth += other.bases_excluded_depth;
+  bases_encountered += other.bases_encountered;
+  sites_excluded_cov += other.sites_excluded_cov;
+  sites_excluded_nonref += other.sites_excluded_nonref;
+  sites_encountered += other.sites_encountered;
+  if (other.max_queued_sites > max_queued_sites)
+    max_queued_sites = other.max_queued_sites;
+  time_bam_decode += other.time_bam_decode;
+  time_ref_load += other.time_ref_load;
+  time_pileup += other.time_pileup;
+  time_output += other.time_output;
+}
+
+void set_pileup_metrics(RunMetrics &metrics, const PileupStats &stats) {
+  metrics.set("reads", "used", stats.reads_used);
+  metrics.set("reads", "skipped_unmapped", stats.reads_skipped_unmapped);
+  metrics.set("reads", "skipped_indels", stats.reads_skipped_indels);
+  metrics.set("bases", "encountered", stats.bases_encountered);
+  metrics.set("bases", "excluded_end", stats.bases_excluded_end);
+  metrics.set("bases", "excluded_q", stats.bases_excluded_q);
+  metrics.set("bases", "excluded_depth", stats.bases_excluded_depth);
+  metrics.set("sites", "encountered", stats.sites_encountered);
+  metrics.set("sites", "excluded_cov", stats.sites_excluded_cov);
+  metrics.set("sites", "excluded_nonref", stats.sites_excluded_nonref);
+  metrics.set("sites", "max_queued", stats.max_queued_sites);
+  metrics.set("timers_s", "bam_decode", stats.time_bam_decode);
+  metrics.set("timers_s", "ref_load", stats.time_ref_load);
+  metrics.set("timers_s", "pileup", stats.time_pileup);
+  metrics.set("timers_s", "output", stats.time_output);
+}
+
+///////////////////////
+
+// size of the sub-chromosome regions piled up in parallel (--threads)
+const int PARALLEL_REGION_SIZE = 1000000;
+
+// returns false for reads the pileup doesn't use, counting them by reason
+static bool usable_read(const bam1_t *bam, bool skip_indels,
+			PileupStats &stats) {
+  // skip non-unique reads
+  //int num_hits = bam_aux2i( bam_aux_get(bam, "NH") );
+  //if (num_hits > 1)
+  //  return false;
+
+  // skip unmapped reads
+  if ((bam->core.flag & 0x4) > 0) {
+    ++stats.reads_skipped_unmapped;
+    return false;
+  }
+
+  // optionally discard reads with indels
+  if (skip_indels) {
+    for(int i=0; i < bam->core.n_cigar; ++i) {
+      if (bam_cigar_op(bam1_cigar(bam)[i]) == BAM_CINS || 
+	  bam_cigar_op(bam1_cigar(bam)[i]) == BAM_CDEL )  {
+	++stats.reads_skipped_indels;
+	return false;
+      }
+    }
+  }
+  ++stats.reads_used;
+  return true;
+}
+
+// sites that reads are still being added to, in position order. Only
+// positions where reads have aligned bases get a site, so a spliced read
+// costs its aligned bases rather than the length of its introns. Sites
+// leaving the front are recycled, so after warming up nothing is
+// allocated per site.
+template <class Site>
+class SiteWindow {
+  // the sites, in position order from index head
+  vector<Site *> sites;
+  size_t head;
+  vector<Site *> free_sites;
+
+public:
+  SiteWindow() : head(0) { }
+  ~SiteWindow() {
+    for (size_t i=head; i < sites.size(); ++i)
+      delete sites[i];
+    for (size_t i=0; i < free_sites.size(); ++i)
+      delete free_sites[i];
+  }
+
+  bool empty() const { return head == sites.size(); }
+  size_t size() const { return sites.size() - head; }
+  Site &front() { return *sites[head]; }
+  Site &operator[](size_t i) { return *sites[head + i]; }
+
+  void pop_front() {
+    free_sites.push_back(sites[head]);
+    ++head;
+    // drop the popped pointers once they make up half the vector
+    if (head == sites.size()) {
+      sites.clear();
+      head = 0;
+    } else if (head >= 1024 && 2 * head >= sites.size()) {
+      sites.erase(sites.begin(), sites.begin() + head);
+      head = 0;
+    }
+  }
+
+  // index of the first site at or after pos, searching from index i
+  size_t seek(int pos, size_t i) {
+    size_t lo = i, hi = size();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (sites[head + mid]->pos < pos)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    return lo;
+  }
+
+  // the site at pos, which belongs at index i; added if it isn't there
+  Site &get(size_t i, int pos) {
+    if (i < size() && sites[head + i]->pos == pos)
+      return *sites[head + i];
+
+    Site *site;
+    if (free_sites.empty())
+      site = new Site;
+    else {
+      site = free_sites.back();
+      free_sites.pop_back();
+    }
+    site->reset(pos);
+    sites.insert(sites.begin() + head + i, site);
+    return *site;
+  }
+};
+
+// splitmix64: a small, fast generator whose whole state is one word, so
+// every site can carry its own and the sample doesn't depend on how the
+// genome was split into regions
+static inline uint64_t next_random(uint64_t &state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void deliver(SiteVisitor &visitor, const string &ref_id,
+		    const Pileup &site) {
+  visitor.visit(ref_id, site);
+}
+
+static void deliver(SiteVisitor &visitor, const string &ref_id,
+		    const SiteCounts &site) {
+  visitor.visit_counts(ref_id, site);
+}
+
+// size of the reference windows loaded by RefWindow, and how far back
+// from the requested position a window starts (reads are sorted, so the
+// sequence wanted next is almost always ahead)
+const int REF_WINDOW_SIZE = 1 << 20;
+const int REF_WINDOW_BACK = 1 << 16;
+
+// serves the reference sequence of one contig at a time, loading it a
+// window at a time with faidx as the reads advance instead of holding
+// whole chromosomes in memory. Bases are upper-cased as they are loaded.
+// Windows are clipped to the limits given to set_contig, so a small
+// region only loads its own sequence.
+class RefWindow {
+  const faidx_t *fai;
+  string name;
+  char *seq;
+  int beg;
+  int len;
+  // only [lo, hi) of the contig is served
+  int lo;
+  int hi;
+  // length of the contig, once a window has reached its end
+  int contig_len;
+  bool failed;
+
+public:
+  // totals over all contigs
+  unsigned long contigs;
+  unsigned long bases_loaded;
+  // if set, the time spent loading is added to it
+  double *load_time;
+
+  RefWindow(const faidx_t *fai) :
+    fai(fai), seq(NULL), beg(0), len(0), lo(0), hi(INT_MAX),
+    contig_len(-1), failed(false),
+    contigs(0), bases_loaded(0), load_time(NULL) { }
+  ~RefWindow() { free(seq); }
+
+  void set_contig(const string &contig, int limit_beg=0,
+		  int limit_end=INT_MAX) {
+    free(seq);
+    seq = NULL;
+    name = contig;
+    beg = len = 0;
+    lo = limit_beg;
+    hi = limit_end;
+    contig_len = -1;
+    failed = false;
+    ++contigs;
+  }
+
+  // the base at g, or '\0' past the end of the contig or outside the
+  // limits (or if its sequence can't be loaded; see error())
+  char at(int g) {
+    if (g >= beg && g < beg + len)
+      return seq[g - beg];
+    return load(g);
+  }
+
+  // true if the contig isn't in the FASTA file
+  bool error() const { return failed; }
+  int known_length() const { return contig_len; }
+
+private:
+  char load(int g) {
+    if (failed || g < 0 || g < lo || g >= hi ||
+	(contig_len >= 0 && g >= contig_len))
+      return '\0';
+
+    ScopedTimer timer(load_time);
+    free(seq);
+    beg = (g > REF_WINDOW_BACK) ? g - REF_WINDOW_BACK : 0;
+    if (beg < lo)
+      beg = lo;
+    int want = (hi - beg < REF_WINDOW_SIZE) ? hi - beg : REF_WINDOW_SIZE;
+    seq = faidx_fetch_seq(fai, const_cast<char *>(name.c_str()),
+			  beg, beg + want - 1, &len);
+    if (seq == NULL || len < 0) {
+      cerr << "ERROR: failed to load sequence for " << name << "\n";
+      free(seq);
+      seq = NULL;
+      len = 0;
+      failed = true;
+      return '\0';
+    }
+    if (len < want)
+      contig_len = beg + len;
+    bases_loaded += len;
+
+    for(int i=0; i < len; ++i)
+      seq[i] = toupper(seq[i]);
+
+    return (g < beg + len) ? seq[g - beg] : '\0';
+  }
+};
+
+// piles up the reads of one chromosome (or of a region [beg, end) of it)
+// and hands finished sites to a visitor. Reads may extend past the region
+// but only sites inside it are counted and reported, so that adjacent
+// regions can be piled up independently.
+class PileupBuilder {
+public:
+  virtual ~PileupBuilder() { }
+
+  // output everything that's left in the queue
+  virtual void finish() = 0;
+  // output the sites before pos, when no read still to come starts
+  // before it
+  virtual void flush(int pos) = 0;
+  virtual void start(const string &id, RefWindow *seq,
+		     int region_beg, int region_end) = 0;
+  virtual int add_read(const bam1_t *bam) = 0;
+
+  // a builder accumulating whichever site type the visitor wants
+  static PileupBuilder *create(const PileupOptions &opts,
+			       SiteVisitor &visitor, PileupStats &stats);
+};
+
+template <class Site>
+class SitePileupBuilder : public PileupBuilder {
+  const PileupOptions &opts;
+  SiteVisitor &visitor;
+  PileupStats &stats;
+
+  string ref_id;
+  // seeds the downsampling at each site of this chromosome
+  uint64_t ref_seed;
+  // genome sequence
+  RefWindow *ref_seq;
+  int beg;
+  int end;
+
+  // the current read, decoded: bases as characters, and 1 for the
+  // bases that pass the quality filter
+  vector<char> read_bases;
+  vector<uint8_t> read_keep;
+
+  // maintain a queue of pileup data and output sites (process_queue)
+  // when we encounter a read that starts after them
+  SiteWindow<Site> q;
+
+public:
+  SitePileupBuilder(const PileupOptions &opts, SiteVisitor &visitor,
+		    PileupStats &stats) :
+    opts(opts), visitor(visitor), stats(stats),
+    ref_seed(0), ref_seq(NULL), beg(0), end(0) { }
+
+  void finish() { process_queue(0, true); }
+  void flush(int pos) { process_queue(pos, false); }
+
+  void start(const string &id, RefWindow *seq, int region_beg, int region_end) {
+    finish();
+    ref_id = id;
+    ref_seed = opts.seed;
+    for (size_t i=0; i < id.size(); ++i)
+      ref_seed = (ref_seed ^ (unsigned char)id[i]) * 0x100000001b3ULL;
+    ref_seq = seq;
+    beg = region_beg;
+    end = region_end;
+  }
+
+  int add_read(const bam1_t *bam);
+
+private:
+  int walk_dispatch(const bam1_t *bam);
+  // add_read for one combination of options, so that the per-base loop
+  // doesn't test them
+  template <bool Rev, bool ExcludeEnds>
+  int walk_read(const bam1_t *bam);
+
+  void process_queue(int upto_pos, bool process_all);
+};
+
+PileupBuilder *PileupBuilder::create(const PileupOptions &opts,
+				     SiteVisitor &visitor,
+				     PileupStats &stats) {
+  if (visitor.use_counts())
+    return new SitePileupBuilder<SiteCounts>(opts, visitor, stats);
+  return new SitePileupBuilder<Pileup>(opts, visitor, stats);
+}
+
+template <class Site>
+void SitePileupBuilder<Site>::process_queue(int upto_pos, bool process_all) {
+  ScopedTimer timer(opts.timing ? &stats.time_output : NULL);
+  while( (!q.empty()) &&
+	 (process_all || (q.front().pos < upto_pos))) {
+
+    // sites outside of the region belong to a neighboring one
+    if (q.front().pos < beg || q.front().pos >= end) {
+      q.pop_front();
+      continue;
+    }
+
+    ++stats.sites_encountered;
+
+    // exclude sites with not enough reads covering
+    if (q.front().nreads < opts.min_coverage) {
+      ++stats.sites_excluded_cov;
+      q.pop_front();
+      continue;
+    }
+
+    // and sites (mostly) matching the reference
+    if (q.front().nonref < opts.min_nonref ||
+	q.front().nonref < opts.min_nonref_fraction * q.front().nreads) {
+      ++stats.sites_excluded_nonref;
+      q.pop_front();
+      continue;
+    }
+
+    deliver(visitor, ref_id, q.front());
+    q.pop_front();
+  }
+}
+
+template <class Site>
+int SitePileupBuilder<Site>::add_read(const bam1_t *bam) {
+  if (!opts.timing)
+    return walk_dispatch(bam);
+
+  // the pileup stage is what's left after the reference loads and the
+  // sites handed on while walking this read
+  double t = metrics_now();
+  double nested = stats.time_ref_load + stats.time_output;
+  int status = walk_dispatch(bam);
+  stats.time_pileup += (metrics_now() - t) -
+    (stats.time_ref_load + stats.time_output - nested);
+  return status;
+}
+
+template <class Site>
+int SitePileupBuilder<Site>::walk_dispatch(const bam1_t *bam) {
+  bool rev_strand = bam1_strand(bam) && !opts.no_ss;
+  if (opts.exclude_ends)
+    return rev_strand ? walk_read<true, true>(bam) :
+      walk_read<false, true>(bam);
+  return rev_strand ? walk_read<true, false>(bam) :
+    walk_read<false, false>(bam);
+}
+
+template <class Site>
+template <bool Rev, bool ExcludeEnds>
+int SitePileupBuilder<Site>::walk_read(const bam1_t *bam) {
+  const int max_depth = opts.max_depth;
+
+  const int read_pos(bam->core.pos);
+  const uint32_t *cigar = bam1_cigar(bam);
+  const int n_cigar = bam->core.n_cigar;
+  const uint8_t *read_seq = bam1_seq(bam);
+  const uint8_t *read_qual = bam1_qual(bam);
+
+#ifdef DEBUGMODE
+  string read_id(bam1_qname(bam));
+#endif
+
+  // the read without its soft-clipped ends is bases [qbeg, qend)
+  // of SEQ; read positions are counted within it
+  int qbeg = 0, qend = bam->core.l_qseq;
+  for (int k=0; k < n_cigar; ++k) {
+    int op = bam_cigar_op(cigar[k]);
+    if (op == BAM_CSOFT_CLIP)
+      qbeg += bam_cigar_oplen(cigar[k]);
+    else if (op != BAM_CHARD_CLIP)
+      break;
+  }
+  for (int k=n_cigar-1; k >= 0; --k) {
+    int op = bam_cigar_op(cigar[k]);
+    if (op == BAM_CSOFT_CLIP)
+      qend -= bam_cigar_oplen(cigar[k]);
+    else if (op != BAM_CHARD_CLIP)
+      break;
+  }
+  const int read_len = qend - qbeg;
+
+  // the first and last aligned bases of SEQ get the read start/end
+  // markers (and are dropped by --exclude-ends); an insertion at either
+  // end of the alignment isn't piled up, so it can't be them
+  int qfirst = -1, qlast = -1;
+  for (int k=0, qk=0; k < n_cigar; ++k) {
+    int op = bam_cigar_op(cigar[k]);
+    int len = bam_cigar_oplen(cigar[k]);
+    if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+      if (qfirst < 0 && len > 0)
+	qfirst = qk;
+      if (len > 0)
+	qlast = qk + len - 1;
+    }
+    if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF ||
+	op == BAM_CINS || op == BAM_CSOFT_CLIP)
+      qk += len;
+  }
+
+#ifdef DEBUGMODE
+  if (qbeg != 0 || qend != bam->core.l_qseq)
+    cerr << "Soft-clipped: (" << qbeg << ", " << bam->core.l_qseq - qend << "\n";
+#endif
+
+  // process queue
+  process_queue(read_pos, false);
+
+  // decode the bases and apply the quality filter to the whole read up
+  // front, with the vector kernels where the CPU has them. Bases the
+  // CIGAR string claims beyond the end of SEQ never pass the filter
+  const int l_qseq = bam->core.l_qseq;
+  const int l_cigar = bam_cigar2qlen(&bam->core, cigar);
+  const int l_read = (l_cigar > l_qseq) ? l_cigar : l_qseq;
+  if ((int)read_bases.size() < l_read) {
+    read_bases.resize(l_read);
+    read_keep.resize(l_read);
+  }
+  if (l_qseq > 0) {
+    decode_bases(read_seq, l_qseq, &read_bases[0]);
+    mask_quals(read_qual, l_qseq, opts.min_q, &read_keep[0]);
+  }
+  for (int i=l_qseq; i < l_read; ++i) {
+    read_bases[i] = 'N';
+    read_keep[i] = 0;
+  }
+
+  // walk the CIGAR string; g is the genomic position, qpos the position
+  // in SEQ and qi the index in the queue at or before g
+  int g = read_pos;
+  int qpos = 0;
+  size_t qi = 0;
+  for (int k=0; k < n_cigar; ++k) {
+    int op = bam_cigar_op(cigar[k]);
+    int len = bam_cigar_oplen(cigar[k]);
+
+    if (op == BAM_CINS || op == BAM_CSOFT_CLIP) {
+      qpos += len;
+      continue;
+    }
+    if (op == BAM_CDEL || op == BAM_CREF_SKIP) {
+      // deletions don't show up in the pileup; skip to the next exon
+      g += len;
+      qi = q.seek(g, qi);
+      continue;
+    }
+    if (op != BAM_CMATCH && op != BAM_CEQUAL && op != BAM_CDIFF)
+      continue;
+
+    for (int j=0; j < len; ++j, ++g, ++qpos) {
+      // bases outside of the region are piled up with a neighboring one
+      if (g < beg || g >= end)
+	continue;
+
+      while (qi < q.size() && q[qi].pos < g)
+	++qi;
+      Site &site = q.get(qi, g);
+
+      ++stats.bases_encountered;
+
+      bool first = (qpos == qfirst);
+      bool last = (qpos == qlast);
+
+      // exclude read-ends
+      if (ExcludeEnds && (first || last)) {
+	++stats.bases_excluded_end;
+	continue;
+      }
+      // exclude low-quality bases
+      if (!read_keep[qpos]) {
+	++stats.bases_excluded_q;
+	continue;
+      }
+      char qual = 33 + read_qual[qpos];
+
+      // make sure we don't go past end of ref seq
+      char ref = ref_seq->at(g);
+      if (ref == '\0') {
+	if (!ref_seq->error())
+	  cerr << "ERROR: genomic pos " << g << " >= chr length ("
+	       << ref_seq->known_length() << ")\n";
+	return 1;
+      }
+
+      char base = read_bases[qpos];
+      char sym;
+      if (ref == base)
+	sym = Rev ? ',' : '.';
+      else
+	sym = Rev ? tolower(base) : base;
+
+      int rpos = qpos - qbeg;
+      if (Rev)
+	rpos = read_len-(1+rpos);
+
+      // past --max-depth, keep a reservoir sample: the n'th base replaces
+      // a random one of those kept with probability max_depth/n
+      ++site.depth;
+      if (max_depth > 0 && site.nreads >= max_depth) {
+	if (site.depth == (unsigned long)max_depth + 1)
+	  site.rng = ref_seed ^ (uint64_t(g) * 0x9e3779b97f4a7c15ULL);
+	uint64_t r = next_random(site.rng) % site.depth;
+	++stats.bases_excluded_depth;
+	if (r < (uint64_t)max_depth)
+	  site.replace_base(int(r), sym, qual, rpos, first, last, Rev);
+	continue;
+      }
+
+      if (max_depth > 0)
+	site.add_sampled_base(ref, sym, qual, rpos, first, last, Rev);
+      else
+	site.add_base(ref, sym, qual, rpos, first, last, Rev);
+
+#ifdef DEBUGMODE
+      site.read_ids.push_back(read_id);
+#endif
+    }
+  }
+  if (q.size() > stats.max_queued_sites)
+    stats.max_queued_sites = q.size();
+  return 0;
+}
+
+/////////////////////
+// Region pileup (--regions, --threads)
+//   Regions are piled up independently, using the BAM index to fetch
+//   the reads overlapping each one and loading only that window of the
+//   reference. With --regions only the listed intervals are piled up.
+//   With --threads the regions (by default the whole genome) are cut to
+//   at most PARALLEL_REGION_SIZE bp and worker threads pile them up;
+//   finished regions are merged into the caller's visitor strictly in
+//   coordinate order, and workers don't run more than a few regions
+//   ahead of the merge so memory stays bounded.
+
+struct PileupRegion {
+  int tid;
+  int beg;
+  int end;
+  // reads starting at or after this are counted in this region's stats
+  // (see set_count_from)
+  int count_from;
+
+  bool operator < (const PileupRegion &other) const {
+    return (tid != other.tid) ? (tid < other.tid) : (beg < other.beg);
+  }
+};
+
+// read a BED file of regions, in BAM header order with overlapping
+// regions merged; returns false on error
+static bool load_region_bed(const string &fn, const bam_header_t *bam_hdr,
+			    vector<PileupRegion> &regions) {
+  ifstream in(fn.c_str());
+  if (!in.is_open()) {
+    cerr << "ERROR: Could not open regions file " << fn << "\n";
+    return false;
+  }
+
+  map<string, int> tids;
+  for (int tid=0; tid < bam_hdr->n_targets; ++tid)
+    tids[bam_hdr->target_name[tid]] = tid;
+
+  vector<PileupRegion> bed;
+  set<string> missing;
+  string line, chr;
+  unsigned long line_num = 0;
+  while (getline(in, line)) {
+    ++line_num;
+    if (line.empty() || line[0] == '#' ||
+	line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0)
+      continue;
+
+    istringstream linestr(line);
+    long beg, end;
+    if (!(linestr >> chr >> beg >> end) || beg < 0 || end < beg) {
+      cerr << "ERROR: malformed line " << line_num << " in " << fn << "\n";
+      return false;
+    }
+
+    map<string, int>::const_iterator it = tids.find(chr);
+    if (it == tids.end()) {
+      if (missing.insert(chr).second)
+	cerr << "WARNING: " << chr << " in " << fn
+	     << " is not in the BAM header; skipping its regions\n";
+      continue;
+    }
+
+    PileupRegion r;
+    r.tid = it->second;
+    r.beg = beg;
+    r.end = (end < (long)bam_hdr->target_len[r.tid]) ?
+      end : bam_hdr->target_len[r.tid];
+    if (r.beg < r.end)
+      bed.push_back(r);
+  }
+
+  sort(bed.begin(), bed.end());
+  regions.clear();
+  for (size_t i=0; i < bed.size(); ++i) {
+    if (!regions.empty() && regions.back().tid == bed[i].tid &&
+	regions.back().end >= bed[i].beg)
+      regions.back().end = max(regions.back().end, bed[i].end);
+    else
+      regions.push_back(bed[i]);
+  }
+  return true;
+}
+
+// cut regions into pieces of at most max_len bp
+static void split_regions(vector<PileupRegion> &regions, int max_len) {
+  vector<PileupRegion> pieces;
+  for (size_t i=0; i < regions.size(); ++i) {
+    for (int beg=regions[i].beg; beg < regions[i].end; beg += max_len) {
+      PileupRegion r = regions[i];
+      r.beg = beg;
+      r.end = (regions[i].end - beg > max_len) ? beg + max_len : regions[i].end;
+      pieces.push_back(r);
+    }
+  }
+  regions.swap(pieces);
+}
+
+// a read overlapping several regions is piled up in each, but counted
+// only in the first: the one whose count_from (the end of the previous
+// region on the chromosome, or 0) is at or before its start
+static void set_count_from(vector<PileupRegion> &regions) {
+  for (size_t i=0; i < regions.size(); ++i) {
+    bool follows = (i > 0 && regions[i-1].tid == regions[i].tid);
+    regions[i].count_from = follows ? regions[i-1].end : 0;
+  }
+}
+
+struct RegionPileup {
+  string bam_fn;
+  string fas_fn;
+  const PileupOptions *opts;
+  SiteVisitor *visitor;
+  bam_header_t *bam_hdr;
+  bam_index_t *idx;
+
+  vector<PileupRegion> regions;
+  // per-region results, filled in by the workers
+  vector<SiteVisitor *> parts;
+  vector<PileupStats> part_stats;
+  vector<bool> done;
+  vector<unsigned long> part_bases;
+
+  // sequence loaded for the regions piled up so far, for the
+  // "Loaded ..." line; regions come in chromosome order
+  unsigned long bases_loaded;
+  unsigned long contigs;
+  int last_tid;
+
+  size_t next_region;
+  size_t next_merge;
+  size_t max_ahead;
+  bool failed;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+// pile up one region into part, adding the bases of reference it
+// loaded to bases_loaded; returns nonzero on error
+static int pileup_region(RegionPileup &pp, const PileupRegion &r,
+			 bamFile bam_file, faidx_t *fai, bam1_t *bam,
+			 SiteVisitor &part, PileupStats &stats,
+			 unsigned long &bases_loaded) {
+  string ref_id(pp.bam_hdr->target_name[r.tid]);
+
+  // only the part of the chromosome inside the region is loaded
+  RefWindow ref_seq(fai);
+  ref_seq.set_contig(ref_id, r.beg, r.end);
+  if (pp.opts->timing)
+    ref_seq.load_time = &stats.time_ref_load;
+
+  PileupBuilder *builder = PileupBuilder::create(*pp.opts, part, stats);
+  builder->start(ref_id, &ref_seq, r.beg, r.end);
+
+  int status = 0;
+  bam_iter_t iter = bam_iter_query(pp.idx, r.tid, r.beg, r.end);
+  double *decode_time = pp.opts->timing ? &stats.time_bam_decode : NULL;
+  for (;;) {
+    int ret;
+    {
+      ScopedTimer timer(decode_time);
+      ret = bam_iter_read(bam_file, iter, bam);
+    }
+    // -1 is the end of the region; anything lower a truncated or
+    // corrupt file
+    if (ret < -1) {
+      cerr << "ERROR: BAM file " << pp.bam_fn << " is truncated or corrupt\n";
+      status = 1;
+    }
+    if (ret <= 0)
+      break;
+    PileupStats skipped;
+    PileupStats &read_stats = (bam->core.pos >= r.count_from) ?
+      stats : skipped;
+    if (!usable_read(bam, pp.opts->skip_indels, read_stats))
+      continue;
+    if ((status = builder->add_read(bam)) != 0)
+      break;
+  }
+  bam_iter_destroy(iter);
+  builder->finish();
+  delete builder;
+
+  bases_loaded += ref_seq.bases_loaded;
+  return status;
+}
+
+// chr:end of a region, for progress lines
+static string region_name(const RegionPileup &pp, const PileupRegion &r) {
+  return string(pp.bam_hdr->target_name[r.tid]) + ":" + to_s(r.end);
+}
+
+// add a piled-up region to the "Loaded ..." totals
+static void count_loaded(RegionPileup &pp, const PileupRegion &r,
+			 unsigned long bases) {
+  pp.bases_loaded += bases;
+  if (r.tid != pp.last_tid) {
+    ++pp.contigs;
+    pp.last_tid = r.tid;
+  }
+}
+
+static void *pileup_worker(void *data) {
+  RegionPileup &pp = *(RegionPileup *)data;
+
+  // BAM and FASTA readers can't be shared between threads
+  bamFile bam_file = bam_open(pp.bam_fn.c_str(), "r");
+  faidx_t *fai = fai_load(pp.fas_fn.c_str());
+  bam1_t *bam = bam_init1();
+  bool ok = (bam_file != 0 && fai != NULL);
+  if (!ok)
+    cerr << "ERROR: worker failed to open " << pp.bam_fn << " or "
+	 << pp.fas_fn << "\n";
+
+  pthread_mutex_lock(&pp.lock);
+  while (ok) {
+    while (!pp.failed && pp.next_region < pp.regions.size() &&
+	   pp.next_region >= pp.next_merge + pp.max_ahead)
+      pthread_cond_wait(&pp.cond, &pp.lock);
+    if (pp.failed || pp.next_region >= pp.regions.size())
+      break;
+    size_t r = pp.next_region++;
+    pthread_mutex_unlock(&pp.lock);
+
+    SiteVisitor *part = pp.visitor->fork();
+    PileupStats stats;
+    unsigned long bases = 0;
+    ok = (pileup_region(pp, pp.regions[r], bam_file, fai, bam,
+			*part, stats, bases) == 0);
+
+    pthread_mutex_lock(&pp.lock);
+    pp.parts[r] = part;
+    pp.part_stats[r] = stats;
+    pp.part_bases[r] = bases;
+    pp.done[r] = true;
+    pthread_cond_broadcast(&pp.cond);
+  }
+  if (!ok)
+    pp.failed = true;
+  pthread_cond_broadcast(&pp.cond);
+  pthread_mutex_unlock(&pp.lock);
+
+  bam_destroy1(bam);
+  if (fai)
+    fai_destroy(fai);
+  if (bam_file)
+    bam_close(bam_file);
+  return NULL;
+}
+
+static int run_parallel_pileup(RegionPileup &pp, PileupStats &stats) {
+  const int nthreads = pp.opts->threads;
+
+  split_regions(pp.regions, PARALLEL_REGION_SIZE);
+  set_count_from(pp.regions);
+
+  cerr << "Piling up " << pp.regions.size() << " regions on "
+       << nthreads << " threads\n";
+
+  pp.parts.assign(pp.regions.size(), (SiteVisitor *)NULL);
+  pp.part_stats.assign(pp.regions.size(), PileupStats());
+  pp.done.assign(pp.regions.size(), false);
+  pp.part_bases.assign(pp.regions.size(), 0);
+  pp.next_region = 0;
+  pp.next_merge = 0;
+  pp.max_ahead = 4 * nthreads;
+  pp.failed = false;
+  pthread_mutex_init(&pp.lock, NULL);
+  pthread_cond_init(&pp.cond, NULL);
+
+  vector<pthread_t> threads(nthreads);
+  for (int i=0; i < nthreads; ++i)
+    pthread_create(&threads[i], NULL, pileup_worker, &pp);
+
+  ProgressMeter progress(pp.opts->progress_interval, "reads");
+
+  // merge finished regions in order
+  pthread_mutex_lock(&pp.lock);
+  while (pp.next_merge < pp.regions.size()) {
+    size_t r = pp.next_merge;
+    while (!pp.failed && !pp.done[r])
+      pthread_cond_wait(&pp.cond, &pp.lock);
+    if (pp.failed)
+      break;
+    pthread_mutex_unlock(&pp.lock);
+
+    pp.visitor->merge(pp.parts[r]);
+    delete pp.parts[r];
+    pp.parts[r] = NULL;
+
+    stats.add(pp.part_stats[r]);
+    count_loaded(pp, pp.regions[r], pp.part_bases[r]);
+    progress.update(stats.reads_used, region_name(pp, pp.regions[r]));
+
+    pthread_mutex_lock(&pp.lock);
+    ++pp.next_merge;
+    pthread_cond_broadcast(&pp.cond);
+  }
+  bool failed = pp.failed;
+  pthread_mutex_unlock(&pp.lock);
+
+  for (int i=0; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+
+  for (size_t r=0; r < pp.parts.size(); ++r)
+    delete pp.parts[r];
+
+  pthread_cond_destroy(&pp.cond);
+  pthread_mutex_destroy(&pp.lock);
+
+  return failed ? 1 : 0;
+}
+
+// pile up the regions one after another on this thread
+static int run_serial_region_pileup(RegionPileup &pp, bamFile bam_file,
+				    PileupStats &stats) {
+  faidx_t *fai = fai_load(pp.fas_fn.c_str());
+  if (fai == NULL) {
+    cerr << "ERROR: failed to load FASTA index for " << pp.fas_fn << "\n";
+    return 1;
+  }
+  bam1_t *bam = bam_init1();
+  set_count_from(pp.regions);
+
+  ProgressMeter progress(pp.opts->progress_interval, "reads");
+  int status = 0;
+  for (size_t r=0; r < pp.regions.size() && status == 0; ++r) {
+    unsigned long bases = 0;
+    status = pileup_region(pp, pp.regions[r], bam_file, fai, bam,
+			   *pp.visitor, stats, bases);
+    count_loaded(pp, pp.regions[r], bases);
+    progress.update(stats.reads_used, region_name(pp, pp.regions[r]));
+  }
+
+  bam_destroy1(bam);
+  fai_destroy(fai);
+  return status;
+}
+
+/////////////////////
+// Input of the serial pileups
+
+// "-" reads the BAM file from standard input
+static bamFile open_bam(const string &bam_fn) {
+  if (bam_fn == "-")
+    return bam_dopen(fileno(stdin), "r");
+  return bam_open(bam_fn.c_str(), "r");
+}
+
+// the BAM file as named in messages
+static string bam_name(const string &bam_fn) {
+  return (bam_fn == "-") ? string("standard input") : bam_fn;
+}
+
+// the pileup relies on reads coming sorted by chromosome, then position
+// (samtools sort); this catches the first one that doesn't, as it is
+// read, so that an unsorted file (or stream) isn't quietly piled up
+// into wrong counts
+class SortOrderCheck {
+  int tid;
+  int pos;
+
+public:
+  SortOrderCheck() : tid(-1), pos(-1) { }
+
+  // false (with a message) if bam comes before the previous read
+  bool check(const bam1_t &bam, const bam_header_t *bam_hdr,
+	     const string &bam_fn) {
+    if (bam.core.tid > tid || (bam.core.tid == tid && bam.core.pos >= pos)) {
+      tid = bam.core.tid;
+      pos = bam.core.pos;
+      return true;
+    }
+    cerr << "ERROR: " << bam_name(bam_fn)
+	 << " is not sorted by coordinate: read "
+	 << bam1_qname(&bam) << " at "
+	 << bam_hdr->target_name[bam.core.tid] << ":" << bam.core.pos + 1
+	 << " comes after " << bam_hdr->target_name[tid] << ":" << pos + 1
+	 << "\n       Sort it first with samtools sort\n";
+    return false;
+  }
+};
+
+/////////////////////
+// Read-ahead for the serial pileup
+//   A reader thread inflates and decodes BAM records, copying the
+//   usable reads into batches; the pileup
+//   thread consumes the batches in order. A fixed pool of batches is
+//   recycled, so once they have grown to their working size memory
+//   stays flat and nothing more is allocated.
+
+const size_t READ_BATCH_SIZE = 4096;
+const int READ_BATCHES = 4;
+
+struct ReadBatch {
+  struct Read {
+    bam1_core_t core;
+    int l_aux;
+    int data_len;
+    size_t data_off;
+  };
+  vector<Read> reads;
+  // variable-length data of all reads, back to back
+  vector<uint8_t> arena;
+  // the last batch
+  bool eof;
+
+  void clear() {
+    reads.clear();
+    arena.clear();
+    eof = false;
+  }
+
+  void add(const bam1_t *bam) {
+    Read r;
+    r.core = bam->core;
+    r.l_aux = bam->l_aux;
+    r.data_len = bam->data_len;
+    // keep each read's data 8-byte aligned
+    r.data_off = (arena.size() + 7) & ~size_t(7);
+    arena.resize(r.data_off + r.data_len);
+    memcpy(&arena[r.data_off], bam->data, r.data_len);
+    reads.push_back(r);
+  }
+
+  // point view at read i, without copying it
+  void get(size_t i, bam1_t &view) {
+    const Read &r = reads[i];
+    view.core = r.core;
+    view.l_aux = r.l_aux;
+    view.data_len = view.m_data = r.data_len;
+    view.data = &arena[r.data_off];
+  }
+};
+
+class BamReadAhead {
+  bamFile bam_file;
+  bool skip_indels;
+  // skipped reads and decoding time, kept by the reader thread; safe to
+  // read once the reader is deleted
+  PileupStats &stats;
+  bool timing;
+  // set by the reader thread if the file ended in a broken record
+  bool read_error;
+  ReadBatch batches[READ_BATCHES];
+  // batches are filled and consumed round-robin
+  int next_fill;
+  int next_use;
+  int n_full;
+  bool stop;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+public:
+  BamReadAhead(bamFile bam_file, bool skip_indels, PileupStats &stats,
+	       bool timing) :
+    bam_file(bam_file), skip_indels(skip_indels), stats(stats),
+    timing(timing), read_error(false), next_fill(0), next_use(0), n_full(0),
+    stop(false) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    pthread_create(&thread, NULL, run, this);
+  }
+
+  ~BamReadAhead() {
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  // wait for the next batch; it belongs to the caller until release()
+  ReadBatch *next() {
+    pthread_mutex_lock(&lock);
+    while (n_full == 0)
+      pthread_cond_wait(&cond, &lock);
+    ReadBatch *batch = &batches[next_use];
+    pthread_mutex_unlock(&lock);
+    return batch;
+  }
+
+  // true if the input was truncated or corrupt rather than at its end;
+  // known once the last batch (eof) has been received
+  bool error() const { return read_error; }
+
+  void release() {
+    pthread_mutex_lock(&lock);
+    next_use = (next_use + 1) % READ_BATCHES;
+    --n_full;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+
+private:
+  static void *run(void *data) {
+    ((BamReadAhead *)data)->read_batches();
+    return NULL;
+  }
+
+  void read_batches() {
+    bam1_t *bam = bam_init1();
+    bool eof = false;
+
+    pthread_mutex_lock(&lock);
+    while (!eof) {
+      while (!stop && n_full == READ_BATCHES)
+	pthread_cond_wait(&cond, &lock);
+      if (stop)
+	break;
+      ReadBatch &batch = batches[next_fill];
+      pthread_mutex_unlock(&lock);
+
+      batch.clear();
+      {
+	ScopedTimer timer(timing ? &stats.time_bam_decode : NULL);
+	while (batch.reads.size() < READ_BATCH_SIZE) {
+	  int ret = bam_read1(bam_file, bam);
+	  if (ret <= 0) {
+	    // -1 is the end of the file
+	    read_error = (ret < -1);
+	    batch.eof = eof = true;
+	    break;
+	  }
+	  if (usable_read(bam, skip_indels, stats))
+	    batch.add(bam);
+	}
+      }
+
+      pthread_mutex_lock(&lock);
+      next_fill = (next_fill + 1) % READ_BATCHES;
+      ++n_full;
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    bam_destroy1(bam);
+  }
+};
+
+/////////////////////
+
+int run_pileup(const string &bam_fn, const string &fas_fn,
+	       const PileupOptions &opts,
+	       SiteVisitor &visitor, PileupStats &stats) {
+  // index the fasta file by finding out where each chr starts
+  ifstream file(fas_fn.c_str());
+  if (!file.is_open()) {
+    cerr << "Failed to open FASTA file " << fas_fn << "\n";
+    return 1;
+  }
+
+  bamFile bam_file;
+  bam_header_t *bam_hdr;
+
+  if ((bam_file = open_bam(bam_fn)) == 0) {
+    cerr << "Failed to open BAM file " << bam_fn << "\n";
+    return 1;
+  }
+
+  // read BAM header
+  if ((bam_hdr = bam_header_read(bam_file)) == NULL) {
+    cerr << "ERROR: could not read the header of " << bam_name(bam_fn)
+	 << "; is it a BAM file?\n";
+    bam_close(bam_file);
+    return 1;
+  }
+
+  // the chromosomes to pile up
+  vector<bool> wanted(bam_hdr->n_targets, opts.chromosomes.empty());
+  for (size_t i=0; i < opts.chromosomes.size(); ++i)
+    for (int tid=0; tid < bam_hdr->n_targets; ++tid)
+      if (opts.chromosomes[i] == bam_hdr->target_name[tid])
+	wanted[tid] = true;
+
+  const bool use_regions = !opts.regions_fn.empty();
+  bool parallel = (opts.threads > 1);
+  if (parallel) {
+    SiteVisitor *probe = visitor.fork();
+    if (probe == NULL) {
+      cerr << "WARNING: this command can't pile up in parallel; "
+	   << "using one thread\n";
+      parallel = false;
+    }
+    delete probe;
+  }
+
+  bam_index_t *idx = NULL;
+  if ((use_regions || parallel) && bam_fn == "-") {
+    // a stream has no index
+    if (use_regions) {
+      cerr << "ERROR: --regions requires an indexed BAM file, "
+	   << "not standard input\n";
+      bam_header_destroy(bam_hdr);
+      bam_close(bam_file);
+      return 1;
+    }
+    cerr << "WARNING: BAM file on standard input can't be piled up in "
+	 << "parallel; using one thread\n";
+  } else if (use_regions || parallel) {
+    if ((idx = bam_index_load(bam_fn.c_str())) == NULL) {
+      if (use_regions) {
+	cerr << "ERROR: --regions requires a BAM index (.bai) for "
+	     << bam_fn << "\n";
+	bam_header_destroy(bam_hdr);
+	bam_close(bam_file);
+	return 1;
+      }
+      cerr << "WARNING: no BAM index (.bai) for " << bam_fn
+	   << "; using one thread\n";
+    }
+  }
+
+  if (idx != NULL) {
+    RegionPileup pp;
+    pp.bam_fn = bam_fn;
+    pp.fas_fn = fas_fn;
+    pp.opts = &opts;
+    pp.visitor = &visitor;
+    pp.bam_hdr = bam_hdr;
+    pp.idx = idx;
+    pp.bases_loaded = 0;
+    pp.contigs = 0;
+    pp.last_tid = -1;
+
+    int status = 0;
+    if (use_regions) {
+      if (!load_region_bed(opts.regions_fn, bam_hdr, pp.regions))
+	status = 1;
+      else {
+	size_t kept = 0;
+	for (size_t r=0; r < pp.regions.size(); ++r)
+	  if (wanted[pp.regions[r].tid])
+	    pp.regions[kept++] = pp.regions[r];
+	pp.regions.resize(kept);
+	long total = 0;
+	for (size_t r=0; r < pp.regions.size(); ++r)
+	  total += pp.regions[r].end - pp.regions[r].beg;
+	cerr << "Piling up " << pp.regions.size() << " regions ("
+	     << total << " bp) from " << opts.regions_fn << "\n";
+      }
+    } else {
+      // whole chromosomes
+      for (int tid=0; tid < bam_hdr->n_targets; ++tid) {
+	if (!wanted[tid])
+	  continue;
+	PileupRegion r;
+	r.tid = tid;
+	r.beg = 0;
+	r.end = bam_hdr->target_len[tid];
+	pp.regions.push_back(r);
+      }
+    }
+
+    if (status == 0) {
+      status = parallel ? run_parallel_pileup(pp, stats) :
+	run_serial_region_pileup(pp, bam_file, stats);
+      cerr << "Loaded " << pp.bases_loaded << " bp of sequence for "
+	   << pp.contigs << " chromosomes\n";
+    }
+
+    bam_index_destroy(idx);
+    bam_header_destroy(bam_hdr);
+    bam_close(bam_file);
+    return status;
+  }
+
+  faidx_t *fai = fai_load(fas_fn.c_str());
+  if (fai == NULL) {
+    cerr << "ERROR: failed to load FASTA index for " << fas_fn << "\n";
+    bam_header_destroy(bam_hdr);
+    bam_close(bam_file);
+    return 1;
+  }
+  bam1_t bam;
+
+  int curr_tid = -1;
+  RefWindow ref_seq(fai);
+  if (opts.timing)
+    ref_seq.load_time = &stats.time_ref_load;
+  int status = 0;
+
+  PileupBuilder *builder = PileupBuilder::create(opts, visitor, stats);
+
+  // BAM decoding runs on its own thread
+  PileupStats read_stats;
+  BamReadAhead *reader = new BamReadAhead(bam_file, opts.skip_indels,
+					  read_stats, opts.timing);
+  ProgressMeter progress(opts.progress_interval, "reads");
+  unsigned long reads_done = 0;
+  SortOrderCheck sort_check;
+  bool eof = false;
+  while (!eof && status == 0) {
+    ReadBatch *batch = reader->next();
+    for (size_t i=0; i < batch->reads.size(); ++i) {
+      batch->get(i, bam);
+      if (!sort_check.check(bam, bam_hdr, bam_fn)) {
+	status = 1;
+	break;
+      }
+      if (!wanted[bam.core.tid])
+	continue;
+
+      // switch genomic sequence to this chromosome
+      if (bam.core.tid != curr_tid) {
+	// get chr name for this bam line
+	string ref( bam_hdr->target_name[bam.core.tid] );
+
+	// sites of the previous chr go out before its sequence goes
+	builder->finish();
+
+	curr_tid = bam.core.tid;
+	ref_seq.set_contig(ref);
+	builder->start(ref, &ref_seq, 0, INT_MAX);
+      }
+
+      if ((status = builder->add_read(&bam)) != 0)
+	break;
+    }
+    reads_done += batch->reads.size();
+    if (!batch->reads.empty())
+      progress.update(reads_done,
+		      string(bam_hdr->target_name[bam.core.tid]) + ":" +
+		      to_s(bam.core.pos + 1));
+    eof = batch->eof;
+    reader->release();
+  }
+  if (status == 0 && reader->error()) {
+    cerr << "ERROR: " << bam_name(bam_fn)
+	 << " is truncated or corrupt\n";
+    status = 1;
+  }
+  delete reader;
+  stats.add(read_stats);
+
+  // process queue
+  if (status == 0)
+    builder->finish();
+  delete builder;
+
+  cerr << "Loaded " << ref_seq.bases_loaded << " bp of sequence for "
+       << ref_seq.contigs << " chromosomes\n";
+  bam_header_destroy(bam_hdr);
+  bam_close(bam_file);
+  fai_destroy(fai);
+
+  return status;
+}
+
+/////////////////////
+// Multi-sample pileup
+//   Each BAM file gets its own read-ahead thread and pileup builder. The
+//   reads of all samples are merged by coordinate so that the builders
+//   share one RefWindow: the reference is read once for the whole batch.
+
+// with a PileupSync, how far (bp) the reads advance between syncs;
+// samples without reads in a stretch hold their sites until then
+const int MULTI_SYNC_INTERVAL = 1 << 12;
+
+// one sample's place in its batches of reads
+struct SampleCursor {
+  BamReadAhead *reader;
+  ReadBatch *batch;
+  size_t i;
+
+  // move past finished batches to a read; returns false once the
+  // sample has no more
+  bool settle() {
+    while (i >= batch->reads.size()) {
+      bool eof = batch->eof;
+      reader->release();
+      batch = NULL;
+      if (eof)
+	return false;
+      batch = reader->next();
+      i = 0;
+    }
+    return true;
+  }
+
+  // merge order of the current read: chromosome, then position
+  uint64_t key() const {
+    const bam1_core_t &core = batch->reads[i].core;
+    return (uint64_t(uint32_t(core.tid)) << 32) | uint32_t(core.pos);
+  }
+};
+
+// true if two BAM headers list the same chromosomes in the same order
+static bool same_targets(const bam_header_t *a, const bam_header_t *b) {
+  if (a->n_targets != b->n_targets)
+    return false;
+  for (int tid=0; tid < a->n_targets; ++tid)
+    if (a->target_len[tid] != b->target_len[tid] ||
+	strcmp(a->target_name[tid], b->target_name[tid]) != 0)
+      return false;
+  return true;
+}
+
+static int pileup_samples(const vector<bamFile> &bam_files,
+			  const vector<string> &bam_fns,
+			  const bam_header_t *bam_hdr, faidx_t *fai,
+			  const PileupOptions &opts,
+			  const vector<SiteVisitor *> &visitors,
+			  vector<PileupStats> &stats, PileupSync *sync) {
+  const size_t n = bam_files.size();
+  RefWindow ref_seq(fai);
+
+  // BAM decoding runs on a thread per sample
+  vector<PileupBuilder *> builders(n);
+  vector<PileupStats> read_stats(n);
+  vector<SampleCursor> cursors(n);
+  vector<SortOrderCheck> sort_checks(n);
+  typedef pair<uint64_t, size_t> MergeEntry;
+  priority_queue<MergeEntry, vector<MergeEntry>, greater<MergeEntry> > merge;
+  for (size_t s=0; s < n; ++s) {
+    builders[s] = PileupBuilder::create(opts, *visitors[s], stats[s]);
+    cursors[s].reader = new BamReadAhead(bam_files[s], opts.skip_indels,
+					 read_stats[s], opts.timing);
+    cursors[s].batch = cursors[s].reader->next();
+    cursors[s].i = 0;
+    if (cursors[s].settle())
+      merge.push(MergeEntry(cursors[s].key(), s));
+  }
+
+  ProgressMeter progress(opts.progress_interval, "reads");
+  unsigned long reads_done = 0;
+  int curr_tid = -1;
+  int synced_pos = 0;
+  string ref;
+  bam1_t bam;
+  int status = 0;
+  while (!merge.empty() && status == 0) {
+    size_t s = merge.top().second;
+    merge.pop();
+    SampleCursor &c = cursors[s];
+    c.batch->get(c.i, bam);
+    if (!sort_checks[s].check(bam, bam_hdr, bam_fns[s])) {
+      status = 1;
+      break;
+    }
+
+    // switch genomic sequence to this chromosome
+    if (bam.core.tid != curr_tid) {
+      // sites of the previous chr go out before its sequence goes
+      for (size_t b=0; b < n; ++b)
+	builders[b]->finish();
+      if (sync != NULL && curr_tid >= 0)
+	sync->sync(ref, INT_MAX);
+
+      curr_tid = bam.core.tid;
+      ref = bam_hdr->target_name[curr_tid];
+      ref_seq.set_contig(ref);
+      for (size_t b=0; b < n; ++b)
+	builders[b]->start(ref, &ref_seq, 0, INT_MAX);
+      synced_pos = 0;
+
+    } else if (sync != NULL &&
+	       bam.core.pos - synced_pos >= MULTI_SYNC_INTERVAL) {
+      // no read of any sample still to come starts before this one
+      for (size_t b=0; b < n; ++b)
+	builders[b]->flush(bam.core.pos);
+      sync->sync(ref, bam.core.pos);
+      synced_pos = bam.core.pos;
+    }
+
+    if (opts.timing)
+      ref_seq.load_time = &stats[s].time_ref_load;
+    if ((status = builders[s]->add_read(&bam)) != 0)
+      break;
+
+    if ((++reads_done & 0xffff) == 0)
+      progress.update(reads_done, ref + ":" + to_s(bam.core.pos + 1));
+
+    ++c.i;
+    if (c.settle())
+      merge.push(MergeEntry(c.key(), s));
+  }
+
+  // every sample has been read to its end
+  for (size_t s=0; s < n && status == 0; ++s) {
+    if (cursors[s].reader->error()) {
+      cerr << "ERROR: " << bam_name(bam_fns[s])
+	   << " is truncated or corrupt\n";
+      status = 1;
+    }
+  }
+
+  if (status == 0) {
+    for (size_t b=0; b < n; ++b)
+      builders[b]->finish();
+    if (sync != NULL && curr_tid >= 0)
+      sync->sync(ref, INT_MAX);
+  }
+  for (size_t s=0; s < n; ++s) {
+    delete builders[s];
+    delete cursors[s].reader;
+    stats[s].add(read_stats[s]);
+  }
+
+  cerr << "Loaded " << ref_seq.bases_loaded << " bp of sequence for "
+       << ref_seq.contigs << " chromosomes\n";
+  return status;
+}
+
+int run_multi_pileup(const vector<string> &bam_fns, const string &fas_fn,
+		     const PileupOptions &opts,
+		     const vector<SiteVisitor *> &visitors,
+		     vector<PileupStats> &stats, PileupSync *sync) {
+  const size_t n = bam_fns.size();
+  stats.assign(n, PileupStats());
+
+  vector<bamFile> bam_files(n, (bamFile)0);
+  vector<bam_header_t *> bam_hdrs(n, (bam_header_t *)NULL);
+  int status = 0;
+  if (count(bam_fns.begin(), bam_fns.end(), string("-")) > 1) {
+    cerr << "ERROR: only one BAM file can be read from standard input\n";
+    status = 1;
+  }
+  for (size_t s=0; s < n && status == 0; ++s) {
+    if ((bam_files[s] = open_bam(bam_fns[s])) == 0) {
+      cerr << "Failed to open BAM file " << bam_fns[s] << "\n";
+      status = 1;
+    } else if ((bam_hdrs[s] = bam_header_read(bam_files[s])) == NULL) {
+      cerr << "ERROR: could not read the header of " << bam_name(bam_fns[s])
+	   << "\n";
+      status = 1;
+    } else if (!same_targets(bam_hdrs[0], bam_hdrs[s])) {
+      cerr << "ERROR: " << bam_fns[s] << " isn't aligned to the same "
+	   << "chromosomes as " << bam_fns[0] << "\n";
+      status = 1;
+    }
+  }
+
+  faidx_t *fai = NULL;
+  if (status == 0 && (fai = fai_load(fas_fn.c_str())) == NULL) {
+    cerr << "ERROR: failed to load FASTA index for " << fas_fn << "\n";
+    status = 1;
+  }
+
+  if (status == 0)
+    status = pileup_samples(bam_files, bam_fns, bam_hdrs[0], fai, opts,
+			    visitors, stats, sync);
+
+  if (fai != NULL)
+    fai_destroy(fai);
+  for (size_t s=0; s < n; ++s) {
+    if (bam_hdrs[s] != NULL)
+      bam_header_destroy(bam_hdrs[s]);
+    if (bam_files[s] != 0)
+      bam_close(bam_files[s]);
+  }
+  return status;
+}
@@ -0,0 +1,437 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  pileup engine
+// The BAM read loop behind rnapileup, shared by every command that
+// needs per-site pileup data. Sites are handed to a SiteVisitor as
+// they leave the queue, in BAM (coordinate) order.
+
+#ifndef HAMR_PILEUP_H
+#define HAMR_PILEUP_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstring>
+#include <stdint.h>
+
+using namespace std;
+
+class OutputBuffer;
+class RunMetrics;
+
+// #define DEBUGMODE
+
+// pileup symbols that are counted, in the order the mismatch BED
+// lists them: reference matches and read bases, + strand upper case,
+// - strand lower case
+const char PILEUP_SYMBOLS[] = ",.ACGTNacgtn";
+const int NUM_PILEUP_SYMBOLS = 12;
+// read positions beyond this go into the last histogram bin
+const int MAX_READPOS = 256;
+
+// index of a pileup symbol in PILEUP_SYMBOLS, or -1
+inline int pileup_symbol_index(char sym) {
+  switch (sym) {
+  case ',': return 0;
+  case '.': return 1;
+  case 'A': return 2;
+  case 'C': return 3;
+  case 'G': return 4;
+  case 'T': return 5;
+  case 'N': return 6;
+  case 'a': return 7;
+  case 'c': return 8;
+  case 'g': return 9;
+  case 't': return 10;
+  case 'n': return 11;
+  default: return -1;
+  }
+}
+
+// true for the symbols of read bases differing from the reference
+// (the ones counted as nonref in the nucleotide frequency table)
+inline bool is_mismatch_symbol(char sym) {
+  return pileup_symbol_index(sym) >= 2;
+}
+
+// represents pileup data at one site
+struct Pileup {
+  int pos;
+  char ref;
+  int nreads;
+  // reads not matching the reference (see is_mismatch_symbol)
+  int nonref;
+  string pileup;
+  string quals;
+  string readpos;
+  // bases offered to the site, including any dropped by --max-depth,
+  // and the state of its random numbers for downsampling
+  unsigned long depth;
+  uint64_t rng;
+
+  // for debugging
+#ifdef DEBUGMODE
+  vector<string> read_ids;
+#endif
+  Pileup() : pos(0), ref('N'), nreads(0), nonref(0), pileup(), quals(), depth(0), rng(0) { }
+  Pileup(int p) : pos(p), ref('N'), nreads(0), nonref(0), pileup(), quals(), depth(0), rng(0) { }
+
+  // start over at position p, keeping the allocated strings
+  void reset(int p) {
+    pos = p;
+    ref = 'N';
+    nreads = 0;
+    nonref = 0;
+    depth = 0;
+    pileup.clear();
+    quals.clear();
+    readpos.clear();
+#ifdef DEBUGMODE
+    read_ids.clear();
+#endif
+  }
+
+  // add one base: sym is the pileup symbol (. , or the read base),
+  // qual the Sanger-encoded quality, rpos the position along the read;
+  // first/last mark the first/last aligned base of the read and rev a
+  // read on the reverse strand
+  void add_base(char refnuc, char sym, char qual, int rpos,
+		bool first, bool last, bool rev) {
+    if (first)
+      pileup += rev ? "$" : "^~";
+    if (last)
+      pileup += rev ? "^~" : "$";
+    pileup += sym;
+    readpos += char(33 + rpos);
+    quals += qual;
+    ref = refnuc;
+    ++nreads;
+    if (is_mismatch_symbol(sym))
+      ++nonref;
+  }
+
+  // add_base for sites downsampled with --max-depth; the strings
+  // already keep the bases in order for replace_base
+  void add_sampled_base(char refnuc, char sym, char qual, int rpos,
+			bool first, bool last, bool rev) {
+    add_base(refnuc, sym, qual, rpos, first, last, rev);
+  }
+
+  // replace the i'th base (and its read start/end markers) with a new one
+  void replace_base(int i, char sym, char qual, int rpos,
+		    bool first, bool last, bool rev) {
+    size_t beg = 0, end = 0;
+    for (int n=0; n <= i && end < pileup.size(); ++n) {
+      beg = end;
+      while (end < pileup.size() && (pileup[end] == '^' || pileup[end] == '$'))
+	end += (pileup[end] == '^') ? 2 : 1;
+      ++end;
+    }
+    string base;
+    if (first)
+      base += rev ? "$" : "^~";
+    if (last)
+      base += rev ? "^~" : "$";
+    base += sym;
+    if (end > beg && is_mismatch_symbol(pileup[end-1]))
+      --nonref;
+    if (is_mismatch_symbol(sym))
+      ++nonref;
+    pileup.replace(beg, end - beg, base);
+    readpos[i] = char(33 + rpos);
+    quals[i] = qual;
+  }
+};
+
+// pileup data at one site as counts: fixed size no matter how many
+// reads cover the site. Same interface as Pileup (reset, add_base) so
+// that the pileup engine can accumulate either.
+struct SiteCounts {
+  int pos;
+  char ref;
+  int nreads;
+  // as in Pileup
+  int nonref;
+  // number of reads showing each of PILEUP_SYMBOLS
+  unsigned int counts[NUM_PILEUP_SYMBOLS];
+  // histogram of read positions for each symbol
+  unsigned int readpos[NUM_PILEUP_SYMBOLS][MAX_READPOS];
+  // highest readpos bin used for each symbol, so resets stay cheap
+  int max_readpos[NUM_PILEUP_SYMBOLS];
+  // quality summary (Q scores, not Sanger-encoded) of the bases kept
+  unsigned long qual_sum;
+  int min_qual;
+  // as in Pileup
+  unsigned long depth;
+  uint64_t rng;
+
+  // with --max-depth, the bases kept in the order they were added, so
+  // that replace_base evicts the same base as Pileup's does
+  struct Slot {
+    signed char sym;	// index in PILEUP_SYMBOLS, -1 if not counted
+    char qual;
+    unsigned char rpos;
+  };
+  vector<Slot> slots;
+
+#ifdef DEBUGMODE
+  vector<string> read_ids;
+#endif
+
+  SiteCounts() {
+    memset(counts, 0, sizeof(counts));
+    memset(readpos, 0, sizeof(readpos));
+    reset(0);
+  }
+
+  void reset(int p) {
+    pos = p;
+    ref = 'N';
+    nreads = 0;
+    nonref = 0;
+    for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+      if (counts[s] > 0)
+	memset(readpos[s], 0, sizeof(unsigned int) * (max_readpos[s] + 1));
+      counts[s] = 0;
+      max_readpos[s] = 0;
+    }
+    qual_sum = 0;
+    min_qual = 255;
+    depth = 0;
+    slots.clear();
+#ifdef DEBUGMODE
+    read_ids.clear();
+#endif
+  }
+
+  void add_base(char refnuc, char sym, char qual, int rpos,
+		bool first, bool last, bool rev) {
+    ref = refnuc;
+    ++nreads;
+    qual_sum += qual - 33;
+    if (qual - 33 < min_qual)
+      min_qual = qual - 33;
+
+    int s = pileup_symbol_index(sym);
+    if (s < 0)
+      return;
+    if (s >= 2)
+      ++nonref;
+    if (rpos >= MAX_READPOS)
+      rpos = MAX_READPOS - 1;
+    ++counts[s];
+    ++readpos[s][rpos];
+    if (rpos > max_readpos[s])
+      max_readpos[s] = rpos;
+  }
+
+  void add_sampled_base(char refnuc, char sym, char qual, int rpos,
+			bool first, bool last, bool rev) {
+    Slot slot;
+    slot.sym = pileup_symbol_index(sym);
+    slot.qual = qual;
+    slot.rpos = (rpos >= MAX_READPOS) ? MAX_READPOS - 1 : rpos;
+    slots.push_back(slot);
+    add_base(refnuc, sym, qual, rpos, first, last, rev);
+  }
+
+  // replace the i'th base added with add_sampled_base
+  void replace_base(int i, char sym, char qual, int rpos,
+		    bool first, bool last, bool rev) {
+    Slot &slot = slots[i];
+    qual_sum -= slot.qual - 33;
+    if (slot.sym >= 0) {
+      --counts[slot.sym];
+      --readpos[slot.sym][slot.rpos];
+      if (slot.sym >= 2)
+	--nonref;
+    }
+    bool was_min = (slot.qual - 33 == min_qual);
+
+    slot.sym = pileup_symbol_index(sym);
+    slot.qual = qual;
+    slot.rpos = (rpos >= MAX_READPOS) ? MAX_READPOS - 1 : rpos;
+    qual_sum += qual - 33;
+    if (was_min) {
+      min_qual = 255;
+      for (size_t k=0; k < slots.size(); ++k)
+	if (slots[k].qual - 33 < min_qual)
+	  min_qual = slots[k].qual - 33;
+    } else if (qual - 33 < min_qual) {
+      min_qual = qual - 33;
+    }
+
+    if (slot.sym < 0)
+      return;
+    if (slot.sym >= 2)
+      ++nonref;
+    ++counts[slot.sym];
+    ++readpos[slot.sym][slot.rpos];
+    if (slot.rpos > max_readpos[slot.sym])
+      max_readpos[slot.sym] = slot.rpos;
+  }
+
+  unsigned int count(char sym) const {
+    int s = pileup_symbol_index(sym);
+    return (s < 0) ? 0 : counts[s];
+  }
+};
+
+// options controlling which bases and sites make it into the pileup
+struct PileupOptions {
+  // library not stand specific
+  bool no_ss;
+  bool exclude_ends;
+  // discard reads with insertions or deletions
+  bool skip_indels;
+  int min_coverage;
+  // sites with fewer reads than this, or a smaller fraction of the
+  // reads, not matching the reference are left out
+  int min_nonref;
+  double min_nonref_fraction;
+  int min_q;
+  // keep at most this many bases per site (0 for no limit), sampled
+  // with a reservoir seeded by seed
+  int max_depth;
+  unsigned long seed;
+  // > 1 to pile up regions of the genome in parallel
+  int threads;
+  // BED file of the only regions to pile up (empty for everything)
+  string regions_fn;
+  // the only chromosomes to pile up (empty for all); set by commands
+  // rather than on the command line
+  vector<string> chromosomes;
+  // time the stages of the pileup (see PileupStats)
+  bool timing;
+  // seconds between progress lines on stderr (0 for none)
+  double progress_interval;
+
+  PileupOptions() : no_ss(false), exclude_ends(false), skip_indels(false),
+		    min_coverage(10), min_nonref(0), min_nonref_fraction(0),
+		    min_q(15), max_depth(0), seed(1),
+		    threads(1), regions_fn(), chromosomes(), timing(false),
+		    progress_interval(0) { }
+};
+
+// track numbers for filtered reads, bases and sites
+struct PileupStats {
+  unsigned long reads_used;
+  unsigned long reads_skipped_unmapped;
+  unsigned long reads_skipped_indels;
+  unsigned long bases_excluded_end;
+  unsigned long bases_excluded_q;
+  unsigned long bases_excluded_depth;
+  unsigned long bases_encountered;
+  unsigned long sites_excluded_cov;
+  unsigned long sites_excluded_nonref;
+  unsigned long sites_encountered;
+  // most sites waiting in the queue at once (per region when parallel)
+  unsigned long max_queued_sites;
+
+  // with PileupOptions::timing, seconds spent in each stage (summed over
+  // threads): reading and decoding BAM records, loading the reference,
+  // walking CIGARs and accumulating bases, and handing sites on
+  double time_bam_decode;
+  double time_ref_load;
+  double time_pileup;
+  double time_output;
+
+  PileupStats() : reads_used(0), reads_skipped_unmapped(0),
+		  reads_skipped_indels(0), bases_excluded_end(0),
+		  bases_excluded_q(0), bases_excluded_depth(0),
+		  bases_encountered(0), sites_excluded_cov(0),
+		  sites_excluded_nonref(0), sites_encountered(0),
+		  max_queued_sites(0), time_bam_decode(0), time_ref_load(0), time_pileup(0),
+		  time_output(0) { }
+
+  // add the numbers of another run (a region piled up separately)
+  void add(const PileupStats &other);
+};
+
+// receives each site that passes the coverage filter, either as a
+// Pileup or, if use_counts() says so, as SiteCounts
+class SiteVisitor {
+public:
+  virtual ~SiteVisitor() { }
+  virtual void visit(const string &ref_id, const Pileup &site) { }
+  virtual void visit_counts(const string &ref_id, const SiteCounts &site) { }
+  virtual bool use_counts() const { return false; }
+
+  // regions can be piled up in parallel when the visitor can be split:
+  // fork() makes an empty visitor for one region (NULL if not supported)
+  // and merge() folds its sites back in; merge is called in coordinate
+  // order, and the part is deleted afterwards
+  virtual SiteVisitor *fork() { return NULL; }
+  virtual void merge(SiteVisitor *part) { }
+};
+
+// in a multi-sample pileup, told each time the sites of every sample
+// before pos on ref_id have been delivered (pos is INT_MAX at the end of
+// a chromosome), so that the samples can be lined up
+class PileupSync {
+public:
+  virtual ~PileupSync() { }
+  virtual void sync(const string &ref_id, int pos) = 0;
+};
+
+// handles a pileup option (--min-q etc.); returns false if key is not
+// a pileup option. invalid is set (and a message printed) on bad values
+bool parse_pileup_option(const string &key, const string &value,
+			 PileupOptions &opts, bool &invalid);
+void print_pileup_options();
+void print_pileup_settings(const PileupOptions &opts);
+void print_pileup_stats(const PileupStats &stats);
+// record the stats in the "reads", "bases", "sites" and "timers_s"
+// sections of metrics
+void set_pileup_metrics(RunMetrics &metrics, const PileupStats &stats);
+
+// parse a line of text .rnapileup into chr and site
+void parse_rnapileup_line(const string &line, string &chr, SiteCounts &site);
+// same, for a line of len bytes (without its newline) in a larger buffer
+void parse_rnapileup_fields(const char *line, size_t len, string &chr,
+			    SiteCounts &site);
+
+// a visitor writing sites to out in a text format: "rnapileup",
+// "mismatchbed" or "nucfreq" (NULL for anything else)
+SiteVisitor *new_text_writer(const string &format, OutputBuffer &out);
+
+// write the mismatch BED lines (one per symbol seen) for a site
+void write_mismatch_bed(OutputBuffer &out, const string &chr,
+			const SiteCounts &site);
+
+// pile up all reads in a sorted BAM file against the genome; bam_fn may
+// be "-" (standard input, piled up serially without an index). Reads
+// out of coordinate order stop the pileup with an error.
+// returns nonzero on error
+int run_pileup(const string &bam_fn, const string &fas_fn,
+	       const PileupOptions &opts,
+	       SiteVisitor &visitor, PileupStats &stats);
+
+// pile up several sorted BAM files aligned to the same genome in one
+// pass over the reference: reads are merged by coordinate, visitors[i]
+// receives the sites of bam_fns[i] and stats[i] its numbers. sync, if
+// not NULL, is told as the samples line up. Returns nonzero on error
+int run_multi_pileup(const vector<string> &bam_fns, const string &fas_fn,
+		     const PileupOptions &opts,
+		     const vector<SiteVisitor *> &visitors,
+		     vector<PileupStats> &stats, PileupSync *sync);
+
+#endif
@@ -22,7 +22,9 @@
 // Generates pileup for RNAseq data:
 //      Requires a sorted BAM file
 //      Genomic strands are treated separately unless --no-strand-specific
-//      Does not support indels
+//      Reads are placed by their CIGAR strings: soft clips, insertions,
+//        deletions and spliced (N) alignments are followed, and only
+//        aligned bases are piled up
 
 //  2.0 - Added another column with position-along-read data
 //        (Sanger encoded just like base quals; X-33 = position along
@@ -31,110 +33,72 @@
 //  2.2 - Integrated into HAMR
 //        Added several options for filtering input, yielding
 //          a smaller output file
-    
-// #define DEBUGMODE
+//  2.3 - Read loop split out into run_pileup so that other commands
+//          (hamr_cmd call) can consume sites without the text format
+//  2.4 - Regions can be piled up in parallel using the BAM index
+//  2.5 - Sites can be accumulated as fixed-size counts instead of
+//          strings (--output-format=mismatchbed, hamr_cmd call)
+//  2.6 - Binary pileup output (--output-format=binary)
+//  2.7 - BAM records are decoded on a separate reader thread
+//  2.8 - Pileup can be restricted to the regions in a BED file
+//  2.9 - Reference sequence is loaded in windows rather than whole
+//          chromosomes
+//  3.0 - Reads are walked along their CIGAR strings: reads with indels
+//          and spliced reads are used (--skip-indel-reads for the old
+//          behavior), and the first aligned bases of soft-clipped reads
+//          are no longer dropped. The queue only holds sites with
+//          aligned bases, so introns cost nothing.
+//  3.1 - --max-depth caps the bases kept per site with a seeded
+//          reservoir sample
+//  3.2 - Bases and quality filters are decoded a whole read at a time
+//          (SSSE3/AVX2 when available)
+//  3.3 - Text output is formatted into large buffers written from a
+//          background thread, optionally as BGZF
+//  3.4 - Stage timings and read counters (--stats-json, --progress)
+//  3.5 - Several BAM files can be piled up in one pass over the
+//          reference (hamr_cmd batch)
+//  3.6 - Nucleotide frequency table output (--output-format=nucfreq),
+//          replacing the strand split, hamr_mismatchbed2table.sh and
+//          sort -m of hamr.sh
+//  3.7 - Sites can be filtered by their number or fraction of reads not
+//          matching the reference (--min-nonref,
+//          --min-nonref-fraction), counted as bases are added
+//  3.8 - The BAM file can be read from standard input (-), and reads
+//          out of coordinate order stop the pileup with an error instead
+//          of a separate pass to check the sort order
+//  3.9 - The pileup engine moved to pileup.cpp (part of libhamr); this
+//          file is only the rnapileup command
 
 #include <iostream>
-#include <iomanip>
-#include <fstream>
 #include <string>
-#include <cstdlib>
-#include <cstdio>
-#include <algorithm>
 #include <vector>
-#include <deque>
-#include <cctype>
 
-#include "sam.h"
-#include "faidx.h"
 #include "hamr.h"
+#include "pileup.h"
+#include "binpileup.h"
+#include "output.h"
+#include "metrics.h"
 
 using namespace std;
 
-///////////////////////
-
-// represents pileup data at one site
-struct Pileup {
-  int pos;
-  char ref;
-  int nreads;
-  string pileup;
-  string quals;
-  string readpos;
-
-  // for debugging
-#ifdef DEBUGMODE
-  vector<string> read_ids;
-#endif
-  Pileup() : pos(0), ref('N'), nreads(0), pileup(), quals() { }
-  Pileup(int p) : pos(p), ref('N'), nreads(0), pileup(), quals() { }
-};
-
-void process_queue(deque<Pileup> &q, int upto_pos, bool process_all,
-		   const string &ref_id,
-		   int min_coverage,
-		   unsigned long &sites_excluded_cov,
-		   unsigned long &sites_encountered) {
-  // output one-based coords
-  while( (!q.empty()) &&
-	 (process_all || (q.front().pos < upto_pos))) {
-
-    ++sites_encountered;
-
-    // exclude sites with not enough reads covering
-    if (q.front().nreads < min_coverage) {
-      ++sites_excluded_cov;
-      q.pop_front();
-      continue;
-    }
-
-    cout << ref_id << "\t"
-	 << 1+(q.front().pos) << "\t"
-	 << q.front().ref << "\t"
-	 << q.front().nreads << "\t"
-	 << q.front().pileup << "\t"
-	 << q.front().quals << "\t" 
-	 << q.front().readpos;
-#ifdef DEBUGMODE
-    cout << "\t";
-    for (int i=0; i < q.front().read_ids.size(); ++i) {
-      cout << q.front().read_ids[i] << ",";
-    }
-#endif
-      cout << "\n";
-    q.pop_front();
-  }
-}
-
-/////////////////////
-/*class DNAComplementer {
-  char c[256];
-public:
-  DNAComplementer() { 
-    for(int i=0; i<256; ++i)
-      c[i] = 'n';
-    c['a'] = 't'; c['c'] = 'g';  c['g'] = 'c'; c['t'] = 'a';
-    c['m'] = 'k'; c['r'] = 'y';  c['k'] = 'm'; c['y'] = 'r';
-    c['s'] = 's'; c['w'] = 'w';
-    c['v'] = 'b'; c['h'] = 'd'; c['b'] = 'v'; c['d'] = 'h';
-    for(int i='a'; i<='z'; ++i)
-      c[toupper(i)] = char(toupper(c[int(i)]));
-  }
-  char operator () (char x) const { return c[int(x)]; }
-  };*/
-
-/////////////////////
-
-void print_usage(const vector<string> &args, bool options_only=false) {
+static void print_usage(const vector<string> &args, bool options_only=false) {
   if (!options_only) {
-    cerr << "USAGE: " << args[0] << " [OPTIONS] reads.bam genome.fasta\n\n"
+    cerr << "USAGE: " << args[0] << " [OPTIONS] reads.bam genome.fasta\n"
+	 << "    (reads.bam may be - to read it from standard input)\n\n"
 	 << "    OPTIONS:\n";
   }
-  cerr   << "      --exclude-ends         Exclude 5' and 3' ends of reads\n"
-         << "      --min-q=N              Exclude bases with Q score < N (15)\n"
-         << "      --min-coverage=N       Exclude sites with < N reads covering (10)\n"
-	 << "      --not-strand-specific  Library not strand-specific (convert everything to +)\n";
-
+  print_pileup_options();
+  // not offered through hamr.sh, which lists options_only
+  if (!options_only)
+    cerr << "      --output-format=FMT    rnapileup, binary (see convert_pileup),\n"
+	 << "                               mismatchbed to skip the\n"
+	 << "                               rnapileup2mismatchbed step, or nucfreq\n"
+	 << "                               for the sorted nucleotide frequency\n"
+	 << "                               table of detect_mods (rnapileup)\n";
+  if (!options_only) {
+    print_output_options();
+    print_metrics_options();
+  }
 }
 
 int rnapileup_main(const vector<string> &args) {
@@ -143,39 +107,34 @@ int rnapileup_main(const vector<string> &args) {
 
   parse_arguments(args, value_args, positional_args);
 
-  // library not stand specific
-  bool no_ss = false;
-  bool exclude_ends = false;
-  int min_coverage = 10;
-  int min_q = 15;
+  PileupOptions opts;
+  OutputOptions out_opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("rnapileup");
+  string output_format("rnapileup");
 
   // collect and validate command line arguments
   for (arg_collection::iterator it = value_args.begin();
        it != value_args.end(); ++it) {
     string key = it->first;
     string value = it->second;
-    bool conv_success = false;
-
-    if (key == "--not-strand-specific") {
-      no_ss = true;
+    bool invalid = false;
 
-    } else if (key == "--exclude-ends") {
-      exclude_ends = true;
-
-    } else if (key == "--min-q") {
-      min_q = from_s<int>(value, conv_success);
-      if (!conv_success || (min_q < 0)) {
-	cerr << "Invalid value for --min-q: " << value << "; must be a non-negative integer\n";
+    if (parse_pileup_option(key, value, opts, invalid) ||
+	parse_output_option(key, value, out_opts, invalid) ||
+	parse_metrics_option(key, value, metrics_opts, invalid)) {
+      if (invalid)
 	return(1);
-      }
 
-    } else if (key == "--min-coverage") {
-      min_coverage = from_s<int>(value, conv_success);
-      if (!conv_success || (min_coverage < 0)) {
-	cerr << "Invalid value for --min-coverage: "
-	     << value << "; must be a non-negative integer\n";
+    } else if (key == "--output-format") {
+      output_format = value;
+      if (output_format != "rnapileup" && output_format != "binary" &&
+	  output_format != "mismatchbed" && output_format != "nucfreq") {
+	cerr << "Invalid value for --output-format: " << value
+	     << "; must be rnapileup, binary, mismatchbed or nucfreq\n";
 	return(1);
       }
+
     } else if (key == "--list-options") {
       print_usage(args, true);
       return(0);
@@ -195,251 +154,46 @@ int rnapileup_main(const vector<string> &args) {
   string bam_fn( positional_args[1] );
   string fas_fn( positional_args[2] );
 
+  if (output_format == "binary" && out_opts.bgzf) {
+    cerr << "ERROR: --output-compression only applies to text output\n";
+    return(1);
+  }
+
   // output supplied arguments
   cerr << "  Processing BAM file " << bam_fn << "\n";
   cerr << "  Using genome fasta file " << fas_fn << "\n";
-  if (no_ss)
-    cerr << "  Treating library as non-stand-specific\n";
-  if (exclude_ends)
-    cerr << "  Excluding ends of reads\n";
-  cerr << "  Requiring Q-score >= " << min_q << "\n";
-  cerr << "  Requiring " << min_coverage << " coverage at a site\n";
-
-  // index the fasta file by finding out where each chr starts
-  ifstream file(fas_fn.c_str());
-  if (!file.is_open()) {
-    cerr << "Failed to open FASTA file " << fas_fn << "\n";
-    return 1;
+  print_pileup_settings(opts);
+  opts.timing = metrics_opts.enabled();
+  opts.progress_interval = metrics_opts.progress_interval;
+
+  OutputWriter output;
+  SiteVisitor *writer;
+  BinPileupWriter *bin_writer = NULL;
+  if (output_format == "binary") {
+    writer = bin_writer = new BinPileupWriter(&cout);
+  } else {
+    if (!output.open("-", out_opts))
+      return 1;
+    writer = new_text_writer(output_format, output);
   }
 
-  faidx_t *fai = fai_load(fas_fn.c_str());
-
-  bamFile bam_file;
-  bam_header_t *bam_hdr;
-
-  if ((bam_file = bam_open(bam_fn.c_str(), "r")) == 0) {
-    cerr << "Failed to open BAM file " << bam_fn << "\n";
+  PileupStats stats;
+  int status = run_pileup(bam_fn, fas_fn, opts, *writer, stats);
+  if (status == 0 && bin_writer != NULL)
+    bin_writer->close();
+  delete writer;
+  if (!output.close())
+    status = 1;
+  if (status != 0)
     return 1;
-  }
-
-  // read BAM header
-  bam_hdr = bam_header_read(bam_file);
-  bam1_t *bam = bam_init1();
-
-  string curr_ref;
-  string prev_ref;
-  char *ref_seq = NULL;
-  int ref_len(0);
-  bool changed_ref = false;
-
-  string bases(16, 'X');
-  bases[1] = 'A';
-  bases[2] = 'C';
-  bases[4] = 'G';
-  bases[8] = 'T';
-  bases[15] = 'N';
-
-  // track numbers for filtered bases
-  unsigned long bases_excluded_end = 0;
-  unsigned long bases_excluded_q = 0;
-  unsigned long bases_encountered = 0;
-  unsigned long sites_excluded_cov = 0;
-  unsigned long sites_encountered = 0;
-
-
-  // maintain a queue of pileup data and output sites (process_queue)
-  // when we encounter a read that starts after them
-  deque<Pileup> q;
-
-  while( bam_read1(bam_file, bam) > 0 ) {
-    changed_ref = false;
-
-    // skip non-unique reads
-    //int num_hits = bam_aux2i( bam_aux_get(bam, "NH") );
-    //if (num_hits > 1)
-    //  continue;
-
-    // skip unmapped reads
-    if ((bam->core.flag & 0x4) > 0)
-      continue;
-
-    // check for soft-clipped reads (clipped seq is present in SEQ field but missing from reference)
-    // on both ends
-    bool has_indels(false);
-    int nclipstart(0);
-    int nclipend(0);
-    
-    // check the CIGAR string for various operations
-    for(int i=0; i < bam->core.n_cigar; ++i) {
-      // discards reads with indels
-      if (bam_cigar_op(bam1_cigar(bam)[i]) == BAM_CINS || 
-	  bam_cigar_op(bam1_cigar(bam)[i]) == BAM_CDEL )  {
-	has_indels = true;
-	break;
-      }
-
-      // note soft-clipping so we can ignore those bases
-      if (bam_cigar_op(bam1_cigar(bam)[i]) == BAM_CSOFT_CLIP) {
-	if (i == 0)
-	  nclipstart = bam_cigar_oplen(bam1_cigar(bam)[i]);
-	else
-	  nclipend = bam_cigar_oplen(bam1_cigar(bam)[i]);
-      }
-    }
-
-    if (has_indels)
-      continue;
-
-    // get chr name for this bam line
-    string ref( bam_hdr->target_name[bam->core.tid] );
-
-    // load genomic sequence for this chromosome
-    if (ref != curr_ref) {
-      cerr << "Loading sequence for " << ref << " ...";
-
-      if (ref_seq) {
-	// deallocate previous chr sequence
-	free(ref_seq);
-	changed_ref = true;
-	prev_ref = curr_ref;
-      } else {
-	// initialize prev_ref to ref
-	prev_ref = ref;
-      }
-
-      curr_ref = ref;
-      ref_seq = fai_fetch(fai, ref.c_str(), &ref_len);
-
-      // convert sequence to uppercase
-      for(int i=0; i < ref_len; ++i)
-	ref_seq[i] = toupper(ref_seq[i]);
-
-      cerr << "done.\n";
-      cerr.flush();
-    }
-    
-    int read_pos(bam->core.pos);
-    int read_len(bam->core.l_qseq);
-    string read_qual(read_len, '#');
-    string read_seq(read_len, 'N');
-
-#ifdef DEBUGMODE
-    string read_id(bam1_qname(bam));
-#endif
-
-#ifdef DEBUGMODE
-    if (nclipstart != 0 || nclipend != 0)
-      cerr << "Soft-clipped: (" << nclipstart << ", " << nclipend << "\n";
-#endif
-
-    // remove all the soft-clipped bases from the start
-    read_seq.erase(0, nclipstart);
-    read_qual.erase(0, nclipstart);
-    read_len -= nclipstart;
-    
-    // process queue
-    process_queue(q, read_pos, changed_ref, 
-		  changed_ref ? prev_ref : curr_ref,
-		  min_coverage,
-		  sites_excluded_cov,
-		  sites_encountered);
-
-    // build read seq
-    for(int i=0; i < (read_len-nclipend); ++i) {
-      read_seq[i] = bases[bam1_seqi( bam1_seq(bam), nclipstart + i)];
-      read_qual[i] = 33+bam1_qual(bam)[nclipstart + i];
-    }
-    //cout << "Read: " << read_seq << "\n";
-
-    bool rev_strand = bam1_strand(bam);
-
-    // for this read, simultaneously loop through its sequence
-    // and the pileup queue
-    deque<Pileup>::iterator q_it( q.begin() );
-    for(int i=0; i < (read_len-nclipend); ++i, ++q_it) {
-      int g(read_pos + i);  // genomic position
-
-      // reported POS in bam is actually the first MATCHING base, so adjust it by the starting soft clip
-      //g -= nclipstart;
-
-      if (q_it == q.end()) {
-	q.push_back(Pileup(g));
-	q_it = q.end()-1;
-      }
-
-      // skip clipped bases
-      if ( i < nclipstart || i > ((read_len-nclipend)-1) )
-	continue;
-
-      ++bases_encountered;
-
-      // exclude read-ends
-      if (exclude_ends && 
-	  ((i == 0) || (i == (read_len - 1))) ) {
-	++bases_excluded_end;
-	continue;
-      }
-      // exclude low-quality bases
-      if ((int(read_qual[i])-33) < min_q) {
-	++bases_excluded_q;
-	continue;
-      }
-
-      if (q_it->pos != g) {
-	cerr << "ERROR: read pos " << g << " != queue pos " << q_it->pos << "\n";
-#ifdef DEBUGMODE
-	cerr << read_pos << " " << read_id << "\n";
-#endif
-	return 1;
-      }
-
-      // cout << read_seq[i] << " vs " << ref_seq[g] << "\n";
-     
-      if (i == 0)
-	q_it->pileup += (rev_strand && !no_ss) ? "$" : "^~";
-      if (i == ((read_len-nclipend) - 1))
-	q_it->pileup += (rev_strand && !no_ss) ? "^~" : "$";
-
-      // make sure we don't go past end of ref seq
-      if (g >= ref_len) {
-	cerr << "ERROR: genomic pos " << g << " >= chr length (" << ref_len << ")\n";
-	return 1;
-      }
-
-      if (ref_seq[g] == read_seq[i])
-	q_it->pileup += (rev_strand && !no_ss) ? ',' : '.';
-      else
-	q_it->pileup += (rev_strand && !no_ss) ? tolower(read_seq[i]) : read_seq[i];
-
-      q_it->readpos += char(33 + ((rev_strand && !no_ss) ? (read_len-(1+i)) : i));
-      q_it->ref = ref_seq[g];
-      q_it->quals += read_qual[i];
-
-#ifdef DEBUGMODE
-      q_it->read_ids.push_back(read_id);
-#endif
-
-      ++(q_it->nreads);
-    }
-  }
-
-  // process queue
-  process_queue(q, 0, true, curr_ref, min_coverage,
-		sites_excluded_cov, sites_encountered);
 
   // output statistics
-  double bases_excluded_end_pct = 100.0 * double(bases_excluded_end) / 
-    double(bases_encountered);
-  double bases_excluded_q_pct = 100.0 * double(bases_excluded_q) / 
-    double(bases_encountered);
-  double sites_excluded_cov_pct = 100.0 * double(sites_excluded_cov) / 
-    double(sites_encountered);
+  print_pileup_stats(stats);
 
-  cerr << "Bases encountered: " << bases_encountered << "\n"
-       << "Bases excluded due to being on read-end: " << setw(3) << bases_excluded_end_pct << "%\n"
-       << "Bases excluded due to low Q: " << setw(3) << bases_excluded_q_pct << "%\n"
-       << "Sites encountered: " << sites_encountered << "\n"
-       << "Sites excluded due to low coverage: " << setw(3) << sites_excluded_cov_pct << "%\n";
+  set_pileup_metrics(metrics, stats);
+  metrics.set("output", "format", output_format);
+  if (!metrics.write_json(metrics_opts.json_fn))
+    return 1;
 
   return 0;
 }
@@ -19,159 +19,468 @@
 //  DEALINGS IN THE SOFTWARE.
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string>
 #include <vector>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "hamr.h"
+#include "pileup.h"
+#include "binpileup.h"
+#include "output.h"
+#include "metrics.h"
 
 using namespace std;
 
-int rnapileup2mismatchbed_main( const vector<string> &args ) {
-  if (args.size() < 2) {
-    cerr << "USAGE: " << args[0] << " in.rnapileup\n";
-    return(1);
+// reads a text file (or stdin) in large blocks and hands out its lines
+// in place; only a line straddling two blocks gets moved
+class LineReader {
+  FILE *fp;
+  vector<char> buf;
+  size_t beg;
+  size_t end;
+  bool eof;
+
+public:
+  LineReader(FILE *fp) : fp(fp), buf(1 << 20), beg(0), end(0), eof(false) { }
+
+  // the next line, without its newline; false at the end of the input
+  bool next(const char *&line, size_t &len) {
+    for (;;) {
+      char *data = &buf[0];
+      const char *nl = (const char *)memchr(data + beg, '\n', end - beg);
+      if (nl != NULL) {
+	line = data + beg;
+	len = nl - line;
+	beg += len + 1;
+	return true;
+      }
+      if (eof) {
+	// last line without a newline
+	if (beg == end)
+	  return false;
+	line = data + beg;
+	len = end - beg;
+	beg = end;
+	return true;
+      }
+
+      // move the partial line to the front and fill up the rest
+      if (beg > 0) {
+	memmove(data, data + beg, end - beg);
+	end -= beg;
+	beg = 0;
+      }
+      if (end == buf.size()) {
+	buf.resize(buf.size() * 2);
+	data = &buf[0];
+      }
+      size_t n = fread(data + end, 1, buf.size() - end, fp);
+      if (n == 0)
+	eof = true;
+      end += n;
+    }
   }
 
-  // arg! have to do these annoying tricks to get an input stream
-  // to come from stdin or a file
-  istream* p_infile;
-  ifstream* p_in;
-  if (args[1] != "-") {
-    p_in = new ifstream(args[1].c_str());
-    if (!p_in->is_open()) {
-      cerr << "Could not open file " << args[1] << "\n";
-      return(1);
+  bool error() const { return ferror(fp) != 0; }
+};
+
+/////////////////////
+// --threads: the text is cut into blocks of whole lines, which are
+//   converted on a pool of threads and written out in input order.
+//   A file is split by offset, each worker reading its own blocks; a
+//   stream (stdin, a pipe) is read a block at a time on the main
+//   thread while the workers convert the blocks before it. At most
+//   max_ahead blocks are in memory at once.
+
+const size_t MISMATCHBED_BLOCK_SIZE = 1 << 21;
+
+struct TextBlock {
+  // the lines of the block (read by the worker for a file)
+  vector<char> text;
+  OutputBuffer out;
+  unsigned long n_sites;
+  // chromosome of the last site, for progress lines
+  string chr;
+  bool done;
+  bool failed;
+};
+
+struct BlockConversion {
+  // the file split by offset, or -1 for a stream
+  int fd;
+  off_t file_size;
+
+  // block b goes through slots[b % max_ahead]
+  TextBlock *slots;
+  size_t max_ahead;
+  // blocks handed out to the workers, taken by them, and written
+  size_t next_read;
+  size_t next_convert;
+  size_t next_write;
+  bool stop;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+// pread all of n bytes at offset
+static bool pread_full(int fd, char *buf, size_t n, off_t offset) {
+  while (n > 0) {
+    ssize_t k = pread(fd, buf, n, offset);
+    if (k <= 0)
+      return false;
+    buf += k;
+    n -= k;
+    offset += k;
+  }
+  return true;
+}
+
+// read the lines of a file that start in block b into text, from
+// text[start] on; the last one is read past the block to its end
+static bool read_file_block(int fd, off_t file_size, size_t b,
+			    vector<char> &text, size_t &start) {
+  off_t beg = off_t(b) * MISMATCHBED_BLOCK_SIZE;
+  off_t end = min(beg + off_t(MISMATCHBED_BLOCK_SIZE), file_size);
+  // the byte before the block tells if a line starts right at beg
+  off_t from = (beg > 0) ? beg - 1 : 0;
+  text.resize(end - from);
+  if (!pread_full(fd, &text[0], text.size(), from))
+    return false;
+
+  start = 0;
+  if (beg > 0) {
+    const char *nl = (const char *)memchr(&text[0], '\n', text.size() - 1);
+    if (nl == NULL) {
+      // inside a line that started in an earlier block
+      text.clear();
+      return true;
     }
-    p_infile = p_in;
+    start = nl + 1 - &text[0];
   }
-  else
-    p_infile = &cin;
-
-  istream& infile = (*p_infile);
-
-  vector<char> relevant_nucs;
-  relevant_nucs.push_back(',');
-  relevant_nucs.push_back('.');
-  relevant_nucs.push_back('A');
-  relevant_nucs.push_back('C');
-  relevant_nucs.push_back('G');
-  relevant_nucs.push_back('T');
-  relevant_nucs.push_back('N');
-  relevant_nucs.push_back('a');
-  relevant_nucs.push_back('c');
-  relevant_nucs.push_back('g');
-  relevant_nucs.push_back('t');
-  relevant_nucs.push_back('n');
-
-  bool rev_strand[256];
-  memset(rev_strand, 0, sizeof(bool)*256);
-  rev_strand['a'] = rev_strand['c'] = rev_strand['g'] = rev_strand['t'] = 
-    rev_strand['n'] = rev_strand[','] = true;
-
-  char complement[256];
-  memset(complement, 0, sizeof(char)*256);
-  complement['A'] = complement['a'] = 'T';
-  complement['C'] = complement['c'] = 'G';
-  complement['G'] = complement['g'] = 'C';
-  complement['T'] = complement['t'] = 'A';
-  complement['N'] = complement['n'] = 'N';
-  complement['.'] = complement[','] = '.';
-
-
-  string line;
-  while (getline(infile, line)) {
-    istringstream linestr(line);
-    string chr, posstr, refstr, nstr;
-    getline(linestr, chr, '\t');
-    getline(linestr, posstr, '\t');
-    unsigned int pos = atoi(posstr.c_str());
-
-    getline(linestr, refstr, '\t');
-    char ref=refstr[0];
-
-    getline(linestr, nstr, '\t');
-    //int n = atoi(nstr.c_str());
-
-    string nucstr;
-    getline(linestr, nucstr, '\t');
-
-    string qualstr;
-    getline(linestr, qualstr, '\t');
-
-    string readposstr;
-    getline(linestr, readposstr, '\t');
-
-    int counts[256];
-    memset(counts, 0, sizeof(int)*256);
-
-    string readposstr_by_nuc[256];
-
-    int read_idx=0;
-    for(unsigned int i=0; i < nucstr.size(); ++i) {
-      if (nucstr[i] == '^')
-	i += 2; // skip ^ and mapq
-      else if (nucstr[i] == '$')
-	i += 1; // skip $
-      ++ counts[(unsigned int)nucstr[i]];
-      readposstr_by_nuc[ (unsigned int)nucstr[i] ] += readposstr[read_idx];
-      ++ read_idx;
+
+  while (text.back() != '\n' && end < file_size) {
+    size_t n = text.size();
+    size_t more = min(off_t(1 << 16), file_size - end);
+    text.resize(n + more);
+    if (!pread_full(fd, &text[n], more, end))
+      return false;
+    end += more;
+    const char *nl = (const char *)memchr(&text[n], '\n', more);
+    if (nl != NULL)
+      text.resize(nl + 1 - &text[0]);
+  }
+  return true;
+}
+
+// read the next block of whole lines of a stream into text, starting
+// with the partial line left in carry by the last block; eof is set
+// once the stream has been read to the end
+static bool read_stream_block(FILE *fp, vector<char> &carry,
+			      vector<char> &text, bool &eof) {
+  text.swap(carry);
+  carry.clear();
+  size_t n = text.size();
+  for (;;) {
+    text.resize(n + MISMATCHBED_BLOCK_SIZE);
+    size_t k = fread(&text[n], 1, MISMATCHBED_BLOCK_SIZE, fp);
+    if (k < MISMATCHBED_BLOCK_SIZE) {
+      text.resize(n + k);
+      eof = true;
+      return ferror(fp) == 0;
+    }
+    // keep the line cut off at the end for the next block; a line
+    // longer than a block makes it bigger
+    size_t last = n + k;
+    while (last > n && text[last - 1] != '\n')
+      --last;
+    if (last > n) {
+      carry.assign(text.begin() + last, text.end());
+      text.resize(last);
+      return true;
     }
+    n += k;
+  }
+}
 
-    for(unsigned int i=0; i < relevant_nucs.size(); ++i) {
-      char strand = '+';
-      char new_ref = ref;
-      char nuc = relevant_nucs[i];
-      char orig_nuc = nuc;
-      unsigned int nuc_idx = (unsigned int)nuc;
-      unsigned int ref_nuc_idx = (unsigned int)ref;
-      unsigned int orig_nuc_idx = (unsigned int)orig_nuc;
-
-      int count = counts[nuc_idx];
-      if (count > 0) {
-	if (rev_strand[nuc_idx]) {
-	  strand = '-';
-	  new_ref = complement[ref_nuc_idx];
-	  nuc = complement[nuc_idx];
-	}
-	// condense read position string (which is Sanger encoded)
-	// into a histogram of the form x:count,x:count,...
-	int readpos_counts[256];
-	memset(readpos_counts, 0, sizeof(int)*256);
-
-	// track max_readpos to speed up the loop below
-	int max_readpos=0;
-	for(unsigned int i=0; i < readposstr_by_nuc[orig_nuc_idx].size(); ++i) {
-	  int readpos = int(readposstr_by_nuc[orig_nuc_idx][i])-33;
-	  ++ readpos_counts[readpos];
-	  max_readpos = (readpos > max_readpos) ? readpos : max_readpos;
-	}
+// convert the lines in text[start..] into blk
+static void convert_lines(const vector<char> &text, size_t start,
+			  TextBlock &blk, SiteCounts &site) {
+  blk.out.clear();
+  blk.n_sites = 0;
+  if (start >= text.size())
+    return;
+  const char *p = &text[start];
+  const char *end = &text[0] + text.size();
+  while (p < end) {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    size_t len = (nl ? nl : end) - p;
+    parse_rnapileup_fields(p, len, blk.chr, site);
+    write_mismatch_bed(blk.out, blk.chr, site);
+    ++blk.n_sites;
+    p += len + 1;
+  }
+}
+
+static void *conversion_worker(void *data) {
+  BlockConversion &cv = *(BlockConversion *)data;
+  SiteCounts site;
+
+  pthread_mutex_lock(&cv.lock);
+  for (;;) {
+    while (!cv.stop && cv.next_convert >= cv.next_read)
+      pthread_cond_wait(&cv.cond, &cv.lock);
+    if (cv.stop)
+      break;
+    size_t b = cv.next_convert++;
+    TextBlock &blk = cv.slots[b % cv.max_ahead];
+    pthread_mutex_unlock(&cv.lock);
+
+    size_t start = 0;
+    blk.failed = (cv.fd >= 0 &&
+		  !read_file_block(cv.fd, cv.file_size, b, blk.text, start));
+    if (!blk.failed)
+      convert_lines(blk.text, start, blk, site);
+
+    pthread_mutex_lock(&cv.lock);
+    blk.done = true;
+    pthread_cond_broadcast(&cv.cond);
+  }
+  pthread_mutex_unlock(&cv.lock);
+  return NULL;
+}
+
+// convert text from infile (in_fn) on nthreads threads; returns false
+// on read errors
+static bool convert_parallel(FILE *infile, const string &in_fn, int nthreads,
+			     OutputWriter &out, ProgressMeter &progress,
+			     unsigned long &n_sites) {
+  BlockConversion cv;
+  cv.fd = -1;
+  cv.file_size = 0;
+  struct stat st;
+  if (infile != stdin && fstat(fileno(infile), &st) == 0 &&
+      S_ISREG(st.st_mode)) {
+    cv.fd = fileno(infile);
+    cv.file_size = st.st_size;
+  }
+  const size_t n_file_blocks = (cv.file_size + MISMATCHBED_BLOCK_SIZE - 1) /
+    MISMATCHBED_BLOCK_SIZE;
+
+  cv.max_ahead = 2 * nthreads;
+  cv.slots = new TextBlock[cv.max_ahead];
+  cv.next_read = 0;
+  cv.next_convert = 0;
+  cv.next_write = 0;
+  cv.stop = false;
+  pthread_mutex_init(&cv.lock, NULL);
+  pthread_cond_init(&cv.cond, NULL);
+
+  vector<pthread_t> threads(nthreads);
+  for (int i=0; i < nthreads; ++i)
+    pthread_create(&threads[i], NULL, conversion_worker, &cv);
+
+  vector<char> carry;
+  bool eof = false;
+  bool failed = false;
 
-	// output BED format
-	cout << chr << "\t" << (pos-1) << "\t" << pos << "\t"
-	     << new_ref << ">" << nuc << "\t" << count << ";";
-	bool first=true;
-	for(int i=0; i <= max_readpos; ++i) {
-	  if (readpos_counts[i] > 0) {
-	    if (!first)
-	      cout << ",";
-	    cout << i << ":" << readpos_counts[i];
-	    first=false;
-	  }
+  pthread_mutex_lock(&cv.lock);
+  for (;;) {
+    // hand out blocks while there's room
+    while (cv.next_read < cv.next_write + cv.max_ahead) {
+      TextBlock &blk = cv.slots[cv.next_read % cv.max_ahead];
+      if (cv.fd >= 0) {
+	if (cv.next_read >= n_file_blocks)
+	  break;
+      } else {
+	if (eof)
+	  break;
+	// no worker touches the slot until it's handed out
+	pthread_mutex_unlock(&cv.lock);
+	if (!read_stream_block(infile, carry, blk.text, eof))
+	  failed = true;
+	pthread_mutex_lock(&cv.lock);
+	if (failed || blk.text.empty())
+	  break;
+      }
+      blk.done = false;
+      ++cv.next_read;
+      pthread_cond_broadcast(&cv.cond);
+    }
+    if (failed || cv.next_write == cv.next_read)
+      break;
+
+    // write the oldest block once it is converted
+    TextBlock &blk = cv.slots[cv.next_write % cv.max_ahead];
+    while (!blk.done)
+      pthread_cond_wait(&cv.cond, &cv.lock);
+    pthread_mutex_unlock(&cv.lock);
+
+    if (blk.failed)
+      failed = true;
+    else {
+      out.put(blk.out.data(), blk.out.size());
+      n_sites += blk.n_sites;
+      if (blk.n_sites > 0)
+	progress.update(n_sites, blk.chr);
+    }
+
+    pthread_mutex_lock(&cv.lock);
+    if (failed)
+      break;
+    ++cv.next_write;
+  }
+  cv.stop = true;
+  pthread_cond_broadcast(&cv.cond);
+  pthread_mutex_unlock(&cv.lock);
+
+  for (int i=0; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+  pthread_cond_destroy(&cv.cond);
+  pthread_mutex_destroy(&cv.lock);
+  delete [] cv.slots;
+
+  if (failed)
+    cerr << "ERROR: could not read " << in_fn << "\n";
+  return !failed;
+}
+
+static void print_mismatchbed_usage(const vector<string> &args) {
+  cerr << "USAGE: " << args[0] << " [OPTIONS] in.rnapileup\n"
+       << "    in.rnapileup may also be in the binary pileup format\n\n"
+       << "    OPTIONS:\n"
+       << "      --threads=N            Convert blocks of the text on N threads,\n"
+       << "                               writing them in order (1)\n";
+  print_output_options();
+  print_metrics_options();
+}
+
+int rnapileup2mismatchbed_main( const vector<string> &args ) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  OutputOptions out_opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("rnapileup2mismatchbed");
+  int threads = 1;
+  string in_fn;
+  if (positional_args.size() >= 2)
+    in_fn = positional_args[1];
+
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    bool invalid = false;
+
+    if (parse_output_option(it->first, it->second, out_opts, invalid) ||
+	parse_metrics_option(it->first, it->second, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (it->first == "--threads") {
+      bool conv_success;
+      threads = from_s<int>(it->second, conv_success);
+      if (!conv_success || (threads < 1)) {
+	cerr << "Invalid value for --threads: "
+	     << it->second << "; must be a positive integer\n";
+	return(1);
+      }
+    }
+  }
+
+  if (in_fn.empty()) {
+    print_mismatchbed_usage(args);
+    return(1);
+  }
+
+  SiteCounts site;
+  OutputWriter out;
+  ProgressMeter progress(metrics_opts.progress_interval, "sites");
+  unsigned long n_sites = 0;
+
+  // binary pileup files are mapped and read in place
+  if (is_binpileup_file(in_fn)) {
+    BinPileupReader reader;
+    if (!reader.open(in_fn))
+      return(1);
+    if (!out.open("-", out_opts))
+      return(1);
+    for (size_t b=0; b < reader.num_blocks(); ++b) {
+      const string &chr = reader.chr_name(reader.block(b).chr);
+      BinPileupCursor c;
+      reader.start_block(b, c);
+      for (size_t i=0; i < reader.block(b).n_sites; ++i) {
+	if (!reader.next_site(c, site)) {
+	  cerr << "ERROR: corrupt site in block " << b << " of "
+	       << in_fn << "\n";
+	  out.close();
+	  return(1);
 	}
-      
-	cout << "\t" << strand << "\n";
+	write_mismatch_bed(out, chr, site);
       }
+      n_sites += reader.block(b).n_sites;
+      progress.update(n_sites, chr);
     }
+    if (!out.close())
+      return(1);
+    metrics.set("input", "format", string("binary"));
+    metrics.set("input", "sites", n_sites);
+    return metrics.write_json(metrics_opts.json_fn) ? 0 : 1;
   }
 
-  if (p_infile != &cin)
-    delete p_infile;
+  // text is read in large blocks and parsed in place
+  FILE *infile = stdin;
+  if (in_fn != "-") {
+    infile = fopen(in_fn.c_str(), "rb");
+    if (infile == NULL) {
+      cerr << "Could not open file " << in_fn << "\n";
+      return(1);
+    }
+  }
+  if (!out.open("-", out_opts)) {
+    if (infile != stdin)
+      fclose(infile);
+    return(1);
+  }
+
+  bool failed = false;
+  if (threads > 1) {
+    failed = !convert_parallel(infile, in_fn, threads, out, progress, n_sites);
+  } else {
+    LineReader reader(infile);
+    const char *line;
+    size_t len;
+    string chr;
+    while (reader.next(line, len)) {
+      parse_rnapileup_fields(line, len, chr, site);
+      write_mismatch_bed(out, chr, site);
+      if ((++n_sites & 0xffff) == 0)
+	progress.update(n_sites, chr);
+    }
+
+    failed = reader.error();
+    if (failed)
+      cerr << "ERROR: could not read " << in_fn << "\n";
+  }
+  if (infile != stdin)
+    fclose(infile);
+  if (!out.close())
+    failed = true;
+
+  if (failed)
+    return(1);
 
+  metrics.set("input", "format", string("rnapileup"));
+  metrics.set("input", "sites", n_sites);
+  metrics.set("input", "threads", (unsigned long)threads);
+  if (!metrics.write_json(metrics_opts.json_fn))
+    return(1);
   return(0);
 }
-
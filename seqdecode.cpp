@@ -0,0 +1,179 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <cstdlib>
+#include <cstring>
+
+#include "seqdecode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAMR_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// character for each 4-bit base code
+static const char BASE_CHARS[17] = "XACXGXXXTXXXXXXN";
+
+// highest quality that still fits a char once Sanger-encoded
+static const int MAX_MASK_QUAL = 94;
+
+/////////////////////
+// scalar versions, also used for the ends of reads
+
+static void decode_bases_scalar(const uint8_t *seq, int n, char *out) {
+  for (int i=0; i < n; ++i)
+    out[i] = BASE_CHARS[(seq[i >> 1] >> ((~i & 1) << 2)) & 0xf];
+}
+
+static void mask_quals_scalar(const uint8_t *qual, int n, int min_q,
+			      uint8_t *out) {
+  for (int i=0; i < n; ++i)
+    out[i] = (qual[i] >= min_q && qual[i] <= MAX_MASK_QUAL);
+}
+
+#ifdef HAMR_X86_KERNELS
+
+/////////////////////
+// SSSE3: 16 packed bytes (32 bases) at a time; the high nibble of each
+// byte is the first base
+
+__attribute__((target("ssse3")))
+static void decode_bases_ssse3(const uint8_t *seq, int n, char *out) {
+  const __m128i table = _mm_loadu_si128((const __m128i *)BASE_CHARS);
+  const __m128i low4 = _mm_set1_epi8(0x0f);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(seq + (i >> 1)));
+    __m128i hi = _mm_shuffle_epi8(table,
+				  _mm_and_si128(_mm_srli_epi16(v, 4), low4));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, low4));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  decode_bases_scalar(seq + (i >> 1), n - i, out + i);
+}
+
+__attribute__((target("ssse3")))
+static void mask_quals_ssse3(const uint8_t *qual, int n, int min_q,
+			     uint8_t *out) {
+  const __m128i lo = _mm_set1_epi8((char)min_q);
+  const __m128i hi = _mm_set1_epi8((char)MAX_MASK_QUAL);
+  const __m128i one = _mm_set1_epi8(1);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i q = _mm_loadu_si128((const __m128i *)(qual + i));
+    // unsigned lo <= q <= hi
+    __m128i ok = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(q, lo), q),
+			       _mm_cmpeq_epi8(_mm_min_epu8(q, hi), q));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(ok, one));
+  }
+  mask_quals_scalar(qual + i, n - i, min_q, out + i);
+}
+
+/////////////////////
+// AVX2: twice the width; shuffles and unpacks work within 128-bit
+// lanes, so the halves are put back in order at the end
+
+__attribute__((target("avx2")))
+static void decode_bases_avx2(const uint8_t *seq, int n, char *out) {
+  const __m256i table = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i *)BASE_CHARS));
+  const __m256i low4 = _mm256_set1_epi8(0x0f);
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(seq + (i >> 1)));
+    __m256i hi = _mm256_shuffle_epi8(
+      table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low4));
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(out + i),
+			_mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + i + 32),
+			_mm256_permute2x128_si256(a, b, 0x31));
+  }
+  decode_bases_ssse3(seq + (i >> 1), n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static void mask_quals_avx2(const uint8_t *qual, int n, int min_q,
+			    uint8_t *out) {
+  const __m256i lo = _mm256_set1_epi8((char)min_q);
+  const __m256i hi = _mm256_set1_epi8((char)MAX_MASK_QUAL);
+  const __m256i one = _mm256_set1_epi8(1);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i q = _mm256_loadu_si256((const __m256i *)(qual + i));
+    __m256i ok = _mm256_and_si256(
+      _mm256_cmpeq_epi8(_mm256_max_epu8(q, lo), q),
+      _mm256_cmpeq_epi8(_mm256_min_epu8(q, hi), q));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(ok, one));
+  }
+  mask_quals_ssse3(qual + i, n - i, min_q, out + i);
+}
+
+#endif
+
+/////////////////////
+// dispatch, decided once
+
+struct SeqDecodeKernels {
+  const char *name;
+  void (*decode_bases)(const uint8_t *, int, char *);
+  void (*mask_quals)(const uint8_t *, int, int, uint8_t *);
+
+  SeqDecodeKernels() : name("scalar"), decode_bases(decode_bases_scalar),
+		       mask_quals(mask_quals_scalar) {
+#ifdef HAMR_X86_KERNELS
+    const char *want = getenv("HAMR_SIMD");
+    if (want == NULL)
+      want = "avx2";
+    __builtin_cpu_init();
+    if (strcmp(want, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+      name = "avx2";
+      decode_bases = decode_bases_avx2;
+      mask_quals = mask_quals_avx2;
+    } else if (strcmp(want, "scalar") != 0 &&
+	       __builtin_cpu_supports("ssse3")) {
+      name = "ssse3";
+      decode_bases = decode_bases_ssse3;
+      mask_quals = mask_quals_ssse3;
+    }
+#endif
+  }
+};
+
+static const SeqDecodeKernels kernels;
+
+void decode_bases(const uint8_t *seq, int n, char *out) {
+  kernels.decode_bases(seq, n, out);
+}
+
+void mask_quals(const uint8_t *qual, int n, int min_q, uint8_t *out) {
+  // qualities are bytes; anything above the highest usable one is
+  // the same as letting nothing through
+  if (min_q > MAX_MASK_QUAL + 1)
+    min_q = MAX_MASK_QUAL + 1;
+  kernels.mask_quals(qual, n, min_q, out);
+}
+
+const char *seq_decode_kernels() {
+  return kernels.name;
+}
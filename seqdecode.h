@@ -0,0 +1,44 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  seqdecode
+// Whole-read decoding of BAM sequences and qualities for the pileup.
+// On x86 the SSSE3 or AVX2 versions are picked at run time, depending
+// on the CPU; the environment variable HAMR_SIMD=scalar|ssse3|avx2
+// overrides the choice (for testing).
+
+#ifndef HAMR_SEQDECODE_H
+#define HAMR_SEQDECODE_H
+
+#include <stdint.h>
+
+// unpack the first n 4-bit bases of seq (as packed in BAM records) into
+// characters: A C G T N, and X for any other code
+void decode_bases(const uint8_t *seq, int n, char *out);
+
+// out[i] = 1 if the base passes the quality filter (min_q <= qual[i]),
+// else 0; qualities too high to fit a char once Sanger-encoded (> 94,
+// including 0xff for a missing quality) never pass
+void mask_quals(const uint8_t *qual, int n, int min_q, uint8_t *out);
+
+// the kernels in use: "avx2", "ssse3" or "scalar"
+const char *seq_decode_kernels();
+
+#endif
@@ -0,0 +1,443 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+
+#include "sam.h"
+#include "faidx.h"
+#include "hamr.h"
+#include "simulate.h"
+#include "metrics.h"
+
+using namespace std;
+
+// length of a hotspot locus (about that of a tRNA) and its modified
+// positions, counted from its 5' end (m1G9, position 37 and m1A58)
+const int HOTSPOT_LENGTH = 76;
+const int HOTSPOT_MODS[] = { 9, 37, 58 };
+const int NUM_HOTSPOT_MODS = 3;
+
+// splitmix64, so that a seed gives the same data on every platform
+class SimRandom {
+  uint64_t state;
+
+public:
+  SimRandom(uint64_t seed) : state(seed) { }
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+  // uniform in [0, 1)
+  double uniform() { return double(next() >> 11) / 9007199254740992.0; }
+  // uniform in [0, n)
+  int below(int n) { return int(next() % (uint64_t)n); }
+};
+
+struct Hotspot {
+  int chr;
+  int pos;
+  bool rev;
+};
+
+// a read before its bases are drawn
+struct SimRead {
+  int pos;
+  int len;
+  int hotspot;  // -1 for reads from uniform coverage
+  bool rev;
+
+  bool operator < (const SimRead &other) const {
+    if (pos != other.pos)
+      return pos < other.pos;
+    if (len != other.len)
+      return len < other.len;
+    if (hotspot != other.hotspot)
+      return hotspot < other.hotspot;
+    return rev < other.rev;
+  }
+};
+
+static const char BASES[] = "ACGT";
+
+static char other_base(char b, SimRandom &rng) {
+  char c;
+  do {
+    c = BASES[rng.below(4)];
+  } while (c == b);
+  return c;
+}
+
+static uint8_t base_code(char b) {
+  switch (b) {
+  case 'A': return 1;
+  case 'C': return 2;
+  case 'G': return 4;
+  case 'T': return 8;
+  default: return 15;
+  }
+}
+
+bool parse_simulate_option(const string &key, const string &value,
+			   SimulateOptions &opts, bool &invalid) {
+  bool conv_success = false;
+  invalid = false;
+
+  if (key == "--seed") {
+    opts.seed = from_s<unsigned long>(value, conv_success);
+  } else if (key == "--chromosomes") {
+    opts.chromosomes = from_s<int>(value, conv_success);
+    conv_success = conv_success && opts.chromosomes > 0;
+  } else if (key == "--chr-length") {
+    opts.chr_length = from_s<int>(value, conv_success);
+    conv_success = conv_success && opts.chr_length > 2*HOTSPOT_LENGTH;
+  } else if (key == "--depth") {
+    opts.depth = from_s<double>(value, conv_success);
+    conv_success = conv_success && opts.depth >= 0;
+  } else if (key == "--read-length") {
+    opts.read_length = from_s<int>(value, conv_success);
+    conv_success = conv_success && opts.read_length >= 20;
+  } else if (key == "--soft-clip-rate") {
+    opts.soft_clip_rate = from_s<double>(value, conv_success);
+    conv_success = conv_success && opts.soft_clip_rate >= 0 &&
+      opts.soft_clip_rate <= 1;
+  } else if (key == "--mismatch-rate") {
+    opts.mismatch_rate = from_s<double>(value, conv_success);
+    conv_success = conv_success && opts.mismatch_rate >= 0 &&
+      opts.mismatch_rate <= 1;
+  } else if (key == "--hotspots") {
+    opts.hotspots = from_s<int>(value, conv_success);
+    conv_success = conv_success && opts.hotspots >= 0;
+  } else if (key == "--hotspot-reads") {
+    opts.hotspot_reads = from_s<int>(value, conv_success);
+    conv_success = conv_success && opts.hotspot_reads >= 0;
+  } else if (key == "--mod-fraction") {
+    opts.mod_fraction = from_s<double>(value, conv_success);
+    conv_success = conv_success && opts.mod_fraction >= 0 &&
+      opts.mod_fraction <= 1;
+  } else {
+    return false;
+  }
+
+  if (!conv_success) {
+    cerr << "Invalid value for " << key << ": " << value << "\n";
+    invalid = true;
+  }
+  return true;
+}
+
+void print_simulate_options() {
+  cerr   << "      --seed=N               Random seed (1)\n"
+	 << "      --chromosomes=N        Number of chromosomes (4)\n"
+	 << "      --chr-length=N         Length of each chromosome (1000000)\n"
+	 << "      --depth=X              Mean coverage from uniform reads (20)\n"
+	 << "      --read-length=N        Read length (100)\n"
+	 << "      --soft-clip-rate=F     Chance of a soft clip at each read end (0.1)\n"
+	 << "      --mismatch-rate=F      Sequencing errors per base (0.005)\n"
+	 << "      --hotspots=N           Deep tRNA-like loci in the genome (40)\n"
+	 << "      --hotspot-reads=N      Reads covering each hotspot (5000)\n"
+	 << "      --mod-fraction=F       Fraction of hotspot reads showing a\n"
+	 << "                               mismatch at modified positions (0.3)\n";
+}
+
+// fill in a BAM record for one read
+static void make_record(bam1_t *b, int tid, const SimRead &r,
+			const string &name, const vector<uint32_t> &cigar,
+			const string &seq, const string &qual) {
+  int ref_len = 0;
+  for (size_t k=0; k < cigar.size(); ++k)
+    if (bam_cigar_op(cigar[k]) == BAM_CMATCH)
+      ref_len += bam_cigar_oplen(cigar[k]);
+
+  bam1_core_t &c = b->core;
+  c.tid = tid;
+  c.pos = r.pos;
+  c.bin = bam_reg2bin(r.pos, r.pos + ref_len);
+  c.qual = 60;
+  c.l_qname = name.size() + 1;
+  c.flag = r.rev ? BAM_FREVERSE : 0;
+  c.n_cigar = cigar.size();
+  c.l_qseq = seq.size();
+  c.mtid = -1;
+  c.mpos = -1;
+  c.isize = 0;
+
+  b->l_aux = 0;
+  b->data_len = c.l_qname + 4*c.n_cigar + (c.l_qseq + 1)/2 + c.l_qseq;
+  if (b->m_data < b->data_len) {
+    b->m_data = b->data_len;
+    b->data = (uint8_t *)realloc(b->data, b->m_data);
+  }
+
+  memcpy(bam1_qname(b), name.c_str(), c.l_qname);
+  memcpy(bam1_cigar(b), &cigar[0], 4*c.n_cigar);
+  uint8_t *s = bam1_seq(b);
+  memset(s, 0, (c.l_qseq + 1)/2);
+  for (int i=0; i < c.l_qseq; ++i)
+    s[i/2] |= base_code(seq[i]) << (4*(1 - i%2));
+  uint8_t *q = bam1_qual(b);
+  for (int i=0; i < c.l_qseq; ++i)
+    q[i] = qual[i] - 33;
+}
+
+int simulate(const SimulateOptions &opts, const string &prefix,
+	     unsigned long &n_reads) {
+  if (opts.read_length >= opts.chr_length) {
+    cerr << "ERROR: --read-length must be less than --chr-length\n";
+    return 1;
+  }
+
+  SimRandom rng(opts.seed);
+  n_reads = 0;
+
+  // genome
+  vector<string> genome(opts.chromosomes);
+  vector<string> names(opts.chromosomes);
+  string fas_fn = prefix + ".fa";
+  ofstream fas(fas_fn.c_str());
+  if (!fas.is_open()) {
+    cerr << "ERROR: Could not open " << fas_fn << "\n";
+    return 1;
+  }
+  for (int c=0; c < opts.chromosomes; ++c) {
+    ostringstream name;
+    name << "chr" << (c+1);
+    names[c] = name.str();
+    genome[c].resize(opts.chr_length);
+    for (int i=0; i < opts.chr_length; ++i)
+      genome[c][i] = BASES[rng.below(4)];
+
+    fas << ">" << names[c] << "\n";
+    for (int i=0; i < opts.chr_length; i += 60)
+      fas << genome[c].substr(i, 60) << "\n";
+  }
+  fas.close();
+  if (!fas) {
+    cerr << "ERROR: Could not write " << fas_fn << "\n";
+    return 1;
+  }
+  fai_build(fas_fn.c_str());
+
+  // hotspots, and the modified sites in them
+  vector<Hotspot> hotspots(opts.hotspots);
+  string mods_fn = prefix + ".mods.bed";
+  ofstream mods(mods_fn.c_str());
+  for (int h=0; h < opts.hotspots; ++h) {
+    hotspots[h].chr = h % opts.chromosomes;
+    hotspots[h].pos = rng.below(opts.chr_length - HOTSPOT_LENGTH);
+    hotspots[h].rev = rng.below(2);
+    for (int k=0; k < NUM_HOTSPOT_MODS; ++k) {
+      int p = hotspots[h].rev ?
+	hotspots[h].pos + HOTSPOT_LENGTH - 1 - HOTSPOT_MODS[k] :
+	hotspots[h].pos + HOTSPOT_MODS[k];
+      mods << names[hotspots[h].chr] << "\t" << p << "\t" << p+1 << "\t"
+	   << "hotspot" << h << "\t0\t" << (hotspots[h].rev ? '-' : '+')
+	   << "\n";
+    }
+  }
+  mods.close();
+
+  // BAM header
+  string bam_fn = prefix + ".bam";
+  bamFile bam = bam_open(bam_fn.c_str(), "w");
+  if (bam == NULL) {
+    cerr << "ERROR: Could not open " << bam_fn << "\n";
+    return 1;
+  }
+  bam_header_t *hdr = bam_header_init();
+  hdr->n_targets = opts.chromosomes;
+  hdr->target_name = (char **)malloc(sizeof(char *) * opts.chromosomes);
+  hdr->target_len = (uint32_t *)malloc(sizeof(uint32_t) * opts.chromosomes);
+  string text;
+  for (int c=0; c < opts.chromosomes; ++c) {
+    hdr->target_name[c] = strdup(names[c].c_str());
+    hdr->target_len[c] = opts.chr_length;
+    ostringstream line;
+    line << "@SQ\tSN:" << names[c] << "\tLN:" << opts.chr_length << "\n";
+    text += line.str();
+  }
+  hdr->l_text = text.size();
+  hdr->text = strdup(text.c_str());
+  bam_header_write(bam, hdr);
+
+  // reads, a chromosome at a time in coordinate order
+  bam1_t *b = bam_init1();
+  vector<uint32_t> cigar;
+  string seq, qual;
+  char name[32];
+  long uniform_reads = long(opts.depth * opts.chr_length / opts.read_length);
+  for (int c=0; c < opts.chromosomes; ++c) {
+    vector<SimRead> reads;
+    reads.reserve(uniform_reads);
+    for (long i=0; i < uniform_reads; ++i) {
+      SimRead r;
+      r.pos = rng.below(opts.chr_length - opts.read_length);
+      r.len = opts.read_length;
+      r.hotspot = -1;
+      r.rev = rng.below(2);
+      reads.push_back(r);
+    }
+    for (int h=0; h < opts.hotspots; ++h) {
+      if (hotspots[h].chr != c)
+	continue;
+      // reads start and end within a few bases of the locus' ends
+      for (int i=0; i < opts.hotspot_reads; ++i) {
+	SimRead r;
+	int trim5 = rng.below(4);
+	int trim3 = rng.below(9);
+	r.pos = hotspots[h].pos + (hotspots[h].rev ? trim3 : trim5);
+	r.len = HOTSPOT_LENGTH - trim5 - trim3;
+	r.hotspot = h;
+	r.rev = hotspots[h].rev;
+	reads.push_back(r);
+      }
+    }
+    sort(reads.begin(), reads.end());
+
+    const string &ref = genome[c];
+    for (size_t i=0; i < reads.size(); ++i) {
+      const SimRead &r = reads[i];
+      int clip5 = (rng.uniform() < opts.soft_clip_rate) ? 1 + rng.below(5) : 0;
+      int clip3 = (rng.uniform() < opts.soft_clip_rate) ? 1 + rng.below(5) : 0;
+      int aligned = r.len - clip5 - clip3;
+
+      cigar.clear();
+      seq.clear();
+      qual.clear();
+      if (clip5 > 0) {
+	cigar.push_back(bam_cigar_gen(clip5, BAM_CSOFT_CLIP));
+	for (int k=0; k < clip5; ++k)
+	  seq += BASES[rng.below(4)];
+      }
+      cigar.push_back(bam_cigar_gen(aligned, BAM_CMATCH));
+      for (int k=0; k < aligned; ++k) {
+	int g = r.pos + k;
+	char base = ref[g];
+	bool modified = false;
+	if (r.hotspot >= 0) {
+	  const Hotspot &hs = hotspots[r.hotspot];
+	  int off = hs.rev ? hs.pos + HOTSPOT_LENGTH - 1 - g : g - hs.pos;
+	  for (int m=0; m < NUM_HOTSPOT_MODS; ++m)
+	    modified = modified || (off == HOTSPOT_MODS[m]);
+	}
+	if ((modified && rng.uniform() < opts.mod_fraction) ||
+	    rng.uniform() < opts.mismatch_rate)
+	  base = other_base(base, rng);
+	seq += base;
+      }
+      if (clip3 > 0) {
+	cigar.push_back(bam_cigar_gen(clip3, BAM_CSOFT_CLIP));
+	for (int k=0; k < clip3; ++k)
+	  seq += BASES[rng.below(4)];
+      }
+      // mostly good qualities, with a few bad bases
+      for (size_t k=0; k < seq.size(); ++k)
+	qual += char(33 + ((rng.uniform() < 0.05) ? 2 + rng.below(12) :
+			   25 + rng.below(16)));
+
+      snprintf(name, sizeof(name), "sim%lu", n_reads);
+      make_record(b, c, r, name, cigar, seq, qual);
+      if (bam_write1(bam, b) < 0) {
+	cerr << "ERROR: Could not write " << bam_fn << "\n";
+	bam_destroy1(b);
+	bam_header_destroy(hdr);
+	bam_close(bam);
+	return 1;
+      }
+      ++n_reads;
+    }
+  }
+  bam_destroy1(b);
+  bam_header_destroy(hdr);
+  bam_close(bam);
+
+  if (bam_index_build(bam_fn.c_str()) != 0) {
+    cerr << "ERROR: Could not index " << bam_fn << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+static void print_simulate_usage(const vector<string> &args,
+				 bool options_only=false) {
+  if (!options_only) {
+    cerr << "USAGE: " << args[0] << " [OPTIONS] out_prefix\n"
+	 << "    writes out_prefix.fa, out_prefix.bam (sorted and indexed)\n"
+	 << "    and the modified sites in out_prefix.mods.bed\n\n"
+	 << "    OPTIONS:\n";
+  }
+  print_simulate_options();
+  if (!options_only)
+    print_metrics_options();
+}
+
+int simulate_main(const vector<string> &args) {
+  arg_collection value_args;
+  vector<string> positional_args;
+
+  parse_arguments(args, value_args, positional_args);
+
+  SimulateOptions opts;
+  MetricsOptions metrics_opts;
+  RunMetrics metrics("simulate");
+  for (arg_collection::iterator it = value_args.begin();
+       it != value_args.end(); ++it) {
+    bool invalid = false;
+
+    if (parse_simulate_option(it->first, it->second, opts, invalid) ||
+	parse_metrics_option(it->first, it->second, metrics_opts, invalid)) {
+      if (invalid)
+	return(1);
+
+    } else if (it->first == "--list-options") {
+      print_simulate_usage(args, true);
+      return(0);
+    }
+  }
+
+  if (positional_args.size() < 2) {
+    print_simulate_usage(args);
+    return(1);
+  }
+
+  unsigned long n_reads;
+  if (simulate(opts, positional_args[1], n_reads) != 0)
+    return(1);
+  cerr << "Simulated " << n_reads << " reads on " << opts.chromosomes
+       << " chromosomes of " << opts.chr_length << " bp\n";
+
+  metrics.set("output", "reads", n_reads);
+  metrics.set("output", "bases",
+	      (unsigned long)opts.chromosomes * opts.chr_length);
+  if (!metrics.write_json(metrics_opts.json_fn))
+    return(1);
+  return(0);
+}
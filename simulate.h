@@ -0,0 +1,71 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  simulate
+// Synthetic data for benchmarking: a random genome and a sorted,
+// indexed BAM file of reads from it. Reads come from uniform coverage
+// plus deep "tRNA-like" hotspots: short loci covered end to end by
+// thousands of reads on one strand, each with a few modified positions
+// where a fraction of the reads show a mismatch. Everything is drawn
+// from a seeded generator, so a seed always gives the same files.
+
+#ifndef HAMR_SIMULATE_H
+#define HAMR_SIMULATE_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct SimulateOptions {
+  unsigned long seed;
+  int chromosomes;
+  int chr_length;
+  // mean coverage of the uniform reads
+  double depth;
+  int read_length;
+  // chance of a soft clip at each end of a read
+  double soft_clip_rate;
+  // sequencing errors per base
+  double mismatch_rate;
+  // number of hotspots in the genome, reads covering each, and the
+  // fraction of reads showing a mismatch at their modified positions
+  int hotspots;
+  int hotspot_reads;
+  double mod_fraction;
+
+  SimulateOptions() : seed(1), chromosomes(4), chr_length(1000000),
+		      depth(20), read_length(100), soft_clip_rate(0.1),
+		      mismatch_rate(0.005), hotspots(40), hotspot_reads(5000),
+		      mod_fraction(0.3) { }
+};
+
+// handles --seed, --depth etc.; returns false if key is not a simulate
+// option. invalid is set (and a message printed) on bad values
+bool parse_simulate_option(const string &key, const string &value,
+			   SimulateOptions &opts, bool &invalid);
+void print_simulate_options();
+
+// write prefix.fa and prefix.bam (with its index); n_reads is set to the
+// number of reads written. Returns nonzero on error
+int simulate(const SimulateOptions &opts, const string &prefix,
+	     unsigned long &n_reads);
+
+#endif
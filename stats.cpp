@@ -0,0 +1,809 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "hamr.h"
+#include "stats.h"
+#include "pileup.h"
+#include "output.h"
+#include "extsort.h"
+
+using namespace std;
+
+void print_stats_options() {
+  cerr << "      --hypothesis=H1|H4     H1: loose, allow SNP/edit-like\n"
+       << "                               H4: strict, only mod-like (default)\n"
+       << "      --max-p=P              Use unadj. p-value cutoff P (1.0)\n"
+       << "      --max-q=Q              Use FDR-controlled cutoff Q (0.05)\n"
+       << "      --seq-error-rate       Assumed rate of seq. errors (0.01)\n"
+       << "      --max-memory=MB        Keep tested sites in memory up to about MB\n"
+       << "                               megabytes, then spill them to disk for\n"
+       << "                               the FDR adjustment (1024)\n"
+       << "      --temp-dir=DIR         Directory for spilled sites ($TMPDIR or /tmp)\n";
+}
+
+bool parse_stats_option(const string &key, const string &value,
+			StatsOptions &opts, bool &invalid) {
+  bool conv_success = false;
+  invalid = false;
+
+  if (key == "--hypothesis") {
+    opts.hypothesis = value;
+    if (value != "H1" && value != "H4") {
+      cerr << "ERROR: invalid null hypothesis (" << value
+	   << "): must be H1 or H4\n";
+      invalid = true;
+    }
+
+  } else if (key == "--max-p") {
+    opts.max_p = from_s<double>(value, conv_success);
+    if (!conv_success || opts.max_p < 0 || opts.max_p > 1) {
+      cerr << "ERROR: invalid p-value threshold (" << value
+	   << "): must be real number in [0,1]\n";
+      invalid = true;
+    }
+
+  } else if (key == "--max-q") {
+    opts.max_q = from_s<double>(value, conv_success);
+    if (!conv_success || opts.max_q < 0 || opts.max_q > 1) {
+      cerr << "ERROR: invalid FDR threshold (" << value
+	   << "): must be real number in [0,1]\n";
+      invalid = true;
+    }
+
+  } else if (key == "--seq-error-rate") {
+    opts.seq_err = from_s<double>(value, conv_success);
+    if (!conv_success || opts.seq_err < 0 || opts.seq_err > 1) {
+      cerr << "ERROR: invalid sequencing err. rate (" << value
+	   << "): must be real number in [0,1]\n";
+      invalid = true;
+    }
+
+  } else if (key == "--max-memory") {
+    opts.max_memory_mb = from_s<unsigned long>(value, conv_success);
+    if (!conv_success || opts.max_memory_mb < 1) {
+      cerr << "ERROR: invalid memory limit (" << value
+	   << "): must be a number of megabytes >= 1\n";
+      invalid = true;
+    }
+
+  } else if (key == "--temp-dir") {
+    opts.temp_dir = value;
+
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void print_stats_settings(const StatsOptions &opts) {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+	   "  Using null hypothesis %s\n"
+	   "  Assuming sequencing error rate is %f\n"
+	   "  Using p-value threshold %f\n"
+	   "  Using FDR adj. p-value threshold %f\n",
+	   opts.hypothesis.c_str(), opts.seq_err, opts.max_p, opts.max_q);
+  cerr << buf;
+}
+
+/////////////////////
+// Binomial distribution
+//   Terms are evaluated with Loader's saddle point expansion (as in R's
+//   dbinom) and summed in long double, starting at the tail boundary
+//   and walking away from the mode until the terms no longer matter.
+
+static const long double LN_2PI = 1.837877066409345483560659472811235L;
+static const long double LN_SQRT_2PI = 0.918938533204672741780329736405618L;
+
+// log(n!) - log(sqrt(2*pi*n)*(n/e)^n)
+static long double stirlerr(long double n) {
+  const long double S0 = 1.0L/12.0L;
+  const long double S1 = 1.0L/360.0L;
+  const long double S2 = 1.0L/1260.0L;
+  const long double S3 = 1.0L/1680.0L;
+  const long double S4 = 1.0L/1188.0L;
+
+  if (n <= 15.0L) {
+    if (n == 0)
+      return 0;
+    return lgammal(n + 1.0L) - (n + 0.5L)*logl(n) + n - LN_SQRT_2PI;
+  }
+
+  long double nn = n*n;
+  if (n > 500) return ((S0-S1/nn)/n);
+  if (n > 80) return ((S0-(S1-S2/nn)/nn)/n);
+  if (n > 35) return ((S0-(S1-(S2-S3/nn)/nn)/nn)/n);
+  return ((S0-(S1-(S2-(S3-S4/nn)/nn)/nn)/nn)/n);
+}
+
+// deviance term x*log(x/np) + np - x, stable when x is close to np
+static long double bd0(long double x, long double np) {
+  if (fabsl(x-np) < 0.1L*(x+np)) {
+    long double v = (x-np)/(x+np);
+    long double s = (x-np)*v;
+    long double ej = 2*x*v;
+    v = v*v;
+    for (int j=1; j < 1000; ++j) {
+      ej *= v;
+      long double s1 = s + ej/((j<<1)+1);
+      if (s1 == s)
+	return s1;
+      s = s1;
+    }
+  }
+  return (x*logl(x/np) + np - x);
+}
+
+// P(X == x) for X ~ Binomial(n, p)
+static long double dbinom_raw(int x, int n, long double p, long double q) {
+  if (p == 0) return (x == 0) ? 1 : 0;
+  if (q == 0) return (x == n) ? 1 : 0;
+  if (x == 0) {
+    if (n == 0) return 1;
+    return expl((p < 0.1L) ? -bd0(n, n*q) - n*p : n*logl(q));
+  }
+  if (x == n)
+    return expl((q < 0.1L) ? -bd0(n, n*p) - n*q : n*logl(p));
+  if (x < 0 || x > n)
+    return 0;
+
+  long double lc = stirlerr(n) - stirlerr(x) - stirlerr(n-x)
+    - bd0(x, n*p) - bd0(n-x, n*q);
+  long double lf = LN_2PI + logl((long double)x) + log1pl(-(long double)x/n);
+  return expl(lc - 0.5L*lf);
+}
+
+// sum of P(X == j) for j = from, from+step, ... through stop, or until
+// the terms vanish once we're walking downhill from the mode
+static long double binom_sum(int from, int stop, int step, int n,
+			     long double p, long double q) {
+  const int mode = int(floorl((n + 1) * p));
+  long double term = dbinom_raw(from, n, p, q);
+  long double sum = 0;
+  for (int j=from; j != stop + step; j += step) {
+    sum += term;
+    if (((step < 0) ? (j <= mode) : (j >= mode)) &&
+	term <= sum * 1e-25L)
+      break;
+    // P(j+1)/P(j) = (n-j)/(j+1) * p/q
+    if (step > 0)
+      term *= ((long double)(n - j) / (j + 1)) * (p / q);
+    else
+      term *= ((long double)j / (n - j + 1)) * (q / p);
+  }
+  return sum;
+}
+
+double pbinom(int k, int n, double p) {
+  double result;
+  pbinom_many(&k, 1, n, p, &result);
+  return result;
+}
+
+struct ThresholdLess {
+  const int *k;
+  ThresholdLess(const int *k) : k(k) { }
+  bool operator() (int a, int b) const { return k[a] < k[b]; }
+};
+
+void pbinom_many(const int *k, int m, int n, double p, double *out) {
+  long double lp = p;
+  long double lq = 1.0L - lp;
+
+  // order the thresholds so that each tail extends the previous one
+  int order[16];
+  vector<int> order_big;
+  int *o = order;
+  if (m > 16) {
+    order_big.resize(m);
+    o = &order_big[0];
+  }
+  for (int i=0; i < m; ++i)
+    o[i] = i;
+  sort(o, o + m, ThresholdLess(k));
+
+  // lower tails P(X <= k) for k below the mean, smallest k first:
+  // each adds the terms in (previous k, k]
+  int i = 0;
+  long double cum = 0;
+  int prev = -1;
+  for (; i < m && k[o[i]] < n*lp; ++i) {
+    int ki = k[o[i]];
+    if (ki < 0) {
+      out[o[i]] = 0;
+      continue;
+    }
+    if (p <= 0 || p >= 1) {
+      out[o[i]] = (p <= 0) ? 1 : 0;
+      continue;
+    }
+    if (ki != prev) {
+      cum += binom_sum(ki, prev + 1, -1, n, lp, lq);
+      prev = ki;
+    }
+    out[o[i]] = double(cum);
+  }
+
+  // the rest are 1 - P(X > k), largest k first:
+  // each adds the terms in (k, previous k]
+  cum = 0;
+  prev = n;
+  for (int j=m-1; j >= i; --j) {
+    int kj = k[o[j]];
+    if (kj >= n || p <= 0) {
+      out[o[j]] = 1;
+      continue;
+    }
+    if (p >= 1) {
+      out[o[j]] = 0;
+      continue;
+    }
+    if (kj != prev) {
+      cum += binom_sum(kj + 1, prev, 1, n, lp, lq);
+      prev = kj;
+    }
+    out[o[j]] = double(1.0L - cum);
+  }
+}
+
+/////////////////////
+
+static char complement_base(char b) {
+  switch(b) {
+  case 'A': return 'T';
+  case 'C': return 'G';
+  case 'G': return 'C';
+  case 'T': return 'A';
+  }
+  return 'N';
+}
+
+bool site_nuc_freq_row(const SiteCounts &site, char strand, NucFreqRow &row) {
+  // + strand: upper case mismatches, '.' matches; - strand: lower case
+  // mismatches, ',' matches, with the bases complemented
+  int nmatch, a, c, g, t, n;
+  if (strand == '+') {
+    row.refnuc = site.ref;
+    nmatch = site.count('.');
+    a = site.count('A');
+    c = site.count('C');
+    g = site.count('G');
+    t = site.count('T');
+    n = site.count('N');
+  } else {
+    row.refnuc = complement_base(site.ref);
+    nmatch = site.count(',');
+    a = site.count('t');
+    c = site.count('g');
+    g = site.count('c');
+    t = site.count('a');
+    n = site.count('n');
+  }
+
+  row.bp = site.pos;
+  row.strand = strand;
+  row.counts[0] = a + ((row.refnuc == 'A') ? nmatch : 0);
+  row.counts[1] = c + ((row.refnuc == 'C') ? nmatch : 0);
+  row.counts[2] = g + ((row.refnuc == 'G') ? nmatch : 0);
+  row.counts[3] = t + ((row.refnuc == 'T') ? nmatch : 0);
+  row.nonref = a + c + g + t + n;
+  return row.nonref > 0;
+}
+
+// parse the next tab-delimited integer field starting at p
+static bool parse_int_field(const char *&p, int &value) {
+  char *end;
+  value = strtol(p, &end, 10);
+  if (end == p || (*end != '\t' && *end != '\0'))
+    return false;
+  p = (*end == '\t') ? end + 1 : end;
+  return true;
+}
+
+bool parse_nuc_freq_line(const string &line, string &chr,
+			 NucFreqRow &row) {
+  size_t tab = line.find('\t');
+  if (tab == string::npos)
+    return false;
+  chr.assign(line, 0, tab);
+
+  const char *p = line.c_str() + tab + 1;
+  if (!parse_int_field(p, row.bp))
+    return false;
+
+  // strand and refnuc are single characters
+  if (p[0] == '\0' || p[1] != '\t')
+    return false;
+  row.strand = p[0];
+  p += 2;
+  if (p[0] == '\0' || p[1] != '\t')
+    return false;
+  row.refnuc = p[0];
+  p += 2;
+
+  for (int i=0; i < 4; ++i)
+    if (!parse_int_field(p, row.counts[i]))
+      return false;
+  if (!parse_int_field(p, row.nonref))
+    return false;
+
+  return (*p == '\0');
+}
+
+void write_nuc_freq_row(OutputBuffer &out, const string &chr,
+			const NucFreqRow &row) {
+  out.put(chr);
+  out.put('\t');
+  out.put_int(row.bp);
+  out.put('\t');
+  out.put(row.strand);
+  out.put('\t');
+  out.put(row.refnuc);
+  for (int i=0; i < 4; ++i) {
+    out.put('\t');
+    out.put_int(row.counts[i]);
+  }
+  out.put('\t');
+  out.put_int(row.nonref);
+  out.put('\n');
+}
+
+static int nuc_index(char c) {
+  switch(c) {
+  case 'A': return 0;
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  }
+  return -1;
+}
+
+SiteTest test_site(const NucFreqRow &row, double seq_err) {
+  const double p = 1 - seq_err;
+  const int n = row.counts[0] + row.counts[1] + row.counts[2] + row.counts[3];
+  const int ref = nuc_index(row.refnuc);
+
+  // compute p-value for each possible genotype (AA, AC, ..., TT):
+  // the chance of seeing at most this many reads from the genotype's
+  // nucleotides if everything else were a sequencing error
+  int correct[10];
+  double hyp_p[10];
+  int ref_hyp = -1;
+  int h = 0;
+  for (int a=0; a < 4; ++a) {
+    for (int b=a; b < 4; ++b, ++h) {
+      correct[h] = row.counts[a] + ((b != a) ? row.counts[b] : 0);
+      if (a == ref && b == ref)
+	ref_hyp = h;
+    }
+  }
+  pbinom_many(correct, 10, n, p, hyp_p);
+
+  SiteTest t;
+  // H0_1: null hypothesis is: genotype = homozygous reference
+  t.h1_p = (ref_hyp >= 0) ? hyp_p[ref_hyp] : NAN;
+  // H0_4: null hypothesis is: genotype = any one or two alelle(s)
+  t.h4_p = *max_element(hyp_p, hyp_p + 10);
+  return t;
+}
+
+struct PValueGreater {
+  const vector<double> &p;
+  PValueGreater(const vector<double> &p) : p(p) { }
+  bool operator() (size_t a, size_t b) const { return p[a] > p[b]; }
+};
+
+void bh_adjust(vector<double> &p) {
+  vector<size_t> o;
+  for (size_t i=0; i < p.size(); ++i)
+    if (!std::isnan(p[i]))
+      o.push_back(i);
+
+  const size_t n = o.size();
+  if (n <= 1)
+    return;
+
+  // walk from largest to smallest p-value: padj = min over ranks >= i
+  // of n/rank * p
+  stable_sort(o.begin(), o.end(), PValueGreater(p));
+  double cummin = 1;
+  for (size_t k=0; k < n; ++k)
+    p[o[k]] = bh_adjust_next(p[o[k]], k, n, cummin);
+}
+
+double bh_adjust_next(double p, unsigned long long k, unsigned long long n,
+		      double &cummin) {
+  if (n <= 1)
+    return p;
+  double adj = double(n) / double(n - k) * p;
+  if (adj < cummin)
+    cummin = adj;
+  return cummin;
+}
+
+/////////////////////
+// R number formatting
+//   write.table prints each value with up to 15 significant digits,
+//   using whichever of fixed or scientific notation is narrower.
+//   This follows scientific() and formatReal() in R's format.c.
+
+static const int R_DIGITS = 15;
+static const int KP_MAX = 27;
+
+static long double pow10l_int(int k) {
+  long double r = 1;
+  for (int i=0; i < k; ++i)
+    r *= 10;
+  return r;
+}
+
+static void r_scientific(double x, int &neg, int &kpower, int &nsig,
+			 bool &roundingwidens) {
+  if (x == 0.0) {
+    kpower = 0;
+    nsig = 1;
+    neg = 0;
+    roundingwidens = false;
+    return;
+  }
+
+  double r;
+  if (x < 0.0) {
+    neg = 1;
+    r = -x;
+  } else {
+    neg = 0;
+    r = x;
+  }
+
+  int kp = int(floor(log10(r))) - R_DIGITS + 1;
+  long double r_prec = r;
+  if (abs(kp) < 10) {
+    if (kp > 0)
+      r_prec /= pow10l_int(kp);
+    else if (kp < 0)
+      r_prec *= pow10l_int(-kp);
+  } else {
+    r_prec /= powl(10.0L, (long double)kp);
+  }
+  if (r_prec < pow10l_int(R_DIGITS - 1)) {
+    r_prec *= 10.0L;
+    --kp;
+  }
+
+  // round to R_DIGITS significant digits, then drop trailing zeros
+  double alpha = (double)nearbyintl(r_prec);
+  nsig = R_DIGITS;
+  for (int j=1; j <= R_DIGITS; ++j) {
+    alpha /= 10.0;
+    if (alpha == floor(alpha))
+      --nsig;
+    else
+      break;
+  }
+  if (nsig == 0) {
+    nsig = 1;
+    kp += 1;
+  }
+  kpower = kp + R_DIGITS - 1;
+
+  // does rounding to R_DIGITS turn e.g. 99.99.. into 100?
+  int rgt = R_DIGITS - kpower;
+  rgt = (rgt < 0) ? 0 : ((rgt > KP_MAX) ? KP_MAX : rgt);
+  double fuzz = 0.5 / (double)pow10l_int(rgt);
+  roundingwidens = (kpower > 0) && (kpower <= KP_MAX) &&
+    (r < pow10l_int(kpower) - fuzz);
+}
+
+void write_r_real(ostream &out, double x) {
+  if (std::isnan(x)) {
+    out << "NA";
+    return;
+  }
+  if (std::isinf(x)) {
+    out << ((x > 0) ? "Inf" : "-Inf");
+    return;
+  }
+
+  int neg, kpower, nsig;
+  bool roundingwidens;
+  r_scientific(x, neg, kpower, nsig, roundingwidens);
+
+  int left = kpower + 1;
+  if (roundingwidens)
+    --left;
+  int sleft = neg + ((left <= 0) ? 1 : left);
+  int rgt = nsig - left;
+  if (rgt < 0)
+    rgt = 0;
+
+  // width in fixed notation vs. scientific notation
+  int wF = sleft + rgt + (rgt != 0);
+  int e = (kpower >= 100 || kpower <= -99) ? 2 : 1;
+  int d = nsig - 1;
+  int w = neg + (d > 0) + d + 4 + e;
+
+  char buf[512];
+  if (wF <= w)
+    snprintf(buf, sizeof(buf), "%.*f", rgt, x);
+  else
+    snprintf(buf, sizeof(buf), (d > 0) ? "%#.*e" : "%.*e", d, x);
+  out << buf;
+}
+
+/////////////////////
+
+void write_mods_header(ostream &out) {
+  out << "chr\tbp\tstrand\trefnuc\tA\tC\tG\tT\tnonref\tref\t"
+      << "h1.p\th1.padj\th4.p\th4.padj\tsig\n";
+}
+
+void write_mods_row(ostream &out, const string &chr, const NucFreqRow &row,
+		    const SiteTest &t, double h1_padj, double h4_padj,
+		    const StatsOptions &opts) {
+  // count reference nucleotide observations at each site
+  int ref = row.counts[0] + row.counts[1] + row.counts[2] + row.counts[3]
+    - row.nonref;
+
+  out << chr << "\t" << row.bp << "\t" << row.strand << "\t"
+      << row.refnuc;
+  for (int i=0; i < 4; ++i)
+    out << "\t" << row.counts[i];
+  out << "\t" << row.nonref << "\t";
+  write_r_real(out, ref);
+  out << "\t";
+  write_r_real(out, t.h1_p);
+  out << "\t";
+  write_r_real(out, h1_padj);
+  out << "\t";
+  write_r_real(out, t.h4_p);
+  out << "\t";
+  write_r_real(out, h4_padj);
+
+  // sig = p < max_p & padj < max_q, with R's NA semantics for &
+  double p = (opts.hypothesis == "H1") ? t.h1_p : t.h4_p;
+  double padj = (opts.hypothesis == "H1") ? h1_padj : h4_padj;
+  bool p_na = std::isnan(p), padj_na = std::isnan(padj);
+  const char *sig;
+  if ((!p_na && !(p < opts.max_p)) || (!padj_na && !(padj < opts.max_q)))
+    sig = "FALSE";
+  else if (p_na || padj_na)
+    sig = "NA";
+  else
+    sig = "TRUE";
+  out << "\t" << sig << "\n";
+}
+
+/////////////////////
+
+// with the rows spilled: the rows in order, and the p-values of each
+// hypothesis sorted from largest to smallest along with their row
+// numbers
+struct PValueRec {
+  double p;
+  unsigned long long row;
+};
+struct PValueDescending {
+  bool operator()(const PValueRec &a, const PValueRec &b) const {
+    return a.p > b.p;
+  }
+};
+struct AdjustedRec {
+  unsigned long long row;
+  double padj;
+};
+struct ByRow {
+  bool operator()(const AdjustedRec &a, const AdjustedRec &b) const {
+    return a.row < b.row;
+  }
+};
+typedef ExternalSorter<PValueRec, PValueDescending> PValueSorter;
+typedef ExternalSorter<AdjustedRec, ByRow> AdjustedSorter;
+
+// rows buffered at a time once spilling
+static const size_t SPILL_CHUNK = 4096;
+
+struct ModsTable::Spill {
+  string rows_fn;
+  FILE *rows;
+  PValueSorter h1, h4;
+
+  Spill(size_t max_bytes, const string &temp_dir) :
+    rows(NULL), h1(max_bytes/2, temp_dir), h4(max_bytes/2, temp_dir) { }
+  ~Spill() {
+    if (rows != NULL)
+      fclose(rows);
+    if (!rows_fn.empty())
+      remove(rows_fn.c_str());
+  }
+};
+
+ModsTable::ModsTable() : n_rows(0), max_entries(0), max_bytes(0),
+			 spill(NULL) { }
+
+ModsTable::~ModsTable() { delete spill; }
+
+void ModsTable::limit_memory(unsigned long max_mb, const string &dir) {
+  max_bytes = size_t(max_mb) << 20;
+  // the in-memory adjustment needs another three values per row
+  max_entries = max_bytes / (sizeof(Entry) + 3*sizeof(double));
+  temp_dir = dir;
+}
+
+bool ModsTable::start_spill() {
+  cerr << "  More than " << (max_bytes >> 20) << " MB of tested sites;"
+       << " spilling to " << (temp_dir.empty() ? default_temp_dir() : temp_dir)
+       << "\n";
+  spill = new Spill(max_bytes, temp_dir);
+  spill->rows = create_temp_file(temp_dir, spill->rows_fn);
+  if (spill->rows == NULL || !spill_entries())
+    return false;
+  // from now on rows are only buffered up to SPILL_CHUNK
+  vector<Entry>().swap(entries);
+  return true;
+}
+
+// move entries to the spill files
+bool ModsTable::spill_entries() {
+  unsigned long long row = n_rows - entries.size();
+  for (size_t i=0; i < entries.size(); ++i, ++row) {
+    PValueRec rec;
+    rec.row = row;
+    rec.p = entries[i].test.h1_p;
+    if (!std::isnan(rec.p) && !spill->h1.add(rec))
+      return false;
+    rec.p = entries[i].test.h4_p;
+    if (!std::isnan(rec.p) && !spill->h4.add(rec))
+      return false;
+  }
+  if (!entries.empty() &&
+      fwrite(&entries[0], sizeof(Entry), entries.size(), spill->rows)
+      != entries.size()) {
+    cerr << "ERROR: could not write temporary file " << spill->rows_fn << "\n";
+    return false;
+  }
+  entries.clear();
+  return true;
+}
+
+bool ModsTable::add(const string &chr, const NucFreqRow &row,
+		    const SiteTest &t) {
+  // rows arrive grouped by chromosome
+  if (chrs.empty() || chrs.back() != chr)
+    chrs.push_back(chr);
+
+  Entry e;
+  e.chr = chrs.size() - 1;
+  e.row = row;
+  e.test = t;
+  entries.push_back(e);
+  ++n_rows;
+
+  if (spill != NULL)
+    return entries.size() < SPILL_CHUNK || spill_entries();
+  if (max_entries > 0 && entries.size() > max_entries)
+    return start_spill();
+  return true;
+}
+
+bool ModsTable::append(const ModsTable &other) {
+  for (size_t i=0; i < other.entries.size(); ++i) {
+    const Entry &e = other.entries[i];
+    if (!add(other.chrs[e.chr], e.row, e.test))
+      return false;
+  }
+  return true;
+}
+
+bool ModsTable::write(ostream &out, const StatsOptions &opts) {
+  if (spill != NULL)
+    return write_spilled(out, opts);
+
+  // adjust p-values
+  vector<double> h1_padj(entries.size()), h4_padj(entries.size());
+  for (size_t i=0; i < entries.size(); ++i) {
+    h1_padj[i] = entries[i].test.h1_p;
+    h4_padj[i] = entries[i].test.h4_p;
+  }
+  bh_adjust(h1_padj);
+  bh_adjust(h4_padj);
+
+  write_mods_header(out);
+  for (size_t i=0; i < entries.size(); ++i)
+    write_mods_row(out, chrs[entries[i].chr], entries[i].row,
+		   entries[i].test, h1_padj[i], h4_padj[i], opts);
+  return true;
+}
+
+// adjust the p-values sorted in sorter, giving them back by row number
+static bool bh_adjust_sorted(PValueSorter &sorter, AdjustedSorter &adjusted) {
+  if (!sorter.finish())
+    return false;
+  const unsigned long long n = sorter.size();
+  double cummin = 1;
+  PValueRec p;
+  AdjustedRec a;
+  for (unsigned long long k=0; sorter.next(p); ++k) {
+    a.row = p.row;
+    a.padj = bh_adjust_next(p.p, k, n, cummin);
+    if (!adjusted.add(a))
+      return false;
+  }
+  bool ok = !sorter.failed();
+  sorter.clear();
+  return ok && adjusted.finish();
+}
+
+// the adjusted p-value of row from adjusted, whose next record is in
+// next (row numbers without one had NaN p-values)
+static double next_padj(AdjustedSorter &adjusted, AdjustedRec &next,
+			bool &have_next, unsigned long long row) {
+  if (!have_next || next.row != row)
+    return NAN;
+  double padj = next.padj;
+  have_next = adjusted.next(next);
+  return padj;
+}
+
+bool ModsTable::write_spilled(ostream &out, const StatsOptions &opts) {
+  if (!spill_entries())
+    return false;
+  if (fclose(spill->rows) != 0) {
+    spill->rows = NULL;
+    cerr << "ERROR: could not write temporary file " << spill->rows_fn << "\n";
+    return false;
+  }
+  spill->rows = NULL;
+
+  AdjustedSorter h1_padj(max_bytes/2, temp_dir), h4_padj(max_bytes/2, temp_dir);
+  if (!bh_adjust_sorted(spill->h1, h1_padj) ||
+      !bh_adjust_sorted(spill->h4, h4_padj))
+    return false;
+
+  FILE *rows = fopen(spill->rows_fn.c_str(), "rb");
+  if (rows == NULL) {
+    cerr << "ERROR: could not open temporary file " << spill->rows_fn << "\n";
+    return false;
+  }
+  write_mods_header(out);
+  AdjustedRec h1_next, h4_next;
+  bool have_h1 = h1_padj.next(h1_next), have_h4 = h4_padj.next(h4_next);
+  Entry e;
+  unsigned long long row = 0;
+  for (; fread(&e, sizeof(Entry), 1, rows) == 1; ++row) {
+    double h1 = next_padj(h1_padj, h1_next, have_h1, row);
+    double h4 = next_padj(h4_padj, h4_next, have_h4, row);
+    write_mods_row(out, chrs[e.chr], e.row, e.test, h1, h4, opts);
+  }
+  fclose(rows);
+  if (row != n_rows || h1_padj.failed() || h4_padj.failed()) {
+    cerr << "ERROR: could not read back spilled sites\n";
+    return false;
+  }
+  return true;
+}
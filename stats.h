@@ -0,0 +1,164 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  stats
+// Genotype hypothesis tests from hamr_detect_mods.R:
+//   for each of the 10 genotypes AA..TT, the p-value of seeing this few
+//   reads consistent with it given the sequencing error rate;
+//   H0_1 uses the homozygous reference genotype, H0_4 the best genotype.
+// Values are printed the way R's write.table prints them.
+
+#ifndef HAMR_STATS_H
+#define HAMR_STATS_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+using namespace std;
+
+struct SiteCounts;
+class OutputBuffer;
+
+// one row of the nucleotide frequency table
+// (chr bp strand refnuc A C G T nonref), minus the chr
+struct NucFreqRow {
+  int bp;
+  char strand;
+  char refnuc;
+  int counts[4];    // A, C, G, T
+  int nonref;
+};
+
+struct StatsOptions {
+  // null hypothesis used for significance: "H1" or "H4"
+  string hypothesis;
+  double max_p;
+  double max_q;
+  double seq_err;
+  // tested rows are kept in memory up to about this much, then spilled
+  // to temporary files in temp_dir (empty: $TMPDIR or /tmp)
+  unsigned long max_memory_mb;
+  string temp_dir;
+
+  StatsOptions() : hypothesis("H4"), max_p(1.0), max_q(0.05),
+		   seq_err(0.01), max_memory_mb(1024) { }
+};
+
+// p-values of one row; p-values that can't be computed are NaN (R's NA)
+struct SiteTest {
+  double h1_p;
+  double h4_p;
+};
+
+// handles --hypothesis etc.; returns false if key is not a stats option.
+// invalid is set (and a message printed) on bad values
+bool parse_stats_option(const string &key, const string &value,
+			StatsOptions &opts, bool &invalid);
+void print_stats_options();
+void print_stats_settings(const StatsOptions &opts);
+
+// P(X <= k) for X ~ Binomial(n, p), like R's pbinom
+double pbinom(int k, int n, double p);
+// pbinom for m thresholds k[0..m-1] sharing the same n and p;
+// overlapping parts of the tails are only summed once
+void pbinom_many(const int *k, int m, int n, double p, double *out);
+
+// the row of one strand ('+' or '-') of a pileup site; counts on the -
+// strand are given relative to it (complemented). Returns false if no
+// read mismatches, which leaves the row out of the table
+bool site_nuc_freq_row(const SiteCounts &site, char strand, NucFreqRow &row);
+
+// parse / write one line of the nucleotide frequency table
+// (chr bp strand refnuc A C G T nonref)
+bool parse_nuc_freq_line(const string &line, string &chr, NucFreqRow &row);
+void write_nuc_freq_row(OutputBuffer &out, const string &chr,
+			const NucFreqRow &row);
+
+SiteTest test_site(const NucFreqRow &row, double seq_err);
+
+// Benjamini-Hochberg adjustment in place, like p.adjust(p, method='BH');
+// NaN values are left alone and don't count towards n
+void bh_adjust(vector<double> &p);
+// the same one value at a time, for p-values walked from largest to
+// smallest: the adjusted value of the k-th (from 0) of n, given the
+// running minimum (starting at 1)
+double bh_adjust_next(double p, unsigned long long k, unsigned long long n,
+		      double &cummin);
+
+// write x the way R's write.table does (15 significant digits)
+void write_r_real(ostream &out, double x);
+
+void write_mods_header(ostream &out);
+void write_mods_row(ostream &out, const string &chr, const NucFreqRow &row,
+		    const SiteTest &t, double h1_padj, double h4_padj,
+		    const StatsOptions &opts);
+
+// tested rows held until every p-value is known, so that they can be
+// FDR-adjusted; chromosome names are stored once. Past the memory
+// limit, rows go to a temporary file in order and the p-values are
+// sorted on disk for the adjustment, so that memory use doesn't grow
+// with the number of rows
+class ModsTable {
+  struct Entry {
+    unsigned int chr;
+    NucFreqRow row;
+    SiteTest test;
+  };
+  struct Spill;
+
+  vector<string> chrs;
+  vector<Entry> entries;
+  unsigned long long n_rows;
+
+  // no limit if 0
+  size_t max_entries;
+  size_t max_bytes;
+  string temp_dir;
+  Spill *spill;
+
+  ModsTable(const ModsTable &);
+  ModsTable &operator=(const ModsTable &);
+
+  bool start_spill();
+  bool spill_entries();
+  bool write_spilled(ostream &out, const StatsOptions &opts);
+
+public:
+  ModsTable();
+  ~ModsTable();
+
+  // spill past about max_mb megabytes to temp_dir (see StatsOptions)
+  void limit_memory(unsigned long max_mb, const string &temp_dir);
+
+  // returns false if spilling failed
+  bool add(const string &chr, const NucFreqRow &row, const SiteTest &t);
+  // add all rows of another table (not spilled) after ours
+  bool append(const ModsTable &other);
+  unsigned long long size() const { return n_rows; }
+  bool empty() const { return n_rows == 0; }
+  bool spilled() const { return spill != NULL; }
+
+  // adjust p-values and write the table with its header; returns false
+  // on errors with the temporary files
+  bool write(ostream &out, const StatsOptions &opts);
+};
+
+#endif
@@ -0,0 +1,257 @@
+//  Copyright (c) 2013 University of Pennsylvania
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+////  text pileup formats
+// Parsing lines of the text .rnapileup, and writing sites as mismatch
+// BED lines; shared by the pileup's mismatchbed output,
+// rnapileup2mismatchbed and convert_pileup.
+
+#include <string>
+#include <cstring>
+#include <cctype>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pileup.h"
+#include "output.h"
+
+using namespace std;
+
+// strand and complement of each pileup symbol (by index in
+// PILEUP_SYMBOLS), and complements of reference bases
+class MismatchBedTables {
+public:
+  bool rev_strand[NUM_PILEUP_SYMBOLS];
+  char complement[256];
+  // index of each character in PILEUP_SYMBOLS, -1 for others
+  signed char symbol[256];
+
+  MismatchBedTables() {
+    for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+      char c = PILEUP_SYMBOLS[s];
+      rev_strand[s] = (c == ',' || (c >= 'a' && c <= 'z'));
+    }
+
+    for (int c=0; c < 256; ++c)
+      symbol[c] = pileup_symbol_index(char(c));
+
+    memset(complement, 0, sizeof(char)*256);
+    complement['A'] = complement['a'] = 'T';
+    complement['C'] = complement['c'] = 'G';
+    complement['G'] = complement['g'] = 'C';
+    complement['T'] = complement['t'] = 'A';
+    complement['N'] = complement['n'] = 'N';
+    complement['.'] = complement[','] = '.';
+  }
+};
+
+static const MismatchBedTables tables;
+
+void write_mismatch_bed(OutputBuffer &out, const string &chr,
+			const SiteCounts &site) {
+  unsigned int pos = site.pos + 1;
+
+  for(int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+    unsigned int count = site.counts[s];
+    if (count == 0)
+      continue;
+
+    char strand = '+';
+    char new_ref = site.ref;
+    char nuc = PILEUP_SYMBOLS[s];
+    if (tables.rev_strand[s]) {
+      strand = '-';
+      new_ref = tables.complement[(unsigned char)site.ref];
+      nuc = tables.complement[(unsigned char)nuc];
+    }
+
+    // output BED format, with the read positions as a histogram
+    // of the form x:count,x:count,...
+    out.put(chr);
+    out.put('\t');
+    out.put_uint(pos-1);
+    out.put('\t');
+    out.put_uint(pos);
+    out.put('\t');
+    out.put(new_ref);
+    out.put('>');
+    out.put(nuc);
+    out.put('\t');
+    out.put_uint(count);
+    out.put(';');
+    bool first=true;
+    const unsigned int *readpos_counts = site.readpos[s];
+    for(int i=0; i <= site.max_readpos[s]; ++i) {
+      if (readpos_counts[i] > 0) {
+	if (!first)
+	  out.put(',');
+	out.put_uint(i);
+	out.put(':');
+	out.put_uint(readpos_counts[i]);
+	first=false;
+      }
+    }
+
+    out.put('\t');
+    out.put(strand);
+    out.put('\n');
+  }
+}
+
+// like atoi, for a field that isn't NUL-terminated
+static int parse_int(const char *p, const char *end) {
+  while (p < end && isspace((unsigned char)*p))
+    ++p;
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = (*p == '-');
+    ++p;
+  }
+  int x = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    x = x*10 + (*p++ - '0');
+  return neg ? -x : x;
+}
+
+// add 16 bases (symbols at nuc, qualities, read positions) to site, the
+// same as 16 add_base calls: the counts of each pileup symbol come from
+// a byte compare and a popcount, and the qualities are summed with
+// psadbw; only the read position histograms are filled in a base at a
+// time, through a lookup table rather than pileup_symbol_index's
+// switch. Returns false, adding nothing, if a read start/end marker or
+// a quality past 127 is among them
+static inline bool add_bases16(SiteCounts &site, const char *nuc,
+			       const char *quals, const char *readpos) {
+#ifdef __SSE2__
+  __m128i v = _mm_loadu_si128((const __m128i *)nuc);
+  __m128i q = _mm_loadu_si128((const __m128i *)quals);
+  __m128i markers = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('^')),
+				 _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+  if ((_mm_movemask_epi8(markers) | _mm_movemask_epi8(q)) != 0)
+    return false;
+
+  // counts: a compare and popcount per symbol
+  for (int s=0; s < NUM_PILEUP_SYMBOLS; ++s) {
+    unsigned int n = __builtin_popcount(_mm_movemask_epi8(
+      _mm_cmpeq_epi8(v, _mm_set1_epi8(PILEUP_SYMBOLS[s]))));
+    site.counts[s] += n;
+    if (s >= 2)
+      site.nonref += n;
+  }
+  // read position histograms, a base at a time
+  for (int j=0; j < 16; ++j) {
+    int s = tables.symbol[(unsigned char)nuc[j]];
+    if (s < 0)
+      continue;
+    int rpos = int((unsigned char)readpos[j]) - 33;
+    if (rpos < 0)
+      rpos = 0;
+    ++site.readpos[s][rpos];
+    if (rpos > site.max_readpos[s])
+      site.max_readpos[s] = rpos;
+  }
+
+  __m128i sum = _mm_sad_epu8(q, _mm_setzero_si128());
+  site.qual_sum += (unsigned long)(_mm_cvtsi128_si32(sum) +
+				   _mm_extract_epi16(sum, 4));
+  site.qual_sum -= 16 * 33;
+  __m128i mn = _mm_min_epu8(q, _mm_srli_si128(q, 8));
+  mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+  mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 2));
+  mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 1));
+  int min_qual = (_mm_cvtsi128_si32(mn) & 0xff) - 33;
+  if (min_qual < site.min_qual)
+    site.min_qual = min_qual;
+  site.nreads += 16;
+  return true;
+#else
+  for (int j=0; j < 16; ++j)
+    if (nuc[j] == '^' || nuc[j] == '$')
+      return false;
+  for (int j=0; j < 16; ++j) {
+    int rpos = int((unsigned char)readpos[j]) - 33;
+    site.add_base(site.ref, nuc[j], quals[j], (rpos < 0) ? 0 : rpos,
+		  false, false, false);
+  }
+  return true;
+#endif
+}
+
+void parse_rnapileup_fields(const char *line, size_t len, string &chr,
+			    SiteCounts &site) {
+  // split into the 7 fields in place; missing fields are empty
+  const char *end = line + len;
+  const char *f[7], *fe[7];
+  const char *p = line;
+  for (int k=0; k < 7; ++k) {
+    const char *tab = (const char *)memchr(p, '\t', end - p);
+    f[k] = p;
+    fe[k] = tab ? tab : end;
+    p = tab ? tab + 1 : end;
+  }
+
+  chr.assign(f[0], fe[0] - f[0]);
+  unsigned int pos = parse_int(f[1], fe[1]);
+  char ref = (f[2] < fe[2]) ? *f[2] : '\0';
+  // f[3] (number of reads) is implied by the symbols
+
+  const char *nuc = f[4];
+  const size_t nuc_len = fe[4] - f[4];
+  const char *quals = f[5];
+  const size_t quals_len = fe[5] - f[5];
+  const char *readpos = f[6];
+  const size_t readpos_len = fe[6] - f[6];
+
+  site.reset(pos-1);
+
+  size_t read_idx=0;
+  for(size_t i=0; i < nuc_len; ++i) {
+    // runs of bases without read start/end markers, and with their
+    // qualities and read positions present, go straight through
+    while (i + 16 <= nuc_len && read_idx + 16 <= quals_len &&
+	   read_idx + 16 <= readpos_len &&
+	   add_bases16(site, nuc + i, quals + read_idx, readpos + read_idx)) {
+      i += 16;
+      read_idx += 16;
+    }
+    if (i >= nuc_len)
+      break;
+
+    if (nuc[i] == '^')
+      i += 2; // skip ^ and mapq
+    else if (nuc[i] == '$')
+      i += 1; // skip $
+    if (i >= nuc_len)
+      break;
+    // read position is Sanger encoded
+    int rpos = (read_idx < readpos_len) ?
+      int((unsigned char)readpos[read_idx]) - 33 : 0;
+    char qual = (read_idx < quals_len) ? quals[read_idx] : '!';
+    site.add_base(ref, nuc[i], qual, (rpos < 0) ? 0 : rpos,
+		  false, false, false);
+    ++ read_idx;
+  }
+  site.ref = ref;
+}
+
+void parse_rnapileup_line(const string &line, string &chr, SiteCounts &site) {
+  parse_rnapileup_fields(line.data(), line.size(), chr, site);
+}
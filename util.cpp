@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <cstdio>
 
 #include "hamr.h"
 
@@ -29,6 +30,7 @@ using namespace std;
 // parses a list of command line arguments where each argument is either
 // <value> or --switch or --key=value
 // the first type, positional arguments, go into positional_args
+// (including a lone -, which stands for standard input)
 // the rest go into a map of key=value
 void parse_arguments(const vector<string> &args,
 		     arg_collection &value_args,
@@ -37,7 +39,7 @@ void parse_arguments(const vector<string> &args,
     if (args[i].empty())
       continue;
       
-    if (args[i][0] == '-') {
+    if (args[i][0] == '-' && args[i] != "-") {
       unsigned int equals_at = args[i].find('=');
       string key = args[i].substr(0, equals_at);
       string value = "";
@@ -53,3 +55,33 @@ void parse_arguments(const vector<string> &args,
     }
   }
 }
+
+// split a tab-delimited line into fields
+void split_tabs(const string &line, vector<string> &fields) {
+  fields.clear();
+  size_t start = 0;
+  for (;;) {
+    size_t end = line.find('\t', start);
+    if (end == string::npos) {
+      fields.push_back(line.substr(start));
+      return;
+    }
+    fields.push_back(line.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
+// number of lines in a file (0 if it can't be read)
+unsigned long count_lines(const string &fn) {
+  FILE *in = fopen(fn.c_str(), "rb");
+  if (in == NULL)
+    return 0;
+  unsigned long n = 0;
+  char buf[1 << 16];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+    for (size_t i=0; i < len; ++i)
+      n += (buf[i] == '\n');
+  fclose(in);
+  return n;
+}